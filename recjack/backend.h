@@ -0,0 +1,34 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <jack/jack.h>
+
+#include "engine.h"
+
+#define DEFAULT_PERIOD 256
+#define DEFAULT_OFFLINE_RATE 48000
+#define DEFAULT_OFFLINE_SECONDS 60
+
+/*
+  Audio backend: provides the period buffers and drives engine_process()
+  - open: set up the ports/buffers for nchannels channels
+  - sample_rate: the rate the engine runs at, valid after open
+  - start: start calling engine_process(); a realtime backend returns
+    at once, an offline one returns when its input is exhausted
+  - close: stop and free everything
+*/
+struct backend
+{
+	const char *name;
+	int (*open)(struct backend *bk, unsigned int nchannels);
+	unsigned long (*sample_rate)(struct backend *bk);
+	int (*start)(struct backend *bk, struct engine *e);
+	void (*close)(struct backend *bk);
+	void *priv;
+};
+
+struct backend *backend_jack_new(void);
+struct backend *backend_file_new(const char *source, unsigned long srate,
+				 jack_nframes_t period, double seconds);
+
+#endif // BACKEND_H
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <jack/jack.h>
+
+#include "recjack.h"
+#include "backend.h"
+#include "wave.h"
+#include "convert.h"
+
+#define SOURCE_FILE 0
+#define SOURCE_SILENCE 1
+#define SOURCE_SINE 2
+#define SOURCE_NOISE 3
+
+#define SINE_FREQ 440
+#define SINE_AMPLITUDE 0.5F
+
+/*
+  Offline backend: the input comes from a WAV file or a synthetic
+  signal, and the engine is driven as fast as possible, without any
+  audio server
+*/
+struct file_backend
+{
+	const char *source;
+	char type;
+	unsigned long srate;
+	jack_nframes_t period;
+	size_t frames;
+	size_t pos;
+	unsigned int nchannels;
+	struct wave_map map;
+	unsigned int seed;
+	jack_default_audio_sample_t *bufs;
+	struct period p;
+};
+
+static double elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+	return (double) (t1->tv_sec - t0->tv_sec) + (double) (t1->tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+static int file_open(struct backend *bk, unsigned int nchannels)
+{
+	struct file_backend *f = bk->priv;
+	unsigned int k;
+
+	f->nchannels = nchannels;
+	if (f->type == SOURCE_FILE) {
+		if (wave_map_open(&f->map, f->source) != 0)
+			return -1;
+		f->srate = f->map.srate;
+		f->frames = f->map.frames;
+	}
+
+	// inputs, outputs and metronome, one period each
+	f->bufs = calloc((2 * nchannels + 1) * f->period, sizeof(jack_default_audio_sample_t));
+	if (f->bufs == NULL)
+		return -1;
+	for (k = 0; k < nchannels; k++) {
+		f->p.in[k] = f->bufs + k * f->period;
+		f->p.out[k] = f->bufs + (nchannels + k) * f->period;
+	}
+	f->p.metronome = f->bufs + 2 * nchannels * f->period;
+
+	return 0;
+}
+
+static unsigned long file_sample_rate(struct backend *bk)
+{
+	struct file_backend *f = bk->priv;
+
+	return f->srate;
+}
+
+/*
+  Fill the input buffers with the next n frames of the source,
+  and the rest of the period with silence
+*/
+static void file_fill(struct file_backend *f, jack_nframes_t n)
+{
+	jack_nframes_t i;
+	unsigned int k;
+
+	for (k = 0; k < f->nchannels; k++) {
+		jack_default_audio_sample_t *in = f->p.in[k];
+		if (f->type == SOURCE_FILE && k < f->map.nchannels) {
+			size_t bytes = sample_bytes(f->map.format);
+			samples_to_float(in, f->map.data + (f->pos * f->map.nchannels + k) * bytes, f->map.format,
+					 f->map.nchannels, n);
+		} else if (f->type == SOURCE_SINE) {
+			double omega = 2 * M_PI * SINE_FREQ / (double) f->srate;
+			for (i = 0; i < n; i++)
+				in[i] = (jack_default_audio_sample_t) (SINE_AMPLITUDE * sin((double) (f->pos + i) * omega));
+		} else if (f->type == SOURCE_NOISE) {
+			for (i = 0; i < n; i++)
+				in[i] = (float) rand_r(&f->seed) / (float) RAND_MAX - 0.5F;
+		} else {
+			memset(in, 0, n * sizeof(jack_default_audio_sample_t));
+		}
+		memset(in + n, 0, (f->period - n) * sizeof(jack_default_audio_sample_t));
+	}
+	f->pos += n;
+}
+
+/*
+  Run a whole session without stopping:
+  record the source as one take, then play the take back
+  The time spent in each call of the engine is measured
+*/
+static int file_start(struct backend *bk, struct engine *e)
+{
+	struct file_backend *f = bk->priv;
+	struct timespec t0, t1, start, end;
+	double t, tmin = 1e9, tmax = 0, total = 0;
+	size_t periods = 0;
+	char phase = MODE_PAUSED;
+
+	memset(&f->p.capture_latency, 0, sizeof(jack_latency_range_t));
+	f->pos = 0;
+
+	// start recording, unless the take is punched in
+	if (e->punch_out <= e->punch_in)
+		send_message(&e->to_process, MSG_MODE, 0, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (1) {
+		if (f->pos < f->frames) {
+			size_t n = f->frames - f->pos;
+			file_fill(f, n < f->period ? (jack_nframes_t) n : f->period);
+		} else {
+			file_fill(f, 0);
+			// the source is exhausted, stop recording and play the take back
+			if (phase == MODE_PAUSED && e->mode == MODE_RECORD) {
+				send_message(&e->to_process, MSG_MODE, 0, NULL);
+				phase = MODE_LISTEN;
+			} else if (e->mode == MODE_PAUSED) {
+				break;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		engine_process(e, f->period, &f->p);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		t = elapsed(&t0, &t1);
+		total += t;
+		if (t < tmin)
+			tmin = t;
+		if (t > tmax)
+			tmax = t;
+		periods++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	t = elapsed(&start, &end);
+	printf("offline: %zu periods of %u frames in %.3f s, %.1f times realtime\n",
+	       periods, f->period, t, (double) periods * f->period / (double) f->srate / t);
+	printf("offline: callback min %.2f us, mean %.2f us, max %.2f us (period is %.2f us)\n",
+	       tmin * 1e6, total / (double) periods * 1e6, tmax * 1e6,
+	       (double) f->period / (double) f->srate * 1e6);
+
+	return 0;
+}
+
+static void file_close(struct backend *bk)
+{
+	struct file_backend *f = bk->priv;
+
+	if (f->type == SOURCE_FILE)
+		wave_map_close(&f->map);
+	free(f->bufs);
+	free(f);
+	free(bk);
+}
+
+/*
+  source is either the name of a WAV file, or one of silence, sine
+  and noise, in which case it lasts for seconds at srate
+*/
+struct backend *backend_file_new(const char *source, unsigned long srate,
+				 jack_nframes_t period, double seconds)
+{
+	struct backend *bk = malloc(sizeof(struct backend));
+	struct file_backend *f = malloc(sizeof(struct file_backend));
+
+	memset(bk, 0, sizeof(struct backend));
+	memset(f, 0, sizeof(struct file_backend));
+	f->source = source;
+	f->srate = srate;
+	f->period = period;
+	f->frames = (size_t) (seconds * (double) srate);
+	f->seed = 1;
+	if (strcmp(source, "silence") == 0)
+		f->type = SOURCE_SILENCE;
+	else if (strcmp(source, "sine") == 0)
+		f->type = SOURCE_SINE;
+	else if (strcmp(source, "noise") == 0)
+		f->type = SOURCE_NOISE;
+	else
+		f->type = SOURCE_FILE;
+
+	bk->name = "file";
+	bk->open = file_open;
+	bk->sample_rate = file_sample_rate;
+	bk->start = file_start;
+	bk->close = file_close;
+	bk->priv = f;
+
+	return bk;
+}
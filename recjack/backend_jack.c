@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jack/jack.h>
+
+#include "recjack.h"
+#include "backend.h"
+#include "stats.h"
+
+struct jack_backend
+{
+	jack_client_t *client;
+	unsigned int nchannels;
+	jack_port_t *input_ports[MAX_CHANNELS];
+	jack_port_t *output_ports[MAX_CHANNELS];
+	jack_port_t *metronome_port;
+	struct engine *e;
+};
+
+/*
+  Connect port to available physical ports
+  If n = 0, connect to all ports
+  Otherwise, connect to n ports, starting at the first-th one
+*/
+static void connect_physical(struct jack_backend *j, jack_port_t *port, unsigned long flags,
+			     unsigned int first, unsigned int n)
+{
+	unsigned int i;
+
+	const char **ports = jack_get_ports(j->client, NULL, NULL, JackPortIsPhysical|flags);
+	if (ports == NULL) {
+		fprintf(stderr, "no physical port found\n");
+		exit(1);
+	}
+
+	for (i = 0; ports[i] != NULL && (n == 0 || i < first + n); i++) {
+		if (n != 0 && i < first)
+			continue;
+		if (flags & JackPortIsInput) {
+			if (jack_connect(j->client, jack_port_name(port), ports[i]))
+				fprintf(stderr, "cannot connect physical port\n");
+		} else if (flags & JackPortIsOutput) {
+			if (jack_connect(j->client, ports[i], jack_port_name(port)))
+				fprintf(stderr, "cannot connect physical port\n");
+		}
+	}
+
+	free(ports);
+}
+
+/*
+  JACK callback function
+  If JACK exits, stop running.
+*/
+static void jack_shutdown(void *arg __attribute__((__unused__)))
+{
+	exit(1);
+}
+
+/*
+  JACK callback function
+  Count the xruns reported by the server
+*/
+static int jack_xrun(void *arg)
+{
+	struct jack_backend *j = (struct jack_backend *) arg;
+
+	if (j->e->stats != NULL)
+		stats_count(&j->e->stats->xruns);
+	return 0;
+}
+
+/*
+  Read the transport state and position, jack_transport_query() is
+  realtime safe
+  The BBT fields are only there if a timebase master provides them
+*/
+static void query_transport(struct jack_backend *j, struct transport *t)
+{
+	jack_position_t pos;
+
+	t->rolling = jack_transport_query(j->client, &pos) == JackTransportRolling;
+	t->frame = pos.frame;
+	t->bbt = (pos.valid & JackPositionBBT) && pos.beats_per_minute > 0 && pos.ticks_per_beat > 0;
+	if (t->bbt) {
+		t->bpm = pos.beats_per_minute;
+		t->beats_per_bar = (unsigned int) pos.beats_per_bar;
+		t->beat = pos.beat > 0 ? (unsigned int) (pos.beat - 1) : 0;
+		t->beat_fraction = pos.tick / pos.ticks_per_beat;
+		// ticks are whole numbers
+		t->resolution = 1 / pos.ticks_per_beat;
+	}
+}
+
+/*
+  JACK callback function
+  Collect the port buffers and hand them to the engine
+*/
+static int jack_process(jack_nframes_t nframes, void *arg)
+{
+	struct jack_backend *j = (struct jack_backend *) arg;
+	struct period p;
+	struct transport t;
+	unsigned int k;
+
+	for (k = 0; k < j->nchannels; k++) {
+		p.in[k] = jack_port_get_buffer(j->input_ports[k], nframes);
+		p.out[k] = jack_port_get_buffer(j->output_ports[k], nframes);
+	}
+	p.metronome = jack_port_get_buffer(j->metronome_port, nframes);
+	jack_port_get_latency_range(j->input_ports[0], JackCaptureLatency, &p.capture_latency);
+	p.transport = NULL;
+	if (j->e->follow_transport) {
+		query_transport(j, &t);
+		p.transport = &t;
+	}
+
+	return engine_process(j->e, nframes, &p);
+}
+
+/*
+  Setup JACK
+*/
+static int jack_open(struct backend *bk, unsigned int nchannels)
+{
+	struct jack_backend *j = bk->priv;
+	const char *client_name = "recjack";
+	jack_status_t status;
+
+	j->nchannels = nchannels;
+	j->client = jack_client_open(client_name, JackNullOption, &status);
+	if (j->client == NULL) {
+		fprintf(stderr, "jack_client_open failed, status = 0x%2.0x\n", status);
+		if (status & JackServerFailed)
+			fprintf(stderr, "Unable to connect to JACK server\n");
+		return -1;
+	}
+
+	if (status & JackServerStarted)
+		fprintf(stderr, "JACK server started\n");
+	if (status & JackNameNotUnique) {
+		client_name = jack_get_client_name(j->client);
+		fprintf(stderr, "unique name '%s' assigned\n", client_name);
+	}
+
+	// create an input port (recording) and an output port (playback) per channel,
+	// and an output port for the metronome
+	// in mono, the ports are simply called input and output
+	unsigned int k;
+	for (k = 0; k < nchannels; k++) {
+		char name[16];
+		if (nchannels == 1)
+			snprintf(name, sizeof(name), "input");
+		else
+			snprintf(name, sizeof(name), "input_%u", k + 1);
+		j->input_ports[k] = jack_port_register(j->client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+		if (nchannels == 1)
+			snprintf(name, sizeof(name), "output");
+		else
+			snprintf(name, sizeof(name), "output_%u", k + 1);
+		j->output_ports[k] = jack_port_register(j->client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+		if ((j->input_ports[k] == NULL) || (j->output_ports[k] == NULL)) {
+			fprintf(stderr, "no more JACK ports available\n");
+			return -1;
+		}
+	}
+	j->metronome_port = jack_port_register(j->client, "metronome", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+
+	if (j->metronome_port == NULL) {
+		fprintf(stderr, "no more JACK ports available\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static unsigned long jack_sample_rate(struct backend *bk)
+{
+	struct jack_backend *j = bk->priv;
+
+	return jack_get_sample_rate(j->client);
+}
+
+/*
+  Activate the client and connect the ports
+*/
+static int jack_start(struct backend *bk, struct engine *e)
+{
+	struct jack_backend *j = bk->priv;
+
+	j->e = e;
+	jack_set_process_callback(j->client, jack_process, (void *) j);
+	jack_set_xrun_callback(j->client, jack_xrun, (void *) j);
+	jack_on_shutdown(j->client, jack_shutdown, 0);
+
+	if (jack_activate(j->client)) {
+		fprintf(stderr, "cannot activate client\n");
+		return -1;
+	}
+
+	if (j->nchannels == 1) {
+		// connect the first physical input port to the input port
+		connect_physical(j, j->input_ports[0], JackPortIsOutput, 0, 1);
+
+		// connect the output port to all physical outputs
+		connect_physical(j, j->output_ports[0], JackPortIsInput, 0, 0);
+	} else {
+		// connect each channel to the matching physical input and output
+		unsigned int k;
+		for (k = 0; k < j->nchannels; k++) {
+			connect_physical(j, j->input_ports[k], JackPortIsOutput, k, 1);
+			connect_physical(j, j->output_ports[k], JackPortIsInput, k, 1);
+		}
+	}
+	// the metronome stays connected, it is muted in the callback
+	connect_physical(j, j->metronome_port, JackPortIsInput, 0, 0);
+
+	jack_port_get_latency_range(j->input_ports[0], JackCaptureLatency, &e->input_latency_range);
+	//printf("Input latency range: %d-%d\n", e->input_latency_range.min, e->input_latency_range.max);
+	jack_latency_range_t range;
+	jack_port_get_latency_range(j->output_ports[0], JackPlaybackLatency, &range);
+	//printf("Output latency: %d-%d\n", range.min, range.max);
+	jack_port_get_latency_range(j->metronome_port, JackPlaybackLatency, &range);
+	//printf("Metronome latency: %d-%d\n", range.min, range.max);
+
+	return 0;
+}
+
+static void jack_close(struct backend *bk)
+{
+	struct jack_backend *j = bk->priv;
+
+	if (j->client != NULL)
+		jack_client_close(j->client);
+	free(j);
+	free(bk);
+}
+
+struct backend *backend_jack_new(void)
+{
+	struct backend *bk = malloc(sizeof(struct backend));
+	struct jack_backend *j = malloc(sizeof(struct jack_backend));
+
+	memset(bk, 0, sizeof(struct backend));
+	memset(j, 0, sizeof(struct jack_backend));
+	bk->name = "jack";
+	bk->open = jack_open;
+	bk->sample_rate = jack_sample_rate;
+	bk->start = jack_start;
+	bk->close = jack_close;
+	bk->priv = j;
+
+	return bk;
+}
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <jack/jack.h>
+
+#include "convert.h"
+
+#define BENCH_SAMPLES (1 << 20)
+#define BENCH_ROUNDS 200
+#define BENCH_PERIOD 4096
+
+struct kernel
+{
+	const char *name;
+	convert_kernel_t fn;
+	int supported;
+};
+
+struct pack
+{
+	const char *name;
+	pack24_kernel_t fn;
+	int supported;
+};
+
+struct meter
+{
+	const char *name;
+	level_kernel_t fn;
+	int supported;
+};
+
+struct extent
+{
+	const char *name;
+	range_kernel_t fn;
+	int supported;
+};
+
+struct product
+{
+	const char *name;
+	dot_kernel_t fn;
+	int supported;
+};
+
+struct mix
+{
+	const char *name;
+	mix_kernel_t fn;
+	int supported;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/*
+  Check a kernel against the scalar reference, with and without dither,
+  on every length up to 64 to cover the tails of the vector loops
+*/
+static int check(struct kernel *k, const jack_default_audio_sample_t *src, const float *noise,
+		 int16_t *ref, int16_t *out)
+{
+	size_t len, i;
+
+	for (len = 0; len <= BENCH_SAMPLES; len = len < 64 ? len + 1 : BENCH_SAMPLES) {
+		for (i = 0; i < 2; i++) {
+			const float *nz = i == 0 ? NULL : noise;
+			convert_scalar(ref, src, nz, len);
+			k->fn(out, src, nz, len);
+			if (memcmp(ref, out, len * sizeof(int16_t)) != 0) {
+				fprintf(stderr, "%s: mismatch with the scalar kernel (%zu samples%s)\n",
+					k->name, len, nz != NULL ? ", dither" : "");
+				return -1;
+			}
+		}
+		if (len == BENCH_SAMPLES)
+			break;
+	}
+	return 0;
+}
+
+/*
+  Check a 24-bit kernel against the scalar reference on every length up
+  to 64, the vector stores overlap so nothing past the end may be written
+*/
+static int check_pack(struct pack *p, const jack_default_audio_sample_t *src, uint8_t *ref, uint8_t *out)
+{
+	size_t len;
+
+	for (len = 0; len <= 64; len++) {
+		memset(ref, 0x55, 3 * len + 32);
+		memset(out, 0x55, 3 * len + 32);
+		pack24_scalar(ref, src, len);
+		p->fn(out, src, len);
+		if (memcmp(ref, out, 3 * len + 32) != 0) {
+			fprintf(stderr, "%s: mismatch with the scalar 24-bit kernel (%zu samples)\n", p->name, len);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+  Check a level kernel against the scalar reference on every length up
+  to 64 and on the largest JACK period: same peak and clips, the energy
+  only differs by rounding
+*/
+static int check_level(struct meter *m, const jack_default_audio_sample_t *src)
+{
+	size_t len;
+
+	for (len = 0; len <= BENCH_PERIOD; len = len < 64 ? len + 1 : BENCH_PERIOD) {
+		struct level ref = {0.5F, 1.0F, 1}, out = ref;
+		level_scalar(&ref, src, len);
+		m->fn(&out, src, len);
+		if (ref.peak != out.peak || ref.clips != out.clips
+		    || fabsf(ref.energy - out.energy) > 1e-4F * ref.energy) {
+			fprintf(stderr, "%s: mismatch with the scalar level (%zu samples)\n", m->name, len);
+			return -1;
+		}
+		if (len == BENCH_PERIOD)
+			break;
+	}
+	return 0;
+}
+
+/*
+  Check a range kernel like a level kernel: same min and max, the energy
+  only differs by rounding
+*/
+static int check_range(struct extent *x, const jack_default_audio_sample_t *src)
+{
+	size_t len;
+
+	for (len = 0; len <= BENCH_PERIOD; len = len < 64 ? len + 1 : BENCH_PERIOD) {
+		struct range ref = {0.1F, 0.2F, 1.0F}, out = ref;
+		range_scalar(&ref, src, len);
+		x->fn(&out, src, len);
+		if (ref.min != out.min || ref.max != out.max
+		    || fabsf(ref.energy - out.energy) > 1e-4F * ref.energy) {
+			fprintf(stderr, "%s: mismatch with the scalar range (%zu samples)\n", x->name, len);
+			return -1;
+		}
+		if (len == BENCH_PERIOD)
+			break;
+	}
+	return 0;
+}
+
+/*
+  Check a dot product kernel on every length up to 64 and on a
+  correlation window: the sums only differ by rounding
+*/
+static int check_dot(struct product *d, const jack_default_audio_sample_t *src)
+{
+	size_t len;
+
+	for (len = 0; len <= BENCH_PERIOD; len = len < 64 ? len + 1 : BENCH_PERIOD) {
+		float ref = dot_scalar(src, src + 1, len), out = d->fn(src, src + 1, len);
+		float scale = dot_scalar(src, src, len);
+		if (fabsf(ref - out) > 1e-4F * scale) {
+			fprintf(stderr, "%s: mismatch with the scalar dot product (%zu samples)\n", d->name, len);
+			return -1;
+		}
+		if (len == BENCH_PERIOD)
+			break;
+	}
+	return 0;
+}
+
+/*
+  Check a mix kernel against the scalar reference, on every length up
+  to 64 and at a few offsets, the layers of a loop aren't aligned
+*/
+static int check_mix(struct mix *m, const jack_default_audio_sample_t *src, float *ref, float *out)
+{
+	size_t len, off;
+
+	for (off = 0; off < 4; off++) {
+		for (len = 0; len <= 64; len++) {
+			memcpy(ref, src + 1, (len + off) * sizeof(float));
+			memcpy(out, src + 1, (len + off) * sizeof(float));
+			mix_scalar(ref + off, src, 0.7F, len);
+			m->fn(out + off, src, 0.7F, len);
+			if (memcmp(ref, out, (len + off) * sizeof(float)) != 0) {
+				fprintf(stderr, "%s: mismatch with the scalar mix (%zu samples at %zu)\n", m->name, len, off);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+  Convert a buffer of random samples, a tenth of them out of [-1, 1],
+  with every kernel the CPU supports, to 16 and 24 bits, measure its
+  levels and range, correlate it with itself, then mix it into another one
+*/
+int main(void)
+{
+	jack_default_audio_sample_t *src = malloc(BENCH_SAMPLES * sizeof(jack_default_audio_sample_t));
+	float *noise = malloc(BENCH_SAMPLES * sizeof(float));
+	int16_t *ref = malloc(BENCH_SAMPLES * sizeof(int16_t));
+	int16_t *out = malloc(BENCH_SAMPLES * sizeof(int16_t));
+	struct kernel kernels[] = {
+		{"scalar", convert_scalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", convert_sse2, __builtin_cpu_supports("sse2")},
+		{"avx2", convert_avx2, __builtin_cpu_supports("avx2")},
+#endif
+	};
+	struct pack packs[] = {
+		{"scalar", pack24_scalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+		{"ssse3", pack24_ssse3, __builtin_cpu_supports("ssse3")},
+		{"avx2", pack24_avx2, __builtin_cpu_supports("avx2")},
+#endif
+	};
+	struct meter meters[] = {
+		{"scalar", level_scalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", level_sse2, __builtin_cpu_supports("sse2")},
+		{"avx2", level_avx2, __builtin_cpu_supports("avx2")},
+#endif
+	};
+	struct extent extents[] = {
+		{"scalar", range_scalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", range_sse2, __builtin_cpu_supports("sse2")},
+		{"avx2", range_avx2, __builtin_cpu_supports("avx2")},
+#endif
+	};
+	struct product products[] = {
+		{"scalar", dot_scalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", dot_sse2, __builtin_cpu_supports("sse2")},
+		{"avx2", dot_avx2, __builtin_cpu_supports("avx2")},
+#endif
+	};
+	struct mix mixes[] = {
+		{"scalar", mix_scalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", mix_sse2, __builtin_cpu_supports("sse2")},
+		{"avx2", mix_avx2, __builtin_cpu_supports("avx2")},
+#endif
+	};
+	uint8_t *pcm24 = malloc(3 * BENCH_SAMPLES + 32);
+	uint8_t *pcm24_ref = malloc(3 * BENCH_SAMPLES + 32);
+	float *acc = malloc(BENCH_SAMPLES * sizeof(float));
+	float *acc_ref = malloc(BENCH_SAMPLES * sizeof(float));
+	unsigned int seed = 1;
+	size_t i, k;
+	int ret = 0;
+
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		src[i] = 2.2F * ((float) rand_r(&seed) / (float) RAND_MAX - 0.5F);
+		noise[i] = (float) rand_r(&seed) / (float) RAND_MAX - (float) rand_r(&seed) / (float) RAND_MAX;
+	}
+	// exact edges
+	src[0] = 1.0F;
+	src[1] = -1.0F;
+	src[2] = 0.0F;
+
+	printf("dispatch: %s\n", convert_init(0));
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		struct kernel *kn = &kernels[k];
+		double t;
+		int r;
+
+		if (!kn->supported) {
+			printf("%-8s not supported by this CPU\n", kn->name);
+			continue;
+		}
+		if (check(kn, src, noise, ref, out) != 0) {
+			ret = 1;
+			continue;
+		}
+
+		t = now();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+			kn->fn(out, src, NULL, BENCH_SAMPLES);
+		t = now() - t;
+		printf("%-8s bit-exact, %8.1f Msamples/s, %6.3f ns/sample\n", kn->name,
+		       BENCH_ROUNDS * (double) BENCH_SAMPLES / t * 1e-6,
+		       t * 1e9 / (BENCH_ROUNDS * (double) BENCH_SAMPLES));
+	}
+
+	for (k = 0; k < sizeof(packs) / sizeof(packs[0]); k++) {
+		struct pack *p = &packs[k];
+		double t;
+		int r;
+
+		if (!p->supported)
+			continue;
+		if (check_pack(p, src, pcm24_ref, pcm24) != 0) {
+			ret = 1;
+			continue;
+		}
+
+		t = now();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+			p->fn(pcm24, src, BENCH_SAMPLES);
+		t = now() - t;
+		pack24_scalar(pcm24_ref, src, BENCH_SAMPLES);
+		if (memcmp(pcm24_ref, pcm24, 3 * BENCH_SAMPLES) != 0) {
+			fprintf(stderr, "%s: mismatch with the scalar 24-bit kernel\n", p->name);
+			ret = 1;
+			continue;
+		}
+		printf("s24 %-6s bit-exact, %8.1f Msamples/s, %6.3f ns/sample\n", p->name,
+		       BENCH_ROUNDS * (double) BENCH_SAMPLES / t * 1e-6,
+		       t * 1e9 / (BENCH_ROUNDS * (double) BENCH_SAMPLES));
+	}
+
+	for (k = 0; k < sizeof(meters) / sizeof(meters[0]); k++) {
+		struct meter *m = &meters[k];
+		struct level l = {0, 0, 0};
+		double t;
+		int r;
+
+		if (!m->supported)
+			continue;
+		if (check_level(m, src) != 0) {
+			ret = 1;
+			continue;
+		}
+
+		t = now();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+			m->fn(&l, src, BENCH_SAMPLES);
+		t = now() - t;
+		printf("lvl %-6s peak/clips exact, %8.1f Msamples/s, %6.3f ns/sample (%u clipped)\n", m->name,
+		       BENCH_ROUNDS * (double) BENCH_SAMPLES / t * 1e-6,
+		       t * 1e9 / (BENCH_ROUNDS * (double) BENCH_SAMPLES), l.clips / BENCH_ROUNDS);
+	}
+
+	for (k = 0; k < sizeof(extents) / sizeof(extents[0]); k++) {
+		struct extent *x = &extents[k];
+		struct range rg = {0, 0, 0};
+		double t;
+		int r;
+
+		if (!x->supported)
+			continue;
+		if (check_range(x, src) != 0) {
+			ret = 1;
+			continue;
+		}
+
+		t = now();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+			x->fn(&rg, src, BENCH_SAMPLES);
+		t = now() - t;
+		printf("rng %-6s min/max exact, %8.1f Msamples/s, %6.3f ns/sample\n", x->name,
+		       BENCH_ROUNDS * (double) BENCH_SAMPLES / t * 1e-6,
+		       t * 1e9 / (BENCH_ROUNDS * (double) BENCH_SAMPLES));
+	}
+
+	for (k = 0; k < sizeof(products) / sizeof(products[0]); k++) {
+		struct product *d = &products[k];
+		volatile float sum = 0;
+		double t;
+		int r;
+
+		if (!d->supported)
+			continue;
+		if (check_dot(d, src) != 0) {
+			ret = 1;
+			continue;
+		}
+
+		t = now();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+			sum += d->fn(src, src + 1, BENCH_SAMPLES - 1);
+		t = now() - t;
+		printf("dot %-6s rounding only, %8.1f Msamples/s, %6.3f ns/sample\n", d->name,
+		       BENCH_ROUNDS * (double) BENCH_SAMPLES / t * 1e-6,
+		       t * 1e9 / (BENCH_ROUNDS * (double) BENCH_SAMPLES));
+	}
+
+	for (k = 0; k < sizeof(mixes) / sizeof(mixes[0]); k++) {
+		struct mix *m = &mixes[k];
+		double t;
+		int r;
+
+		if (!m->supported)
+			continue;
+		if (check_mix(m, src, acc_ref, acc) != 0) {
+			ret = 1;
+			continue;
+		}
+
+		memset(acc, 0, BENCH_SAMPLES * sizeof(float));
+		t = now();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+			m->fn(acc, src, 0.5F, BENCH_SAMPLES);
+		t = now() - t;
+		printf("mix %-6s bit-exact, %8.1f Msamples/s, %6.3f ns/sample\n", m->name,
+		       BENCH_ROUNDS * (double) BENCH_SAMPLES / t * 1e-6,
+		       t * 1e9 / (BENCH_ROUNDS * (double) BENCH_SAMPLES));
+	}
+
+	free(src);
+	free(noise);
+	free(acc);
+	free(acc_ref);
+	free(pcm24);
+	free(pcm24_ref);
+	free(ref);
+	free(out);
+	return ret;
+}
@@ -0,0 +1,517 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <jack/jack.h>
+
+#include "recjack.h"
+#include "metronome.h"
+#include "wave.h"
+#include "convert.h"
+#include "flac.h"
+#include "engine.h"
+#include "meter.h"
+#include "peaks.h"
+#include "stretch.h"
+#include "memory.h"
+
+#define BENCH_SRATE 48000
+#define BENCH_FRAMES (1 << 23)
+#define BENCH_ARENA_MB 160
+#define BENCH_TAKE_MB 2048
+#define BENCH_BLOCK_FRAMES (1 << 22)
+#define BENCH_CLICK_ROUNDS 20
+#define BENCH_HEADER_ROUNDS 100000
+#define BENCH_OVERVIEW_ROUNDS 1000
+#define BENCH_STRETCH_FRAMES (1 << 20)
+#define BENCH_STRETCH_PERIOD 256
+#define BENCH_MAPPED_SECONDS 20
+#define BENCH_MAPPED_PERIOD 256
+// mapped takes are played this many times faster than real time
+#define BENCH_MAPPED_SPEEDUP 4
+
+/*
+  Micro-benchmarks of the hot paths, run without any audio server
+  Results are printed as a JSON array, one object per measurement:
+  {"bench": ..., "params": ..., "ns_per_frame": ..., "bytes_per_s": ...}
+*/
+
+static int first_result = 1;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/*
+  Print one measurement: count frames (or calls) and bytes processed in t seconds
+*/
+static void result(const char *bench, const char *params, const char *unit, double count,
+		   double bytes, double t)
+{
+	printf("%s\n  {\"bench\": \"%s\", \"params\": {%s}, \"ns_per_%s\": %.4f, \"bytes_per_s\": %.0f}",
+	       first_result ? "[" : ",", bench, params, unit, t * 1e9 / count, bytes / t);
+	first_result = 0;
+}
+
+// the benchmark never streams, but stream.o needs a file name generator
+char *make_filename(const char *tag, const char *ext)
+{
+	char *filename = malloc(strlen(tag) + 1 + strlen(ext) + 1);
+
+	sprintf(filename, "%s.%s", tag, ext);
+	return filename;
+}
+
+/*
+  Run the engine for BENCH_FRAMES frames, one period at a time
+*/
+static double run_engine(struct engine *e, struct period *p, jack_nframes_t period)
+{
+	size_t done;
+	double t = now();
+
+	for (done = 0; done < BENCH_FRAMES; done += period)
+		engine_process(e, period, p);
+	return now() - t;
+}
+
+/*
+  Stretched playback: the engine waits for the worker before each period
+  Returns the CPU time of the worker, the cost of a stretched take
+*/
+static double run_stretch(struct engine *e, struct period *p, jack_nframes_t period)
+{
+	struct stretch *s = e->stretch;
+	size_t frame = e->nchannels * sizeof(jack_default_audio_sample_t);
+	size_t done;
+	struct timespec t0, t1;
+	clockid_t worker;
+
+	if (pthread_getcpuclockid(s->thread, &worker) != 0)
+		return 0;
+	clock_gettime(worker, &t0);
+	for (done = 0; done < BENCH_STRETCH_FRAMES && e->mode == MODE_LISTEN; done += period) {
+		engine_process(e, period, p);
+		while (e->stretching && (s->flushing ? atomic_load(&s->acked) != atomic_load(&s->requested)
+					 : ringbuffer_read_space(&s->output) < period * frame))
+			sched_yield();
+	}
+	clock_gettime(worker, &t1);
+	return (double) (t1.tv_sec - t0.tv_sec) + (double) (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+}
+
+/*
+  Record path: append every period to the take, index and meter it, at
+  several period sizes
+  Overview: levels of the whole take in OVERVIEW_WIDTH columns, from the index
+  Playback path: read the take back
+  Stretch: play the take slower and faster, the time is the worker's
+  Metronome: fill the click port while waiting
+*/
+static void bench_engine(struct arena *a, unsigned int nchannels, jack_default_audio_sample_t *in,
+			 jack_default_audio_sample_t *out)
+{
+	static const jack_nframes_t periods[] = {16, 64, 256, 1024, 4096};
+	jack_default_audio_sample_t metronome[4096];
+	struct buffer b;
+	struct engine e;
+	struct meter meter;
+	struct peaks peaks;
+	struct range levels[MAX_CHANNELS];
+	struct period p;
+	struct stretch stretch;
+	struct beep *beep;
+	char params[128];
+	size_t i;
+	unsigned int k;
+	double t, bytes = (double) BENCH_FRAMES * nchannels * sizeof(jack_default_audio_sample_t);
+
+	buffer_init(&b, a, nchannels);
+	b.srate = BENCH_SRATE;
+	memset(&peaks, 0, sizeof(peaks));
+	if (peaks_alloc(&peaks, nchannels, a->nchunks * b.chunk_frames) == 0)
+		b.peaks = &peaks;
+	engine_init(&e, &b, nchannels);
+	meter_init(&meter, nchannels);
+	e.meter = &meter;
+	for (k = 0; k < nchannels; k++) {
+		p.in[k] = in + k * 4096;
+		p.out[k] = out + k * 4096;
+	}
+	p.metronome = metronome;
+	memset(&p.capture_latency, 0, sizeof(p.capture_latency));
+	p.transport = NULL;
+
+	for (i = 0; i < sizeof(periods) / sizeof(periods[0]); i++) {
+		snprintf(params, sizeof(params), "\"period\": %u, \"channels\": %u", periods[i], nchannels);
+
+		buffer_reset(&b);
+		peaks_reset(&peaks);
+		e.mode = MODE_RECORD;
+		t = run_engine(&e, &p, periods[i]);
+		if (b.dropped > 0)
+			fprintf(stderr, "record: %zu frames dropped, the arena is too small\n", b.dropped);
+		result("record", params, "frame", BENCH_FRAMES, bytes, t);
+
+		if (b.peaks != NULL) {
+			int r, col;
+			t = now();
+			for (r = 0; r < BENCH_OVERVIEW_ROUNDS; r++)
+				for (col = 0; col < OVERVIEW_WIDTH; col++)
+					peaks_get(&peaks, b.frames * (size_t) col / OVERVIEW_WIDTH,
+						  b.frames * (size_t) (col + 1) / OVERVIEW_WIDTH, levels);
+			t = now() - t;
+			result("overview", params, "call", BENCH_OVERVIEW_ROUNDS, 0, t);
+		}
+
+		buffer_rewind(&b, 0);
+		e.mode = MODE_LISTEN;
+		t = run_engine(&e, &p, periods[i]);
+		result("playback", params, "frame", BENCH_FRAMES, bytes, t);
+	}
+
+	if (stretch_start(&stretch, nchannels) == 0) {
+		static const unsigned int speeds[] = {50, 75, 125, 150};
+		e.stretch = &stretch;
+		for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+			snprintf(params, sizeof(params), "\"period\": %u, \"channels\": %u, \"speed\": %u",
+				 BENCH_STRETCH_PERIOD, nchannels, speeds[i]);
+			buffer_rewind(&b, 0);
+			engine_speed(&e, speeds[i]);
+			e.mode = MODE_LISTEN;
+			t = run_stretch(&e, &p, BENCH_STRETCH_PERIOD);
+			result("stretch", params, "frame", BENCH_STRETCH_FRAMES,
+			       (double) BENCH_STRETCH_FRAMES * nchannels * sizeof(jack_default_audio_sample_t), t);
+		}
+		e.stretch = NULL;
+		e.stretching = 0;
+		stretch_stop(&stretch);
+	}
+
+	// plain beats, then a fractional tempo with accents and subdivisions
+	beep = generate_beep(BENCH_SRATE, 440, 0.5F, 10);
+	metronome_init(&e.metronome, beep);
+	for (i = 0; i < 2 * sizeof(periods) / sizeof(periods[0]); i++) {
+		jack_nframes_t period = periods[i % (sizeof(periods) / sizeof(periods[0]))];
+		struct tempo tempo;
+		tempo_init(&tempo, 120);
+		if (i >= sizeof(periods) / sizeof(periods[0])) {
+			tempo.bpm = 133.3;
+			tempo.beats_per_bar = 7;
+			tempo.subdivisions = 4;
+		}
+		metronome_set(&e.metronome, &tempo);
+		snprintf(params, sizeof(params), "\"period\": %u, \"channels\": %u, \"bpm\": %g, \"subdivisions\": %u",
+			 period, nchannels, tempo.bpm, tempo.subdivisions);
+		e.mode = MODE_PAUSED;
+		t = run_engine(&e, &p, period);
+		result("metronome", params, "frame", BENCH_FRAMES,
+		       BENCH_FRAMES * sizeof(jack_default_audio_sample_t), t);
+	}
+
+	buffer_reset(&b);
+	engine_destroy(&e);
+	peaks_free(&peaks);
+	free_beep(beep);
+}
+
+/*
+  Beep wavetables, once per sample rate
+  Changing the tempo allocates nothing, only the wavetables cost anything
+*/
+static void bench_click(void)
+{
+	static const unsigned long srates[] = {44100, 48000, 96000, 192000};
+	char params[128];
+	size_t j;
+	int r;
+
+	for (j = 0; j < sizeof(srates) / sizeof(srates[0]); j++) {
+		struct beep *beep = NULL;
+		jack_nframes_t size = 0;
+		double t = now();
+		for (r = 0; r < BENCH_CLICK_ROUNDS; r++) {
+			free_beep(beep);
+			beep = generate_beep(srates[j], 440, 0.5F, 10);
+			size = beep->size;
+		}
+		t = now() - t;
+		free_beep(beep);
+		snprintf(params, sizeof(params), "\"srate\": %lu", srates[j]);
+		// three wavetables per beep
+		result("generate_beep", params, "frame", 3.0 * size * BENCH_CLICK_ROUNDS,
+		       3.0 * size * BENCH_CLICK_ROUNDS * sizeof(jack_default_audio_sample_t), t);
+	}
+}
+
+/*
+  WAV writing over a take of take_mb MB of samples
+  The samples are written from one block over and over, so that the
+  take doesn't need to fit in memory
+*/
+static int bench_write(int fd, size_t take_mb, jack_default_audio_sample_t *block)
+{
+	size_t frames = (take_mb << 20) / sizeof(jack_default_audio_sample_t);
+	size_t done, len;
+	char params[128];
+	double t;
+	int r;
+
+	snprintf(params, sizeof(params), "\"take_frames\": %zu", frames);
+
+	t = now();
+	for (r = 0; r < BENCH_HEADER_ROUNDS; r++) {
+		if (lseek(fd, 0, SEEK_SET) != 0 || write_wave_header(fd, BENCH_SRATE, 1, frames) != HEADER_LENGTH) {
+			perror("write_wave_header");
+			return -1;
+		}
+	}
+	t = now() - t;
+	result("write_wave_header", params, "call", BENCH_HEADER_ROUNDS, BENCH_HEADER_ROUNDS * HEADER_LENGTH, t);
+
+	t = now();
+	for (done = 0; done < frames; done += len) {
+		len = frames - done < BENCH_BLOCK_FRAMES ? frames - done : BENCH_BLOCK_FRAMES;
+		if (write_wave_samples(fd, len, (char *) block) != 0)
+			return -1;
+	}
+	if (fdatasync(fd) != 0)
+		perror("fdatasync");
+	t = now() - t;
+	result("write_wave_samples", params, "frame", (double) frames, (double) frames * sizeof(int16_t), t);
+	return 0;
+}
+
+/*
+  Export a recorded take through the mapped file at each depth, then as FLAC
+*/
+static int bench_save(int fd, struct arena *a, jack_default_audio_sample_t *in)
+{
+	jack_default_audio_sample_t *src[MAX_CHANNELS];
+	struct buffer b;
+	enum sample_format format;
+	char params[128];
+	size_t done, bytes;
+	long ncpus;
+	double t;
+
+	buffer_init(&b, a, 2);
+	b.srate = BENCH_SRATE;
+	src[0] = in;
+	src[1] = in + 4096;
+	for (done = 0; done < BENCH_FRAMES; done += 4096)
+		buffer_append(&b, src, 0, 4096);
+
+	// every sample format
+	for (format = SAMPLE_S16; format <= SAMPLE_F32; format++) {
+		if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+			perror("ftruncate");
+			return -1;
+		}
+		t = now();
+		if (save_wave(fd, &b, format) != 0)
+			return -1;
+		if (fdatasync(fd) != 0)
+			perror("fdatasync");
+		t = now() - t;
+		snprintf(params, sizeof(params), "\"take_frames\": %zu, \"channels\": 2, \"depth\": %zu",
+			 b.frames, 8 * sample_bytes(format));
+		result("save_wave", params, "frame", (double) b.frames,
+		       (double) b.frames * 2 * (double) sample_bytes(format), t);
+	}
+
+	// the same take as FLAC, on every core
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+		perror("ftruncate");
+		return -1;
+	}
+	t = now();
+	if (save_flac(fd, &b, (unsigned int) ncpus, &bytes) != 0)
+		return -1;
+	if (fdatasync(fd) != 0)
+		perror("fdatasync");
+	t = now() - t;
+	snprintf(params, sizeof(params), "\"take_frames\": %zu, \"channels\": 2, \"threads\": %ld, \"ratio\": %.3f",
+		 b.frames, ncpus, (double) bytes / (double) (b.frames * 2 * sizeof(int16_t)));
+	result("save_flac", params, "frame", (double) b.frames, (double) b.frames * 2 * sizeof(int16_t), t);
+
+	buffer_reset(&b);
+	return 0;
+}
+
+// what the main loop does while a mapped take is played
+struct read_ahead
+{
+	const struct wave_map *map;
+	atomic_size_t position;
+	atomic_int running;
+};
+
+static void *read_ahead_thread(void *arg)
+{
+	struct read_ahead *r = arg;
+
+	while (atomic_load(&r->running)) {
+		wave_map_prefetch(r->map, atomic_load(&r->position), READAHEAD_SECONDS * BENCH_SRATE);
+		usleep(CHECK_INTERVAL_MS * 1000 / BENCH_MAPPED_SPEEDUP);
+	}
+	return NULL;
+}
+
+/*
+  Play a take from a file that isn't in the page cache, period by period
+  at BENCH_MAPPED_SPEEDUP times real time, with or without the read-ahead
+  of the main loop, and count the major faults taken by the playback
+  With the read-ahead, there must be none
+*/
+static int bench_mapped(const char *tmpdir, struct arena *a, jack_default_audio_sample_t *in,
+			jack_default_audio_sample_t *out, int ahead)
+{
+	jack_default_audio_sample_t *src[MAX_CHANNELS], *dst[MAX_CHANNELS];
+	struct read_ahead r;
+	struct wave_map map;
+	struct buffer b;
+	struct timespec next;
+	pthread_t thread;
+	char path[4096], params[128];
+	size_t done, frames = BENCH_MAPPED_SECONDS * BENCH_SRATE;
+	long minor, major, minor_end, major_end;
+	double t = 0, longest = 0, start;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/recjack-bench-XXXXXX", tmpdir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	buffer_init(&b, a, 2);
+	b.srate = BENCH_SRATE;
+	src[0] = in;
+	src[1] = in + 4096;
+	for (done = 0; done < frames; done += 4096)
+		buffer_append(&b, src, 0, 4096);
+	if (save_wave(fd, &b, SAMPLE_F32) != 0 || wave_map_open(&map, path) != 0) {
+		unlink(path);
+		close(fd);
+		return -1;
+	}
+	buffer_reset(&b);
+	unlink(path);
+	// the samples are on disk only
+	if (fdatasync(fd) != 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+		perror("posix_fadvise");
+	close(fd);
+
+	buffer_map(&b, &map);
+	buffer_rewind(&b, 0);
+	dst[0] = out;
+	dst[1] = out + 4096;
+	r.map = &map;
+	atomic_init(&r.position, 0);
+	atomic_init(&r.running, 1);
+	if (ahead && pthread_create(&thread, NULL, read_ahead_thread, &r) != 0)
+		ahead = 0;
+
+	thread_faults(&minor, &major);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (done = 0; done < map.frames; done += BENCH_MAPPED_PERIOD) {
+		double d;
+		start = now();
+		buffer_read(&b, dst, 0, BENCH_MAPPED_PERIOD);
+		d = now() - start;
+		t += d;
+		if (d > longest)
+			longest = d;
+		atomic_store(&r.position, buffer_tell(&b));
+		next.tv_nsec += 1000000000L / BENCH_SRATE * BENCH_MAPPED_PERIOD / BENCH_MAPPED_SPEEDUP;
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	thread_faults(&minor_end, &major_end);
+
+	atomic_store(&r.running, 0);
+	if (ahead)
+		pthread_join(thread, NULL);
+	frames = map.frames;
+	wave_map_close(&map);
+
+	snprintf(params, sizeof(params), "\"read_ahead\": %d, \"major_faults\": %ld, \"longest_us\": %.0f",
+		 ahead, major_end - major, longest * 1e6);
+	result("mapped_playback", params, "frame", (double) frames, (double) frames * 2 * sizeof(float), t);
+	if (ahead && major_end > major) {
+		fprintf(stderr, "mapped playback: %ld major faults with the read-ahead\n", major_end - major);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  Usage: bench_recjack [take MB]
+  The WAV files are written to $TMPDIR (or /tmp) and removed
+*/
+int main(int argc, char **argv)
+{
+	size_t take_mb = argc > 1 ? (size_t) atol(argv[1]) : BENCH_TAKE_MB;
+	const char *tmpdir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+	jack_default_audio_sample_t *in = malloc(MAX_CHANNELS * 4096 * sizeof(jack_default_audio_sample_t));
+	jack_default_audio_sample_t *out = malloc(MAX_CHANNELS * 4096 * sizeof(jack_default_audio_sample_t));
+	jack_default_audio_sample_t *block = malloc(BENCH_BLOCK_FRAMES * sizeof(jack_default_audio_sample_t));
+	char path[4096];
+	struct arena arena;
+	unsigned int seed = 1;
+	size_t i;
+	int fd, ret = 0;
+
+	for (i = 0; i < MAX_CHANNELS * 4096; i++)
+		in[i] = 2.0F * ((float) rand_r(&seed) / (float) RAND_MAX - 0.5F);
+	for (i = 0; i < BENCH_BLOCK_FRAMES; i++)
+		block[i] = in[i % (MAX_CHANNELS * 4096)];
+
+	convert_init(0);
+	if (arena_init(&arena, (size_t) BENCH_ARENA_MB << 20, 0) != 0) {
+		fprintf(stderr, "cannot allocate the arena\n");
+		return 1;
+	}
+
+	bench_engine(&arena, 1, in, out);
+	bench_engine(&arena, 2, in, out);
+	bench_click();
+
+	snprintf(path, sizeof(path), "%s/recjack-bench-XXXXXX", tmpdir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		ret = 1;
+	} else {
+		unlink(path);
+		if (bench_write(fd, take_mb, block) != 0 || bench_save(fd, &arena, in) != 0)
+			ret = 1;
+		close(fd);
+	}
+	if (bench_mapped(tmpdir, &arena, in, out, 0) != 0 || bench_mapped(tmpdir, &arena, in, out, 1) != 0)
+		ret = 1;
+	printf("\n]\n");
+
+	arena_destroy(&arena);
+	free(in);
+	free(out);
+	free(block);
+	return ret;
+}
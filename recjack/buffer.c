@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <jack/jack.h>
+
+#include "buffer.h"
+#include "wave.h"
+#include "convert.h"
+#include "memory.h"
+#include "peaks.h"
+
+/*
+  Allocate the chunk pool, at most max_bytes large
+  With huge, the pool is backed by huge pages if the kernel has some to
+  spare, or else by transparent ones, fewer TLB misses as takes grow
+  This must be called from a non-RT thread, before recording starts
+*/
+int arena_init(struct arena *a, size_t max_bytes, int huge)
+{
+	size_t i;
+	void *p = MAP_FAILED;
+
+	a->nchunks = max_bytes / sizeof(struct chunk);
+	if (a->nchunks == 0)
+		a->nchunks = 1;
+	a->bytes = a->nchunks * sizeof(struct chunk);
+	a->huge = ARENA_PAGES;
+#ifdef MAP_HUGETLB
+	if (huge) {
+		size_t bytes = (a->bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			a->bytes = bytes;
+			a->huge = ARENA_HUGETLB;
+		}
+	}
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, a->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return -1;
+#ifdef MADV_HUGEPAGE
+		if (huge && madvise(p, a->bytes, MADV_HUGEPAGE) == 0)
+			a->huge = ARENA_THP;
+#endif
+	}
+	a->chunks = p;
+
+	// chain all the chunks in the free list
+	for (i = 0; i < a->nchunks - 1; i++)
+		a->chunks[i].next = &a->chunks[i + 1];
+	a->chunks[a->nchunks - 1].next = NULL;
+	a->free = a->chunks;
+
+	return 0;
+}
+
+void arena_destroy(struct arena *a)
+{
+	if (a->chunks != NULL)
+		munmap(a->chunks, a->bytes);
+	a->chunks = NULL;
+	a->free = NULL;
+	a->nchunks = 0;
+}
+
+// take a chunk from the free list, NULL if the arena is exhausted
+static struct chunk *arena_get(struct arena *a)
+{
+	struct chunk *c = a->free;
+
+	if (c != NULL) {
+		a->free = c->next;
+		c->next = NULL;
+		c->start = 0;
+		c->frames = 0;
+	}
+	return c;
+}
+
+/*
+  Give a list of chunks back to the arena, spliced in front of the free list
+  Only the thread that records may call this once the audio thread runs
+*/
+void arena_put(struct arena *a, struct chunk *head, struct chunk *tail)
+{
+	if (head != NULL) {
+		tail->next = a->free;
+		a->free = head;
+	}
+}
+
+void buffer_init(struct buffer *b, struct arena *a, unsigned int nchannels)
+{
+	memset(b, 0, sizeof(struct buffer));
+	b->arena = a;
+	b->nchannels = nchannels;
+	b->chunk_frames = CHUNK_SAMPLES / nchannels;
+}
+
+/*
+  Give all the chunks of the take back to the arena
+  The whole list is spliced in front of the free list
+*/
+void buffer_reset(struct buffer *b)
+{
+	struct chunk *head, *tail;
+
+	buffer_detach(b, &head, &tail);
+	arena_put(b->arena, head, tail);
+}
+
+/*
+  Empty the take, its chunks are stored in head and tail rather than
+  given back, so that another thread can hand them to arena_put()
+*/
+void buffer_detach(struct buffer *b, struct chunk **head, struct chunk **tail)
+{
+	*head = b->head;
+	*tail = b->tail;
+	b->head = NULL;
+	b->tail = NULL;
+	b->cur = NULL;
+	b->pos = 0;
+	b->read_pos = 0;
+	b->map = NULL;
+	b->map_pos = 0;
+	b->frames = 0;
+	b->dropped = 0;
+	b->clipped = 0;
+}
+
+/*
+  Use a WAV file mapped in memory as the take
+  The samples are converted while they are played, nothing is copied
+*/
+void buffer_map(struct buffer *b, const struct wave_map *m)
+{
+	buffer_reset(b);
+	b->map = m;
+	b->frames = m->frames;
+}
+
+/*
+  Move the playback position back to the start of the take,
+  then skip the first skip frames
+*/
+void buffer_rewind(struct buffer *b, size_t skip)
+{
+	struct cursor c;
+
+	buffer_locate(b, skip, &c);
+	buffer_seek(b, &c);
+}
+
+/*
+  Find frame of the take, or its end if the take is shorter
+  Walks the chunks, the take must not change until the cursor is used
+*/
+void buffer_locate(const struct buffer *b, size_t frame, struct cursor *c)
+{
+	size_t skip = frame < b->frames ? frame : b->frames;
+
+	c->frame = skip;
+	c->chunk = NULL;
+	c->pos = 0;
+	if (b->map != NULL)
+		return;
+	c->chunk = b->head;
+	while (c->chunk != NULL && skip >= c->chunk->frames - c->chunk->start) {
+		skip -= c->chunk->frames - c->chunk->start;
+		c->chunk = c->chunk->next;
+	}
+	if (c->chunk != NULL)
+		c->pos = c->chunk->start + (jack_nframes_t) skip;
+}
+
+/*
+  Move the playback position to a cursor of the take, in O(1)
+*/
+void buffer_seek(struct buffer *b, const struct cursor *c)
+{
+	if (b->map != NULL) {
+		b->map_pos = c->frame;
+		return;
+	}
+	b->cur = c->chunk;
+	b->pos = c->pos;
+	b->read_pos = c->frame;
+}
+
+// frame of the take at the playback position
+size_t buffer_tell(const struct buffer *b)
+{
+	return b->map != NULL ? b->map_pos : b->read_pos;
+}
+
+/*
+  Append n frames at the end of the take, taken from offset in each of
+  the nchannels buffers of src
+  Only bumps a pointer in the current chunk, or takes a new one from the arena
+  The frames stored are added to the peak index of the take
+  Returns the number of frames stored, less than n if the arena is full
+*/
+jack_nframes_t buffer_append(struct buffer *b, jack_default_audio_sample_t **src,
+			     jack_nframes_t offset, jack_nframes_t n)
+{
+	jack_nframes_t done = 0;
+	unsigned int k;
+
+	while (done < n) {
+		if (b->tail == NULL || b->tail->frames == b->chunk_frames) {
+			struct chunk *c = arena_get(b->arena);
+			if (c == NULL) {
+				b->dropped += n - done;
+				break;
+			}
+			if (b->tail == NULL)
+				b->head = c;
+			else
+				b->tail->next = c;
+			b->tail = c;
+		}
+
+		jack_nframes_t len = b->chunk_frames - b->tail->frames;
+		if (len > n - done)
+			len = n - done;
+		// one straight copy per port
+		for (k = 0; k < b->nchannels; k++)
+			memcpy(CHUNK_CHANNEL(b, b->tail, k) + b->tail->frames, src[k] + offset + done,
+			       len * sizeof(jack_default_audio_sample_t));
+		b->tail->frames += len;
+		done += len;
+	}
+
+	b->frames += done;
+	if (b->peaks != NULL)
+		peaks_append(b->peaks, src, offset, done);
+	return done;
+}
+
+/*
+  Copy up to n frames from the playback position to offset in each of
+  the nchannels buffers of dst
+  Returns the number of frames copied, less than n at the end of the take
+*/
+jack_nframes_t buffer_read(struct buffer *b, jack_default_audio_sample_t **dst,
+			   jack_nframes_t offset, jack_nframes_t n)
+{
+	jack_nframes_t done = 0;
+	unsigned int k;
+
+	if (b->map != NULL) {
+		// the file is interleaved, channels missing from it are silent
+		size_t bytes = sample_bytes(b->map->format);
+		const char *data = b->map->data + b->map_pos * b->map->nchannels * bytes;
+		if (n > b->frames - b->map_pos)
+			n = (jack_nframes_t) (b->frames - b->map_pos);
+		for (k = 0; k < b->nchannels; k++) {
+			if (k < b->map->nchannels)
+				samples_to_float(dst[k] + offset, data + k * bytes, b->map->format, b->map->nchannels, n);
+			else
+				memset(dst[k] + offset, 0, n * sizeof(jack_default_audio_sample_t));
+		}
+		b->map_pos += n;
+		return n;
+	}
+
+	while (done < n && b->cur != NULL) {
+		jack_nframes_t len = b->cur->frames - b->pos;
+		if (len > n - done)
+			len = n - done;
+		for (k = 0; k < b->nchannels; k++)
+			memcpy(dst[k] + offset + done, CHUNK_CHANNEL(b, b->cur, k) + b->pos,
+			       len * sizeof(jack_default_audio_sample_t));
+		done += len;
+		b->pos += len;
+		b->read_pos += len;
+		if (b->pos == b->cur->frames) {
+			if (b->cur->next == NULL)
+				break;
+			b->cur = b->cur->next;
+			b->pos = b->cur->start;
+		}
+	}
+
+	return done;
+}
+
+/*
+  Pre-roll: append n frames to b like buffer_append, but once the
+  chunks after the first one hold keep frames, the first one is recycled
+  at the end instead of taking a new one from the arena
+  b then always holds the last keep frames at least, in a constant
+  number of chunks
+*/
+void buffer_roll(struct buffer *b, jack_default_audio_sample_t **src, jack_nframes_t offset, jack_nframes_t n,
+		 size_t keep)
+{
+	jack_nframes_t done = 0;
+
+	while (done < n) {
+		jack_nframes_t len;
+		if (b->tail != NULL && b->tail->frames == b->chunk_frames && b->head != b->tail
+		    && b->frames - (b->head->frames - b->head->start) >= keep) {
+			struct chunk *c = b->head;
+			b->frames -= c->frames - c->start;
+			b->head = c->next;
+			c->next = NULL;
+			c->start = 0;
+			c->frames = 0;
+			b->tail->next = c;
+			b->tail = c;
+		}
+		// no further than the end of the last chunk, it may be recycled then
+		len = b->tail == NULL || b->tail->frames == b->chunk_frames
+			? b->chunk_frames : b->chunk_frames - b->tail->frames;
+		if (len > n - done)
+			len = n - done;
+		if (buffer_append(b, src, offset + done, len) < len)
+			break;
+		done += len;
+	}
+}
+
+/*
+  Move the last n frames of src to the empty take b without copying:
+  b takes the chunks of src, the first one starts at the right frame and
+  the chunks before it go back to the arena
+  src is left empty, returns the number of frames b got
+*/
+size_t buffer_adopt(struct buffer *b, struct buffer *src, size_t n)
+{
+	size_t drop = src->frames > n ? src->frames - n : 0;
+
+	if (b->head != NULL || b->map != NULL)
+		return 0;
+	while (src->head != NULL && drop >= src->head->frames - src->head->start) {
+		struct chunk *c = src->head;
+		drop -= c->frames - c->start;
+		src->frames -= c->frames - c->start;
+		src->head = c->next;
+		arena_put(src->arena, c, c);
+	}
+	if (src->head == NULL) {
+		src->tail = NULL;
+		return 0;
+	}
+	src->head->start += (jack_nframes_t) drop;
+	src->frames -= drop;
+
+	b->head = src->head;
+	b->tail = src->tail;
+	b->frames = src->frames;
+	src->head = NULL;
+	src->tail = NULL;
+	src->frames = 0;
+	return b->frames;
+}
@@ -0,0 +1,107 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+#include <jack/jack.h>
+
+#define CHUNK_SAMPLES 16384
+#define DEFAULT_ARENA_MB 512
+#define MAX_CHANNELS 16
+
+struct wave_map;
+struct peaks;
+
+/*
+  A take is stored as a list of fixed-size chunks drawn from a
+  preallocated arena, so that recording in the JACK thread never has
+  to call the allocator
+  The channels are planar: a chunk holds chunk_frames frames of the
+  first channel, then chunk_frames frames of the second one, etc.
+  The frames of a chunk that belong to the take go from start to frames,
+  start is only set on the first chunk of a take made from the pre-roll
+*/
+struct chunk
+{
+	struct chunk *next;
+	jack_nframes_t start;
+	jack_nframes_t frames;
+	jack_default_audio_sample_t buf[CHUNK_SAMPLES];
+};
+
+#define CHUNK_CHANNEL(b, c, k) ((c)->buf + (size_t) (k) * (b)->chunk_frames)
+
+/*
+  A frame of a take and where it is stored, found once by the main loop
+  so that the audio thread jumps there without walking the chunks
+  chunk is NULL in a mapped take, or past the end of the take
+*/
+struct cursor
+{
+	struct chunk *chunk;
+	jack_nframes_t pos;
+	size_t frame;
+};
+
+#define ARENA_PAGES 0
+#define ARENA_HUGETLB 1
+#define ARENA_THP 2
+
+struct arena
+{
+	struct chunk *chunks;
+	size_t nchunks;
+	struct chunk *free;
+	// size of the mapping, and the kind of pages behind it
+	size_t bytes;
+	int huge;
+};
+
+/*
+  A take is either recorded in the arena, or a WAV file mapped in memory
+  (map != NULL), in which case map_pos is the playback position
+  In the arena, the playback position is frame read_pos of the take,
+  frame pos of the chunk cur
+*/
+struct buffer
+{
+	struct arena *arena;
+	struct chunk *head;
+	struct chunk *tail;
+	struct chunk *cur;
+	jack_nframes_t pos;
+	size_t read_pos;
+	const struct wave_map *map;
+	size_t map_pos;
+	unsigned int nchannels;
+	jack_nframes_t chunk_frames;
+	size_t frames;
+	size_t dropped;
+	// samples at or past full scale, counted while recording
+	size_t clipped;
+	unsigned long srate;
+	// index of the recorded frames, NULL if the take has none
+	struct peaks *peaks;
+};
+
+int arena_init(struct arena *a, size_t max_bytes, int huge);
+void arena_destroy(struct arena *a);
+void arena_put(struct arena *a, struct chunk *head, struct chunk *tail);
+
+void buffer_init(struct buffer *b, struct arena *a, unsigned int nchannels);
+void buffer_reset(struct buffer *b);
+void buffer_detach(struct buffer *b, struct chunk **head, struct chunk **tail);
+void buffer_map(struct buffer *b, const struct wave_map *m);
+void buffer_rewind(struct buffer *b, size_t skip);
+void buffer_locate(const struct buffer *b, size_t frame, struct cursor *c);
+void buffer_seek(struct buffer *b, const struct cursor *c);
+size_t buffer_tell(const struct buffer *b);
+jack_nframes_t buffer_append(struct buffer *b, jack_default_audio_sample_t **src,
+			     jack_nframes_t offset, jack_nframes_t n);
+jack_nframes_t buffer_read(struct buffer *b, jack_default_audio_sample_t **dst,
+			   jack_nframes_t offset, jack_nframes_t n);
+void buffer_roll(struct buffer *b, jack_default_audio_sample_t **src, jack_nframes_t offset, jack_nframes_t n,
+		 size_t keep);
+size_t buffer_adopt(struct buffer *b, struct buffer *src, size_t n);
+
+#endif // BUFFER_H
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <jack/jack.h>
+
+#include "calibrate.h"
+#include "memory.h"
+
+/*
+  Allocate the buffers and generate the sequence
+  The sequence comes from a 15-bit linear feedback shift register
+  (x^15 + x^14 + 1), its autocorrelation is a single peak
+*/
+struct calibration *calibration_new(void)
+{
+	struct calibration *c = malloc(sizeof(struct calibration));
+	unsigned int lfsr = 1, bit, k;
+
+	memset(c, 0, sizeof(struct calibration));
+	c->signal = malloc(MLS_LENGTH * sizeof(jack_default_audio_sample_t));
+	c->capture = malloc(CALIBRATION_FRAMES * sizeof(jack_default_audio_sample_t));
+	if (c->signal == NULL || c->capture == NULL) {
+		calibration_free(c);
+		return NULL;
+	}
+	// filled by the audio thread
+	prefault(c->capture, CALIBRATION_FRAMES * sizeof(jack_default_audio_sample_t));
+	for (k = 0; k < MLS_LENGTH; k++) {
+		c->signal[k] = (lfsr & 1) ? MLS_AMPLITUDE : -MLS_AMPLITUDE;
+		bit = ((lfsr >> 14) ^ (lfsr >> 13)) & 1;
+		lfsr = ((lfsr << 1) | bit) & 0x7fff;
+	}
+	c->latency = -1;
+	return c;
+}
+
+void calibration_free(struct calibration *c)
+{
+	if (c != NULL) {
+		free(c->signal);
+		free(c->capture);
+		free(c);
+	}
+}
+
+/*
+  Audio thread: play the sequence on every output, followed by silence,
+  and record the first input, starting offset frames into the period
+  Returns 1 once the capture is complete
+*/
+int calibration_process(struct calibration *c, jack_default_audio_sample_t *in,
+			jack_default_audio_sample_t **out, unsigned int nchannels,
+			jack_nframes_t offset, jack_nframes_t n)
+{
+	jack_nframes_t len = CALIBRATION_FRAMES - c->pos, play = 0;
+	unsigned int k;
+
+	if (len > n)
+		len = n;
+	if (c->pos < MLS_LENGTH)
+		play = MLS_LENGTH - c->pos < len ? MLS_LENGTH - c->pos : len;
+
+	for (k = 0; k < nchannels; k++) {
+		memcpy(out[k] + offset, c->signal + c->pos, play * sizeof(jack_default_audio_sample_t));
+		memset(out[k] + offset + play, 0, (n - play) * sizeof(jack_default_audio_sample_t));
+	}
+	memcpy(c->capture + c->pos, in + offset, len * sizeof(jack_default_audio_sample_t));
+	c->pos += len;
+
+	return c->pos == CALIBRATION_FRAMES;
+}
+
+/*
+  In-place radix-2 complex FFT, inverse if sign is 1
+*/
+static void fft(double *re, double *im, size_t n, int sign)
+{
+	size_t i, j, len, k;
+
+	for (i = 1, j = 0; i < n; i++) {
+		size_t bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			double t = re[i];
+			re[i] = re[j];
+			re[j] = t;
+			t = im[i];
+			im[i] = im[j];
+			im[j] = t;
+		}
+	}
+
+	for (len = 2; len <= n; len <<= 1) {
+		double angle = sign * 2 * M_PI / (double) len;
+		double wr = cos(angle), wi = sin(angle);
+		for (i = 0; i < n; i += len) {
+			double cr = 1, ci = 0;
+			for (k = 0; k < len / 2; k++) {
+				size_t a = i + k, b = i + k + len / 2;
+				double tr = re[b] * cr - im[b] * ci;
+				double ti = re[b] * ci + im[b] * cr;
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+				double t = cr * wr - ci * wi;
+				ci = cr * wi + ci * wr;
+				cr = t;
+			}
+		}
+	}
+}
+
+/*
+  Worker thread: cross-correlate the capture with the sequence
+  r[k] = sum capture[n + k] * signal[n], the latency is the highest peak
+*/
+static void *calibration_thread(void *arg)
+{
+	struct calibration *c = (struct calibration *) arg;
+	double *xr = calloc(FFT_SIZE, sizeof(double));
+	double *xi = calloc(FFT_SIZE, sizeof(double));
+	double *sr = calloc(FFT_SIZE, sizeof(double));
+	double *si = calloc(FFT_SIZE, sizeof(double));
+	size_t k, lags = CALIBRATION_FRAMES - MLS_LENGTH, peak = 0;
+	double sum = 0;
+
+	if (xr == NULL || xi == NULL || sr == NULL || si == NULL)
+		goto out;
+
+	for (k = 0; k < CALIBRATION_FRAMES; k++)
+		xr[k] = c->capture[k];
+	for (k = 0; k < MLS_LENGTH; k++)
+		sr[k] = c->signal[k];
+	fft(xr, xi, FFT_SIZE, -1);
+	fft(sr, si, FFT_SIZE, -1);
+	// X * conj(S)
+	for (k = 0; k < FFT_SIZE; k++) {
+		double r = xr[k] * sr[k] + xi[k] * si[k];
+		double i = xi[k] * sr[k] - xr[k] * si[k];
+		xr[k] = r;
+		xi[k] = i;
+	}
+	fft(xr, xi, FFT_SIZE, 1);
+
+	for (k = 0; k < lags; k++) {
+		sum += fabs(xr[k]);
+		if (fabs(xr[k]) > fabs(xr[peak]))
+			peak = k;
+	}
+	c->quality = sum > 0 ? fabs(xr[peak]) / (sum / (double) lags) : 0;
+	if (c->quality >= CALIBRATION_MIN_QUALITY)
+		c->latency = (long) peak;
+
+out:
+	free(xr);
+	free(xi);
+	free(sr);
+	free(si);
+	atomic_store(&c->done, 1);
+	return NULL;
+}
+
+/*
+  Start the analysis of a complete capture
+*/
+int calibration_analyze(struct calibration *c)
+{
+	atomic_store(&c->done, 0);
+	return pthread_create(&c->thread, NULL, calibration_thread, c) == 0 ? 0 : -1;
+}
+
+/*
+  Returns 1 if the analysis is over (the result is in latency, -1 if no
+  clear peak was found), 0 if it is still running
+*/
+int calibration_finish(struct calibration *c)
+{
+	if (!atomic_load(&c->done))
+		return 0;
+	pthread_join(c->thread, NULL);
+	return 1;
+}
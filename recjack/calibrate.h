@@ -0,0 +1,45 @@
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <jack/jack.h>
+
+#define MLS_ORDER 15
+#define MLS_LENGTH ((1 << MLS_ORDER) - 1)
+#define MLS_AMPLITUDE 0.25F
+// the round trip must be shorter than CALIBRATION_FRAMES - MLS_LENGTH
+#define CALIBRATION_FRAMES (1 << 16)
+#define FFT_SIZE (1 << 17)
+// the correlation peak must stand that much above the rest
+#define CALIBRATION_MIN_QUALITY 10.0
+
+/*
+  Round-trip latency measurement
+  The audio thread plays a maximum length sequence on the outputs and
+  records the first input, a worker thread then cross-correlates both
+  to find the delay
+*/
+struct calibration
+{
+	jack_default_audio_sample_t *signal;
+	jack_default_audio_sample_t *capture;
+	// audio thread
+	jack_nframes_t pos;
+	// worker thread
+	pthread_t thread;
+	atomic_int done;
+	long latency;
+	double quality;
+};
+
+struct calibration *calibration_new(void);
+void calibration_free(struct calibration *c);
+int calibration_process(struct calibration *c, jack_default_audio_sample_t *in,
+			jack_default_audio_sample_t **out, unsigned int nchannels,
+			jack_nframes_t offset, jack_nframes_t n);
+int calibration_analyze(struct calibration *c);
+int calibration_finish(struct calibration *c);
+
+#endif // CALIBRATE_H
@@ -0,0 +1,640 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <jack/jack.h>
+
+#include "wave.h"
+#include "convert.h"
+
+#define PCM_MIN -32768.0F
+#define PCM_MAX 32767.0F
+#define PCM24_SCALE 8388608.0F
+#define PCM24_MIN -8388608.0F
+#define PCM24_MAX 8388607.0F
+// a sample at full scale already clips once converted to 16 bits
+#define LEVEL_CLIP 1.0F
+
+static convert_kernel_t kernel = convert_scalar;
+static pack24_kernel_t pack24_kernel = pack24_scalar;
+static mix_kernel_t mix_kernel = mix_scalar;
+static level_kernel_t level_kernel = level_scalar;
+static range_kernel_t range_kernel = range_scalar;
+static dot_kernel_t dot_kernel = dot_scalar;
+
+// TPDF dither noise, in LSB, shared by all the threads
+static float *dither_table = NULL;
+static __thread size_t dither_pos = 0;
+
+/*
+  Reference mix kernel, no FMA so that the vector kernels match it
+*/
+void mix_scalar(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, float gain, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] += gain * src[i];
+}
+
+/*
+  Reference level kernel
+  The peak is written as peak > a ? peak : a, like the SSE max instruction
+*/
+void level_scalar(struct level *l, const jack_default_audio_sample_t *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		float a = fabsf(src[i]);
+		l->peak = l->peak > a ? l->peak : a;
+		l->energy += src[i] * src[i];
+		if (a >= LEVEL_CLIP)
+			l->clips++;
+	}
+}
+
+/*
+  Reference range kernel, written like the SSE min/max instructions
+*/
+void range_scalar(struct range *r, const jack_default_audio_sample_t *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		r->min = r->min < src[i] ? r->min : src[i];
+		r->max = r->max > src[i] ? r->max : src[i];
+		r->energy += src[i] * src[i];
+	}
+}
+
+/*
+  Reference dot product kernel
+*/
+float dot_scalar(const jack_default_audio_sample_t *a, const jack_default_audio_sample_t *b, size_t n)
+{
+	float sum = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+/*
+  Reference kernel
+  The clamps are written as v > min ? v : min so that a NaN gives the
+  same result as the SSE min/max instructions
+*/
+void convert_scalar(int16_t *dst, const jack_default_audio_sample_t *src, const float *noise, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		float v = src[i] * DEPTH_MAX;
+		if (noise != NULL)
+			v += noise[i];
+		v = v > PCM_MIN ? v : PCM_MIN;
+		v = v < PCM_MAX ? v : PCM_MAX;
+		dst[i] = (int16_t) lrintf(v);
+	}
+}
+
+/*
+  Reference 24-bit kernel
+  A float holds 24 bits of mantissa, the scaled samples are exact
+*/
+void pack24_scalar(uint8_t *dst, const jack_default_audio_sample_t *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		float v = src[i] * PCM24_SCALE;
+		int32_t s;
+		v = v > PCM24_MIN ? v : PCM24_MIN;
+		v = v < PCM24_MAX ? v : PCM24_MAX;
+		s = (int32_t) lrintf(v);
+		dst[3 * i] = (uint8_t) s;
+		dst[3 * i + 1] = (uint8_t) (s >> 8);
+		dst[3 * i + 2] = (uint8_t) (s >> 16);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void convert_sse2(int16_t *dst, const jack_default_audio_sample_t *src, const float *noise, size_t n)
+{
+	const __m128 scale = _mm_set1_ps(DEPTH_MAX);
+	const __m128 lo = _mm_set1_ps(PCM_MIN);
+	const __m128 hi = _mm_set1_ps(PCM_MAX);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+		if (noise != NULL) {
+			a = _mm_add_ps(a, _mm_loadu_ps(noise + i));
+			b = _mm_add_ps(b, _mm_loadu_ps(noise + i + 4));
+		}
+		a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+		b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+	}
+
+	convert_scalar(dst + i, src + i, noise != NULL ? noise + i : NULL, n - i);
+}
+
+__attribute__((target("avx2")))
+void convert_avx2(int16_t *dst, const jack_default_audio_sample_t *src, const float *noise, size_t n)
+{
+	const __m256 scale = _mm256_set1_ps(DEPTH_MAX);
+	const __m256 lo = _mm256_set1_ps(PCM_MIN);
+	const __m256 hi = _mm256_set1_ps(PCM_MAX);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+		__m256 b = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale);
+		if (noise != NULL) {
+			a = _mm256_add_ps(a, _mm256_loadu_ps(noise + i));
+			b = _mm256_add_ps(b, _mm256_loadu_ps(noise + i + 8));
+		}
+		a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+		b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+		// packs works on 128-bit lanes, put the quadwords back in order
+		__m256i p = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_permute4x64_epi64(p, 0xD8));
+	}
+
+	convert_sse2(dst + i, src + i, noise != NULL ? noise + i : NULL, n - i);
+}
+
+/*
+  The three low bytes of each 32-bit sample are gathered by a shuffle
+  Each store writes 16 bytes for 12: the loop stops 2 samples early so
+  that the extra bytes are always overwritten, by the next store or by
+  the tail
+*/
+__attribute__((target("ssse3")))
+void pack24_ssse3(uint8_t *dst, const jack_default_audio_sample_t *src, size_t n)
+{
+	const __m128 scale = _mm_set1_ps(PCM24_SCALE);
+	const __m128 lo = _mm_set1_ps(PCM24_MIN);
+	const __m128 hi = _mm_set1_ps(PCM24_MAX);
+	const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	size_t i;
+
+	for (i = 0; i + 4 + 2 <= n; i += 4) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+		a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+		_mm_storeu_si128((__m128i *) (dst + 3 * i), _mm_shuffle_epi8(_mm_cvtps_epi32(a), pack));
+	}
+
+	pack24_scalar(dst + 3 * i, src + i, n - i);
+}
+
+// same shuffle in both lanes, then one store per lane
+__attribute__((target("avx2")))
+void pack24_avx2(uint8_t *dst, const jack_default_audio_sample_t *src, size_t n)
+{
+	const __m256 scale = _mm256_set1_ps(PCM24_SCALE);
+	const __m256 lo = _mm256_set1_ps(PCM24_MIN);
+	const __m256 hi = _mm256_set1_ps(PCM24_MAX);
+	const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+					      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	size_t i;
+
+	for (i = 0; i + 8 + 2 <= n; i += 8) {
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+		__m256i p;
+		a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+		p = _mm256_shuffle_epi8(_mm256_cvtps_epi32(a), pack);
+		_mm_storeu_si128((__m128i *) (dst + 3 * i), _mm256_castsi256_si128(p));
+		_mm_storeu_si128((__m128i *) (dst + 3 * i + 12), _mm256_extracti128_si256(p, 1));
+	}
+
+	pack24_ssse3(dst + 3 * i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void mix_sse2(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, float gain, size_t n)
+{
+	const __m128 g = _mm_set1_ps(gain);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128 a = _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g));
+		__m128 b = _mm_add_ps(_mm_loadu_ps(dst + i + 4), _mm_mul_ps(_mm_loadu_ps(src + i + 4), g));
+		_mm_storeu_ps(dst + i, a);
+		_mm_storeu_ps(dst + i + 4, b);
+	}
+
+	mix_scalar(dst + i, src + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+void mix_avx2(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, float gain, size_t n)
+{
+	const __m256 g = _mm256_set1_ps(gain);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256 a = _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), g));
+		__m256 b = _mm256_add_ps(_mm256_loadu_ps(dst + i + 8), _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), g));
+		_mm256_storeu_ps(dst + i, a);
+		_mm256_storeu_ps(dst + i + 8, b);
+	}
+
+	mix_sse2(dst + i, src + i, gain, n - i);
+}
+
+/*
+  One pass over the samples: the absolute value is the sign bit cleared,
+  a comparison gives -1 in the lanes that clip
+*/
+__attribute__((target("sse2")))
+void level_sse2(struct level *l, const jack_default_audio_sample_t *src, size_t n)
+{
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 full = _mm_set1_ps(LEVEL_CLIP);
+	__m128 peak = _mm_set1_ps(l->peak);
+	__m128 energy = _mm_setzero_ps();
+	__m128i clips = _mm_setzero_si128();
+	float p[4], e[4];
+	int32_t c[4];
+	size_t i, k;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128 v = _mm_loadu_ps(src + i);
+		__m128 a = _mm_and_ps(v, abs_mask);
+		peak = _mm_max_ps(peak, a);
+		energy = _mm_add_ps(energy, _mm_mul_ps(v, v));
+		clips = _mm_sub_epi32(clips, _mm_castps_si128(_mm_cmpge_ps(a, full)));
+	}
+	_mm_storeu_ps(p, peak);
+	_mm_storeu_ps(e, energy);
+	_mm_storeu_si128((__m128i *) c, clips);
+	for (k = 0; k < 4; k++) {
+		l->peak = l->peak > p[k] ? l->peak : p[k];
+		l->energy += e[k];
+		l->clips += (unsigned int) c[k];
+	}
+
+	level_scalar(l, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void level_avx2(struct level *l, const jack_default_audio_sample_t *src, size_t n)
+{
+	const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	const __m256 full = _mm256_set1_ps(LEVEL_CLIP);
+	__m256 peak = _mm256_set1_ps(l->peak);
+	__m256 energy = _mm256_setzero_ps();
+	__m256i clips = _mm256_setzero_si256();
+	float p[8], e[8];
+	int32_t c[8];
+	size_t i, k;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256 v = _mm256_loadu_ps(src + i);
+		__m256 a = _mm256_and_ps(v, abs_mask);
+		peak = _mm256_max_ps(peak, a);
+		energy = _mm256_add_ps(energy, _mm256_mul_ps(v, v));
+		clips = _mm256_sub_epi32(clips, _mm256_castps_si256(_mm256_cmp_ps(a, full, _CMP_GE_OQ)));
+	}
+	_mm256_storeu_ps(p, peak);
+	_mm256_storeu_ps(e, energy);
+	_mm256_storeu_si256((__m256i *) c, clips);
+	for (k = 0; k < 8; k++) {
+		l->peak = l->peak > p[k] ? l->peak : p[k];
+		l->energy += e[k];
+		l->clips += (unsigned int) c[k];
+	}
+
+	level_sse2(l, src + i, n - i);
+}
+
+/*
+  The lanes are folded in order at the end, min and max don't depend on it
+*/
+__attribute__((target("sse2")))
+void range_sse2(struct range *r, const jack_default_audio_sample_t *src, size_t n)
+{
+	__m128 lo = _mm_set1_ps(r->min);
+	__m128 hi = _mm_set1_ps(r->max);
+	__m128 energy = _mm_setzero_ps();
+	float a[4], b[4], e[4];
+	size_t i, k;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128 v = _mm_loadu_ps(src + i);
+		lo = _mm_min_ps(lo, v);
+		hi = _mm_max_ps(hi, v);
+		energy = _mm_add_ps(energy, _mm_mul_ps(v, v));
+	}
+	_mm_storeu_ps(a, lo);
+	_mm_storeu_ps(b, hi);
+	_mm_storeu_ps(e, energy);
+	for (k = 0; k < 4; k++) {
+		r->min = r->min < a[k] ? r->min : a[k];
+		r->max = r->max > b[k] ? r->max : b[k];
+		r->energy += e[k];
+	}
+
+	range_scalar(r, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void range_avx2(struct range *r, const jack_default_audio_sample_t *src, size_t n)
+{
+	__m256 lo = _mm256_set1_ps(r->min);
+	__m256 hi = _mm256_set1_ps(r->max);
+	__m256 energy = _mm256_setzero_ps();
+	float a[8], b[8], e[8];
+	size_t i, k;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256 v = _mm256_loadu_ps(src + i);
+		lo = _mm256_min_ps(lo, v);
+		hi = _mm256_max_ps(hi, v);
+		energy = _mm256_add_ps(energy, _mm256_mul_ps(v, v));
+	}
+	_mm256_storeu_ps(a, lo);
+	_mm256_storeu_ps(b, hi);
+	_mm256_storeu_ps(e, energy);
+	for (k = 0; k < 8; k++) {
+		r->min = r->min < a[k] ? r->min : a[k];
+		r->max = r->max > b[k] ? r->max : b[k];
+		r->energy += e[k];
+	}
+
+	range_sse2(r, src + i, n - i);
+}
+
+/*
+  Two accumulators, so that an addition doesn't wait for the previous one
+*/
+__attribute__((target("sse2")))
+float dot_sse2(const jack_default_audio_sample_t *a, const jack_default_audio_sample_t *b, size_t n)
+{
+	__m128 s0 = _mm_setzero_ps();
+	__m128 s1 = _mm_setzero_ps();
+	float s[4];
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+	_mm_storeu_ps(s, _mm_add_ps(s0, s1));
+
+	return s[0] + s[1] + s[2] + s[3] + dot_scalar(a + i, b + i, n - i);
+}
+
+/*
+  Four accumulators, 32 samples per iteration
+  The rest is summed here rather than by dot_sse2: correlate is called
+  on short segments, and going from AVX to SSE code would cost more
+  than the whole product
+*/
+__attribute__((target("avx2")))
+float dot_avx2(const jack_default_audio_sample_t *a, const jack_default_audio_sample_t *b, size_t n)
+{
+	__m256 s0 = _mm256_setzero_ps();
+	__m256 s1 = _mm256_setzero_ps();
+	__m256 s2 = _mm256_setzero_ps();
+	__m256 s3 = _mm256_setzero_ps();
+	float s[8];
+	float rest = 0;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+		s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+		s2 = _mm256_add_ps(s2, _mm256_mul_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16)));
+		s3 = _mm256_add_ps(s3, _mm256_mul_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24)));
+	}
+	_mm256_storeu_ps(s, _mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+
+	for (; i < n; i++)
+		rest += a[i] * b[i];
+
+	return s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7] + rest;
+}
+#endif
+
+/*
+  Pick the fastest kernel for this CPU and prepare the dither noise
+  Must be called before any conversion, returns the name of the kernel
+*/
+const char *convert_init(int dither)
+{
+	const char *name = "scalar";
+	size_t i;
+
+	kernel = convert_scalar;
+	pack24_kernel = pack24_scalar;
+	mix_kernel = mix_scalar;
+	level_kernel = level_scalar;
+	range_kernel = range_scalar;
+	dot_kernel = dot_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernel = convert_avx2;
+		pack24_kernel = pack24_avx2;
+		mix_kernel = mix_avx2;
+		level_kernel = level_avx2;
+		range_kernel = range_avx2;
+		dot_kernel = dot_avx2;
+		name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernel = convert_sse2;
+		mix_kernel = mix_sse2;
+		level_kernel = level_sse2;
+		range_kernel = range_sse2;
+		dot_kernel = dot_sse2;
+		name = "sse2";
+		if (__builtin_cpu_supports("ssse3"))
+			pack24_kernel = pack24_ssse3;
+	}
+#endif
+
+	if (dither && dither_table == NULL) {
+		// difference of two uniform variables in [0, 1[: triangular in ]-1, 1[
+		unsigned int seed = 1;
+		dither_table = malloc(DITHER_SIZE * sizeof(float));
+		for (i = 0; i < DITHER_SIZE; i++)
+			dither_table[i] = (float) rand_r(&seed) / ((float) RAND_MAX + 1.0F)
+				- (float) rand_r(&seed) / ((float) RAND_MAX + 1.0F);
+	}
+
+	return name;
+}
+
+// dst += gain * src, with the selected kernel
+void mix_add(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, float gain, size_t n)
+{
+	mix_kernel(dst, src, gain, n);
+}
+
+// peak, energy and clipped samples of src, added to l, with the selected kernel
+void measure_level(struct level *l, const jack_default_audio_sample_t *src, size_t n)
+{
+	level_kernel(l, src, n);
+}
+
+// smallest and largest sample and energy of src, added to r, with the selected kernel
+void measure_range(struct range *r, const jack_default_audio_sample_t *src, size_t n)
+{
+	range_kernel(r, src, n);
+}
+
+// sum of a[i] * b[i], with the selected kernel
+float correlate(const jack_default_audio_sample_t *a, const jack_default_audio_sample_t *b, size_t n)
+{
+	return dot_kernel(a, b, n);
+}
+
+/*
+  16-bit PCM back to floats, taking one sample every stride
+  (the number of channels of an interleaved file)
+*/
+void pcm_to_float(jack_default_audio_sample_t *dst, const int16_t *src, size_t stride, size_t n)
+{
+	size_t i;
+
+	if (stride == 1) {
+		// simple enough for the compiler to vectorize
+		for (i = 0; i < n; i++)
+			dst[i] = (jack_default_audio_sample_t) src[i] * (1.0F / DEPTH_MAX);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		dst[i] = (jack_default_audio_sample_t) src[i * stride] * (1.0F / DEPTH_MAX);
+}
+
+size_t sample_bytes(enum sample_format format)
+{
+	switch (format) {
+	case SAMPLE_S24:
+		return 3;
+	case SAMPLE_F32:
+		return sizeof(float);
+	default:
+		return sizeof(int16_t);
+	}
+}
+
+/*
+  Convert n samples to format: 16-bit as convert_samples does, packed
+  24-bit, or floats copied as they are
+  Returns the end of the samples written in dst
+*/
+void *convert_format(void *dst, const jack_default_audio_sample_t *src, size_t n, enum sample_format format)
+{
+	switch (format) {
+	case SAMPLE_S16:
+		convert_samples(dst, src, n);
+		break;
+	case SAMPLE_S24:
+		pack24_kernel(dst, src, n);
+		break;
+	case SAMPLE_F32:
+		memcpy(dst, src, n * sizeof(float));
+		break;
+	}
+	return (char *) dst + n * sample_bytes(format);
+}
+
+/*
+  Samples of a file back to floats, taking one sample every stride
+  src may not be aligned
+*/
+void samples_to_float(jack_default_audio_sample_t *dst, const void *src, enum sample_format format,
+		      size_t stride, size_t n)
+{
+	const uint8_t *p = src;
+	size_t i;
+
+	switch (format) {
+	case SAMPLE_S16:
+		pcm_to_float(dst, src, stride, n);
+		break;
+	case SAMPLE_S24:
+		for (i = 0; i < n; i++, p += 3 * stride) {
+			// sign extended by the arithmetic shift
+			int32_t v = (int32_t) ((uint32_t) p[0] << 8 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 24) >> 8;
+			dst[i] = (jack_default_audio_sample_t) v * (1.0F / PCM24_SCALE);
+		}
+		break;
+	case SAMPLE_F32:
+		for (i = 0; i < n; i++, p += sizeof(float) * stride)
+			memcpy(dst + i, p, sizeof(float));
+		break;
+	}
+}
+
+// convert with the selected kernel, walking through the dither table
+void convert_samples(int16_t *dst, const jack_default_audio_sample_t *src, size_t n)
+{
+	convert_samples_at(dst, src, n, dither_pos);
+	dither_pos = (dither_pos + n) % DITHER_SIZE;
+}
+
+/*
+  Same, reading the dither table from pos on
+  Threads that convert their own part of a take use this one, so that
+  the result doesn't depend on which thread converted which part
+*/
+void convert_samples_at(int16_t *dst, const jack_default_audio_sample_t *src, size_t n, size_t pos)
+{
+	if (dither_table == NULL) {
+		kernel(dst, src, NULL, n);
+		return;
+	}
+
+	pos %= DITHER_SIZE;
+	while (n > 0) {
+		size_t len = DITHER_SIZE - pos;
+		if (len > n)
+			len = n;
+		kernel(dst, src, dither_table + pos, len);
+		pos = (pos + len) % DITHER_SIZE;
+		dst += len;
+		src += len;
+		n -= len;
+	}
+}
+
+/*
+  Same, for one channel of an interleaved take kept apart: sample i is
+  sample pos + i * stride of the interleaved take, and gets its dither,
+  so that the channel comes out as it would in a WAV file
+*/
+void convert_channel_at(int16_t *dst, const jack_default_audio_sample_t *src, size_t n, size_t pos, size_t stride)
+{
+	float noise[INTERLEAVE_FRAMES];
+	size_t len, i;
+
+	if (dither_table == NULL || stride == 1) {
+		convert_samples_at(dst, src, n, pos);
+		return;
+	}
+
+	while (n > 0) {
+		len = n < INTERLEAVE_FRAMES ? n : INTERLEAVE_FRAMES;
+		for (i = 0; i < len; i++)
+			noise[i] = dither_table[(pos + i * stride) % DITHER_SIZE];
+		kernel(dst, src, noise, len);
+		pos += len * stride;
+		dst += len;
+		src += len;
+		n -= len;
+	}
+}
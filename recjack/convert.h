@@ -0,0 +1,127 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <jack/jack.h>
+
+#define DITHER_SIZE 65536
+
+// sample formats of the files written
+enum sample_format
+{
+	SAMPLE_S16,
+	SAMPLE_S24,
+	SAMPLE_F32,
+};
+
+/*
+  Float to 16-bit PCM conversion kernels
+  All kernels scale, add the (optional) dither noise, clamp and round to
+  nearest the same way, so that their output is bit-exact
+*/
+typedef void (*convert_kernel_t)(int16_t *dst, const jack_default_audio_sample_t *src,
+				 const float *noise, size_t n);
+
+void convert_scalar(int16_t *dst, const jack_default_audio_sample_t *src, const float *noise, size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+void convert_sse2(int16_t *dst, const jack_default_audio_sample_t *src, const float *noise, size_t n);
+void convert_avx2(int16_t *dst, const jack_default_audio_sample_t *src, const float *noise, size_t n);
+#endif
+
+/*
+  Float to packed 24-bit PCM (3 bytes per sample, little endian)
+  No dither at this depth, the same scale/clamp/round rule otherwise
+*/
+typedef void (*pack24_kernel_t)(uint8_t *dst, const jack_default_audio_sample_t *src, size_t n);
+
+void pack24_scalar(uint8_t *dst, const jack_default_audio_sample_t *src, size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+void pack24_ssse3(uint8_t *dst, const jack_default_audio_sample_t *src, size_t n);
+void pack24_avx2(uint8_t *dst, const jack_default_audio_sample_t *src, size_t n);
+#endif
+
+/*
+  Mix kernels: dst += gain * src
+  Same bit-exactness rule, a multiplication then an addition
+*/
+typedef void (*mix_kernel_t)(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src,
+			     float gain, size_t n);
+
+void mix_scalar(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, float gain, size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+void mix_sse2(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, float gain, size_t n);
+void mix_avx2(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, float gain, size_t n);
+#endif
+
+/*
+  Levels of a block of samples: the largest absolute value, the sum of
+  the squares, and how many samples are at or past full scale
+  The kernels add to l, peak and clips match the scalar kernel exactly,
+  the energy is summed in another order
+*/
+struct level
+{
+	float peak;
+	float energy;
+	unsigned int clips;
+};
+
+typedef void (*level_kernel_t)(struct level *l, const jack_default_audio_sample_t *src, size_t n);
+
+void level_scalar(struct level *l, const jack_default_audio_sample_t *src, size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+void level_sse2(struct level *l, const jack_default_audio_sample_t *src, size_t n);
+void level_avx2(struct level *l, const jack_default_audio_sample_t *src, size_t n);
+#endif
+
+/*
+  Range of a block of samples: the smallest and the largest one, and the
+  sum of the squares
+  The kernels add to r, min and max match the scalar kernel exactly
+*/
+struct range
+{
+	float min;
+	float max;
+	float energy;
+};
+
+typedef void (*range_kernel_t)(struct range *r, const jack_default_audio_sample_t *src, size_t n);
+
+void range_scalar(struct range *r, const jack_default_audio_sample_t *src, size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+void range_sse2(struct range *r, const jack_default_audio_sample_t *src, size_t n);
+void range_avx2(struct range *r, const jack_default_audio_sample_t *src, size_t n);
+#endif
+
+/*
+  Dot product of two blocks of samples, the inner loop of the time
+  stretch search
+  The vector kernels sum in another order, the results only differ by
+  rounding
+*/
+typedef float (*dot_kernel_t)(const jack_default_audio_sample_t *a, const jack_default_audio_sample_t *b, size_t n);
+
+float dot_scalar(const jack_default_audio_sample_t *a, const jack_default_audio_sample_t *b, size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+float dot_sse2(const jack_default_audio_sample_t *a, const jack_default_audio_sample_t *b, size_t n);
+float dot_avx2(const jack_default_audio_sample_t *a, const jack_default_audio_sample_t *b, size_t n);
+#endif
+
+const char *convert_init(int dither);
+void convert_samples(int16_t *dst, const jack_default_audio_sample_t *src, size_t n);
+void convert_samples_at(int16_t *dst, const jack_default_audio_sample_t *src, size_t n, size_t pos);
+void convert_channel_at(int16_t *dst, const jack_default_audio_sample_t *src, size_t n, size_t pos, size_t stride);
+void mix_add(jack_default_audio_sample_t *dst, const jack_default_audio_sample_t *src, float gain, size_t n);
+void measure_level(struct level *l, const jack_default_audio_sample_t *src, size_t n);
+void measure_range(struct range *r, const jack_default_audio_sample_t *src, size_t n);
+float correlate(const jack_default_audio_sample_t *a, const jack_default_audio_sample_t *b, size_t n);
+void pcm_to_float(jack_default_audio_sample_t *dst, const int16_t *src, size_t stride, size_t n);
+size_t sample_bytes(enum sample_format format);
+void *convert_format(void *dst, const jack_default_audio_sample_t *src, size_t n, enum sample_format format);
+void samples_to_float(jack_default_audio_sample_t *dst, const void *src, enum sample_format format,
+		      size_t stride, size_t n);
+
+#endif // CONVERT_H
@@ -0,0 +1,901 @@
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jack/jack.h>
+
+#include "recjack.h"
+#include "engine.h"
+#include "metronome.h"
+#include "stream.h"
+#include "stats.h"
+#include "memory.h"
+#include "meter.h"
+#include "calibrate.h"
+#include "loop.h"
+#include "peaks.h"
+#include "stretch.h"
+
+static void metronome_synchronize(struct engine *e, jack_nframes_t offset, jack_nframes_t *delay);
+static void handle_messages(struct engine *e);
+static int punch(struct engine *e, uint64_t pos, jack_nframes_t nframes,
+		 jack_nframes_t *start, jack_nframes_t *end);
+static void report_message(struct engine *e, char type, char m);
+static void report_take(struct engine *e, char type);
+static void rewind_take(struct engine *e);
+static void report_loop(struct engine *e, char type, struct layer *layer);
+static jack_nframes_t round_trip(struct engine *e);
+static void adopt_preroll(struct engine *e, struct buffer *b);
+static void click_gain(struct engine *e, jack_default_audio_sample_t *buf, jack_nframes_t nframes);
+static void jump(struct engine *e, const struct cursor *c, int fade);
+static jack_nframes_t play_take(struct engine *e, struct buffer *b, jack_default_audio_sample_t **out,
+				jack_nframes_t offset, jack_nframes_t n);
+static jack_nframes_t play(struct engine *e, struct buffer *b, jack_default_audio_sample_t **out,
+			   jack_nframes_t offset, jack_nframes_t n);
+static size_t heard(struct engine *e);
+
+int engine_init(struct engine *e, struct buffer *b, unsigned int nchannels)
+{
+	memset(e, 0, sizeof(struct engine));
+	e->b = b;
+	e->nchannels = nchannels;
+	e->mode = MODE_PAUSED;
+	e->wakeup = -1;
+	atomic_init(&e->click_on, 1);
+	e->click_gain = 1;
+	e->seam_pos = SEAM_FRAMES;
+	atomic_init(&e->position, 0);
+	atomic_init(&e->speed, SPEED_NORMAL);
+	buffer_init(&e->preroll, b->arena, nchannels);
+
+	if (ringbuffer_init(&e->to_process, MESSAGE_RING_SIZE * sizeof(struct message)) != 0
+	    || ringbuffer_init(&e->from_process, MESSAGE_RING_SIZE * sizeof(struct message)) != 0)
+		return -1;
+	return 0;
+}
+
+void engine_destroy(struct engine *e)
+{
+	buffer_reset(&e->preroll);
+	ringbuffer_free(&e->to_process);
+	ringbuffer_free(&e->from_process);
+}
+
+/*
+  Synchronize the mode switch for recording/playing with a metronome beat
+
+  Called at the beginning of every beat: if we were waiting for
+  synchronization, start recording/playing.
+
+  Store the current offset in delay
+*/
+static void metronome_synchronize(struct engine *e, jack_nframes_t offset, jack_nframes_t *delay)
+{
+	if (e->mode == MODE_REWAIT || e->mode == MODE_LIWAIT || e->mode == MODE_LOWAIT) {
+		if (e->mode == MODE_REWAIT)
+			e->mode = MODE_RECORD;
+		else if (e->mode == MODE_LIWAIT)
+			e->mode = MODE_LISTEN;
+		else if (e->mode == MODE_LOWAIT) {
+			e->mode = MODE_LOOP;
+			loop_start(e->loop, round_trip(e));
+		}
+		// and offset with the right number of frames to get synchronization
+		if (delay != NULL)
+			*delay = offset;
+	}
+}
+
+/*
+  Post a message on one of the rings
+  Messages are never split: if there isn't room for the whole message,
+  nothing is written
+*/
+int send_message(struct ringbuffer *r, char type, char m, const struct tempo *t)
+{
+	struct message msg;
+
+	if (ringbuffer_write_space(r) < sizeof(struct message))
+		return -1;
+	memset(&msg, 0, sizeof(struct message));
+	msg.type = type;
+	msg.mode = m;
+	if (t != NULL)
+		msg.tempo = *t;
+	ringbuffer_write(r, &msg, sizeof(struct message));
+	return 0;
+}
+
+/*
+  Hand a calibration over, both ways
+*/
+int send_calibration(struct ringbuffer *r, struct calibration *c)
+{
+	struct message msg;
+
+	if (ringbuffer_write_space(r) < sizeof(struct message))
+		return -1;
+	memset(&msg, 0, sizeof(struct message));
+	msg.type = MSG_CALIBRATE;
+	msg.calibration = c;
+	ringbuffer_write(r, &msg, sizeof(struct message));
+	return 0;
+}
+
+/*
+  Set the round trip latency measured by a calibration
+*/
+int send_latency(struct ringbuffer *r, size_t frames)
+{
+	struct message msg;
+
+	if (ringbuffer_write_space(r) < sizeof(struct message))
+		return -1;
+	memset(&msg, 0, sizeof(struct message));
+	msg.type = MSG_LATENCY;
+	msg.frames = frames;
+	ringbuffer_write(r, &msg, sizeof(struct message));
+	return 0;
+}
+
+/*
+  Hand a take over, both ways
+*/
+int send_take(struct ringbuffer *r, char type, struct buffer *take)
+{
+	struct message msg;
+
+	if (ringbuffer_write_space(r) < sizeof(struct message))
+		return -1;
+	memset(&msg, 0, sizeof(struct message));
+	msg.type = type;
+	msg.take = take;
+	ringbuffer_write(r, &msg, sizeof(struct message));
+	return 0;
+}
+
+/*
+  Give chunks the main loop doesn't need anymore back to the arena
+*/
+int send_chunks(struct ringbuffer *r, struct chunk *head, struct chunk *tail)
+{
+	struct message msg;
+
+	if (ringbuffer_write_space(r) < sizeof(struct message))
+		return -1;
+	memset(&msg, 0, sizeof(struct message));
+	msg.type = MSG_RELEASE;
+	msg.head = head;
+	msg.tail = tail;
+	ringbuffer_write(r, &msg, sizeof(struct message));
+	return 0;
+}
+
+/*
+  Hand a loop or one of its layers over, both ways
+*/
+int send_loop(struct ringbuffer *r, char type, struct loop *l, struct layer *layer, float gain)
+{
+	struct message msg;
+
+	if (ringbuffer_write_space(r) < sizeof(struct message))
+		return -1;
+	memset(&msg, 0, sizeof(struct message));
+	msg.type = type;
+	msg.loop = l;
+	msg.layer = layer;
+	msg.gain = gain;
+	ringbuffer_write(r, &msg, sizeof(struct message));
+	return 0;
+}
+
+/*
+  Send a position in a take, frames is the end of the region if any
+*/
+int send_cursor(struct ringbuffer *r, char type, struct buffer *take, const struct cursor *c, size_t frames)
+{
+	struct message msg;
+
+	if (ringbuffer_write_space(r) < sizeof(struct message))
+		return -1;
+	memset(&msg, 0, sizeof(struct message));
+	msg.type = type;
+	msg.take = take;
+	msg.cursor = *c;
+	msg.frames = frames;
+	ringbuffer_write(r, &msg, sizeof(struct message));
+	return 0;
+}
+
+/*
+  Post a message to the main loop from the audio thread
+  A message that doesn't fit is lost, count it
+*/
+static void report_message(struct engine *e, char type, char m)
+{
+	if (send_message(&e->from_process, type, m, NULL) != 0 && e->stats != NULL)
+		stats_count(&e->stats->lost_messages);
+}
+
+static void report_loop(struct engine *e, char type, struct layer *layer)
+{
+	if (send_loop(&e->from_process, type, e->loop, layer, 0) != 0 && e->stats != NULL)
+		stats_count(&e->stats->lost_messages);
+}
+
+// tell the main loop which take the audio thread works on
+static void report_take(struct engine *e, char type)
+{
+	if (send_take(&e->from_process, type, e->b) != 0 && e->stats != NULL)
+		stats_count(&e->stats->lost_messages);
+}
+
+/*
+  Apply the requests posted by the main loop
+  Called at the start of every period from the audio thread
+*/
+static void handle_messages(struct engine *e)
+{
+	struct message msg;
+
+	while (ringbuffer_read_space(&e->to_process) >= sizeof(struct message)) {
+		ringbuffer_read(&e->to_process, &msg, sizeof(struct message));
+		if (msg.type == MSG_MODE) {
+			change_mode(e, msg.mode);
+		} else if (msg.type == MSG_CLICK) {
+			metronome_schedule(&e->metronome, &msg.tempo);
+		} else if (msg.type == MSG_CALIBRATE) {
+			// only calibrate while waiting, otherwise give it back untouched
+			if (e->mode == MODE_PAUSED && e->calibration == NULL) {
+				msg.calibration->pos = 0;
+				e->calibration = msg.calibration;
+				change_mode(e, MODE_CALIBRATE);
+			} else if (send_calibration(&e->from_process, msg.calibration) != 0 && e->stats != NULL) {
+				stats_count(&e->stats->lost_messages);
+			}
+		} else if (msg.type == MSG_LATENCY) {
+			e->latency = (jack_nframes_t) msg.frames;
+			e->latency_set = 1;
+		} else if (msg.type == MSG_TAKE) {
+			// switch takes, unless one is being recorded
+			if (e->mode == MODE_PAUSED || e->mode == MODE_LIWAIT || e->mode == MODE_LISTEN) {
+				e->b = msg.take;
+				e->region_end = 0;
+				rewind_take(e);
+			}
+			report_take(e, MSG_TAKE);
+		} else if (msg.type == MSG_SEEK) {
+			// the cursors are only valid in the take they were found in
+			if (msg.take == e->b && (e->mode == MODE_PAUSED || e->mode == MODE_LIWAIT
+						 || e->mode == MODE_LISTEN)) {
+				// a stretched take fades out on the worker side
+				if (e->stretching) {
+					stretch_restart(e->stretch, e->mode == MODE_LISTEN);
+					buffer_seek(e->b, &msg.cursor);
+				} else {
+					jump(e, &msg.cursor, e->mode == MODE_LISTEN);
+				}
+			}
+		} else if (msg.type == MSG_REGION) {
+			if (msg.take == e->b && e->mode != MODE_RECORD && e->mode != MODE_REWAIT) {
+				e->region_start = msg.cursor;
+				e->region_end = msg.frames;
+			}
+		} else if (msg.type == MSG_SPARE) {
+			e->spare = msg.take;
+		} else if (msg.type == MSG_RELEASE) {
+			arena_put(e->b->arena, msg.head, msg.tail);
+		} else if (msg.type == MSG_LOOP) {
+			// only start looping while waiting, otherwise give it back untouched
+			if (e->mode == MODE_PAUSED && e->loop == NULL) {
+				e->loop = msg.loop;
+				change_mode(e, MODE_LOWAIT);
+			} else if (send_loop(&e->from_process, MSG_LOOP, msg.loop, NULL, 0) != 0 && e->stats != NULL) {
+				stats_count(&e->stats->lost_messages);
+			}
+		} else if (msg.type == MSG_OVERDUB) {
+			if (e->loop != NULL)
+				e->loop->overdub = msg.mode;
+		} else if (msg.type == MSG_LAYER) {
+			// a spare for a loop that is over is simply dropped
+			if (e->loop != NULL && msg.loop == e->loop)
+				e->loop->spare = msg.layer;
+		} else if (msg.type == MSG_GAIN) {
+			if (e->loop == NULL || msg.loop != e->loop || loop_correct(e->loop, msg.layer, msg.gain) != 0) {
+				if (send_loop(&e->from_process, MSG_GAIN, msg.loop, msg.layer, msg.gain) != 0
+				    && e->stats != NULL)
+					stats_count(&e->stats->lost_messages);
+			}
+		}
+	}
+}
+
+/*
+  Punch-in/out: pos is the position of the start of the period
+  Recording starts exactly at punch_in and stops exactly at punch_out,
+  whatever the metronome, start and end are set to the matching offsets
+  in the period
+  Going back before punch_in (a transport loop) arms the punch again
+  Returns 1 if recording stops in this period
+*/
+static int punch(struct engine *e, uint64_t pos, jack_nframes_t nframes,
+		 jack_nframes_t *start, jack_nframes_t *end)
+{
+	// what is played at punch_in is captured a round trip later
+	uint64_t in = e->punch_in + e->latency;
+	uint64_t out = e->punch_out + e->latency;
+
+	if (pos + nframes <= in) {
+		e->punch_armed = 1;
+		return 0;
+	}
+	if (!e->punch_armed)
+		return 0;
+
+	if (e->mode == MODE_PAUSED && pos < out) {
+		// a new take, the main loop is told that recording starts
+		change_mode(e, 0);
+		e->mode = MODE_RECORD;
+		e->skip = 0;
+		// the punch is exact, no pre-roll
+		e->starting = 0;
+		*start = pos < in ? (jack_nframes_t) (in - pos) : 0;
+	}
+	if (e->mode == MODE_RECORD && pos + nframes >= out) {
+		*end = pos < out ? (jack_nframes_t) (out - pos) : 0;
+		if (*end < *start)
+			*end = *start;
+		e->punch_armed = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+  Mute or unmute the click, from any thread
+  The metronome port stays connected, nothing changes in the JACK graph
+*/
+void engine_click(struct engine *e, int on)
+{
+	atomic_store(&e->click_on, on);
+}
+
+/*
+  Set the playback speed, in percent
+  Without a stretch worker, the takes are always played at 100%
+*/
+void engine_speed(struct engine *e, unsigned int speed)
+{
+	atomic_store(&e->speed, speed);
+}
+
+/*
+  Apply the click gain to the metronome output
+  The gain moves towards 0 or 1 by 1/CLICK_RAMP_FRAMES per frame, so
+  that a beep cut in the middle doesn't click; the steps are powers of
+  two, the gain reaches 0 and 1 exactly
+*/
+static void click_gain(struct engine *e, jack_default_audio_sample_t *buf, jack_nframes_t nframes)
+{
+	const float step = 1.0F / CLICK_RAMP_FRAMES;
+	float target = atomic_load_explicit(&e->click_on, memory_order_relaxed) ? 1.0F : 0.0F;
+	jack_nframes_t i;
+
+	if (e->click_gain == target) {
+		if (target == 0)
+			memset(buf, 0, nframes * sizeof(jack_default_audio_sample_t));
+		return;
+	}
+	for (i = 0; i < nframes; i++) {
+		if (e->click_gain < target)
+			e->click_gain = e->click_gain + step < target ? e->click_gain + step : target;
+		else if (e->click_gain > target)
+			e->click_gain = e->click_gain - step > target ? e->click_gain - step : target;
+		buf[i] *= e->click_gain;
+	}
+}
+
+/*
+  Set the punch-in/out positions, in frames
+  Only call this before the audio thread starts
+*/
+void engine_set_punch(struct engine *e, uint64_t in, uint64_t out)
+{
+	e->punch_in = in;
+	e->punch_out = out;
+	e->punch_armed = 1;
+}
+
+/*
+  Audio callback, called by the backend for every period
+  - first, apply the pending mode changes and tempo changes
+  - then, process the metronome output, following the transport if needed
+  - then, the punch-in/out
+  - then, handle the recording/playback
+  - then, measure the input levels
+  - finally, wake the main loop up if messages were posted for it
+  No lock is ever taken here, every period is processed
+  When stats are enabled, the time spent here is measured, and the page
+  faults taken are counted
+*/
+int engine_process(struct engine *e, jack_nframes_t nframes, struct period *p)
+{
+	struct buffer *b;
+	struct metronome *metronome = &e->metronome;
+	const struct transport *t = p->transport;
+	struct timespec t0, t1;
+	long minflt0 = 0, majflt0 = 0;
+
+	// the faults are sampled outside of the timed section
+	if (e->stats != NULL) {
+		thread_faults(&minflt0, &majflt0);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+	}
+
+	handle_messages(e);
+
+	// metronome
+	jack_nframes_t record_offset = 0;
+	jack_default_audio_sample_t *buf = p->metronome;
+	jack_nframes_t written = 0; // how many samples have been written to the buffer?
+	jack_nframes_t loop_wrap = nframes; // where a new pass of the loop starts
+
+	// following a transport that is stopped?
+	// no click, and waiting goes on until it rolls
+	if (t != NULL && !t->rolling) {
+		e->rolling = 0;
+		memset(buf, 0, nframes * sizeof(jack_default_audio_sample_t));
+	} else {
+		if (t != NULL) {
+			if (t->bbt) {
+				// the beats come from the transport
+				metronome_follow(metronome, t->bpm, t->beats_per_bar, t->beat, t->beat_fraction,
+						 t->resolution, !e->rolling);
+			} else {
+				// no tempo from the transport, only start with it
+				if (!e->rolling)
+					metronome_set(metronome, &metronome->tempo);
+				metronome_synchronize(e, 0, &record_offset);
+			}
+			e->rolling = 1;
+		}
+
+		// has a metronome been set up?
+		// no metronome
+		// write some silence, skip waiting mode and start recording/playing immediately
+		if (metronome->tempo.bpm == 0) {
+			metronome_synchronize(e, 0, NULL);
+			memset(buf, 0, nframes * sizeof(jack_default_audio_sample_t));
+		} else {
+			// we do have a metronome
+			// render up to the next tick, start it, and so on until the buffer is full
+			// the beeps come from the wavetables, the rest is silence
+			while (written < nframes) {
+				written += metronome_render(metronome, buf + written, nframes - written);
+				if (written < nframes && metronome_tick(metronome)) {
+					// the beats are counted from the one the loop started on
+					if (e->mode == MODE_LOOP && loop_beat(e->loop))
+						loop_wrap = written;
+					metronome_synchronize(e, written, &record_offset);
+				}
+			}
+		}
+	}
+	// the calibration must not hear the click
+	if (e->mode == MODE_CALIBRATE)
+		memset(buf, 0, nframes * sizeof(jack_default_audio_sample_t));
+	else
+		click_gain(e, buf, nframes);
+	// end metronome
+
+	// punch-in/out, on the transport if it is followed
+	jack_nframes_t record_end = nframes;
+	int punched_out = 0;
+	if (e->punch_out > e->punch_in && (t == NULL || t->rolling))
+		punched_out = punch(e, t != NULL ? t->frame : e->clock, nframes, &record_offset, &record_end);
+	e->clock += nframes;
+
+	// recording/playing, the take may have changed with the messages or the punch-in
+	b = e->b;
+	jack_nframes_t record_size = record_end - record_offset;
+	jack_nframes_t meter_offset = 0, meter_size = nframes;
+	struct buffer *recording = NULL;
+	unsigned int k;
+
+	if (e->mode == MODE_RECORD) {
+		// follow the capture latency, the round trip is taken from it
+		e->input_latency_range = p->capture_latency;
+
+		// a new take: the end of the pre-roll, up to where recording starts,
+		// goes in front of it
+		if (e->starting) {
+			e->starting = 0;
+			if (e->preroll_frames > 0) {
+				buffer_roll(&e->preroll, p->in, 0, record_offset, e->preroll_frames);
+				adopt_preroll(e, b);
+			}
+		}
+
+		// skip what was captured before the first beat was heard
+		if (e->skip > 0) {
+			jack_nframes_t n = e->skip < record_size ? e->skip : record_size;
+			record_offset += n;
+			record_size -= n;
+			e->skip -= n;
+		}
+		// only what goes into the take counts for its clipped samples
+		meter_offset = record_offset;
+		meter_size = record_size;
+		recording = b;
+
+		// append the samples to the take, chunks come from the preallocated arena
+		if (buffer_append(b, p->in, record_offset, record_size) < record_size && e->stats != NULL)
+			stats_count(&e->stats->dropped_periods);
+		if (e->stream != NULL)
+			stream_push(e->stream, p->in, record_offset, record_size);
+		if (punched_out) {
+			// the take is complete, wait for the next punch-in
+			change_mode(e, 0);
+			change_mode(e, MODE_PAUSED);
+		}
+	} else if (e->mode == MODE_LISTEN) {
+		// get a sample from the buffer and play it
+		for (k = 0; k < e->nchannels; k++)
+			memset(p->out[k], 0, record_offset * sizeof(jack_default_audio_sample_t));
+		jack_nframes_t read = play(e, b, p->out, record_offset, record_size);
+		// not enough data in the recording buffer to fill the output buffer?
+		if (read < record_size) {
+			// fill the rest with zeroes
+			for (k = 0; k < e->nchannels; k++)
+				memset(p->out[k] + record_offset + read, 0,
+				       (record_size - read) * sizeof(jack_default_audio_sample_t));
+			// playback complete, switch mode
+			change_mode(e, 0);
+		}
+	} else if (e->mode == MODE_LOOP) {
+		// play the layers, and record a new one if overdubbing
+		for (k = 0; k < e->nchannels; k++)
+			memset(p->out[k], 0, record_offset * sizeof(jack_default_audio_sample_t));
+		struct layer *layer = loop_process(e->loop, p->in, p->out, record_offset, nframes - record_offset,
+						   loop_wrap, round_trip(e));
+		if (layer != NULL)
+			report_loop(e, MSG_LAYER, layer);
+		if (e->loop->started) {
+			e->loop->started = 0;
+			report_loop(e, MSG_OVERDUB, e->loop->rec);
+		}
+	} else if (e->mode == MODE_CALIBRATE) {
+		// play the test sequence and capture it, then let the main loop analyze it
+		if (calibration_process(e->calibration, p->in[0], p->out, e->nchannels, 0, nframes)) {
+			if (send_calibration(&e->from_process, e->calibration) != 0 && e->stats != NULL)
+				stats_count(&e->stats->lost_messages);
+			e->calibration = NULL;
+			change_mode(e, MODE_PAUSED);
+		}
+	} else {
+		// if we are neither recording nor playing, write some silence
+		for (k = 0; k < e->nchannels; k++)
+			memset(p->out[k], 0, nframes * sizeof(jack_default_audio_sample_t));
+	}
+
+	// the calibration sequence is no music, it isn't metered
+	if (e->meter != NULL && e->mode != MODE_CALIBRATE) {
+		unsigned long clips = meter_process(e->meter, p->in, meter_offset, meter_size);
+		if (recording != NULL)
+			recording->clipped += clips;
+	}
+
+	// keep the input for the pre-roll of the next take
+	if (e->preroll_frames > 0 && recording == NULL && e->mode != MODE_CALIBRATE)
+		buffer_roll(&e->preroll, p->in, 0, nframes, e->preroll_frames);
+
+	atomic_store_explicit(&e->position, heard(e), memory_order_relaxed);
+	// one byte per period at most, the pipe never blocks: when it's full,
+	// the main loop is awake anyway
+	if (e->wakeup >= 0 && ringbuffer_written(&e->from_process) != e->posted) {
+		char byte = 0;
+		ssize_t w = write(e->wakeup, &byte, 1);
+		(void) w;
+		e->posted = ringbuffer_written(&e->from_process);
+	}
+
+	if (e->stats != NULL) {
+		long minflt, majflt;
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		thread_faults(&minflt, &majflt);
+		stats_record(e->stats, &t0, &t1, nframes);
+		stats_faults(e->stats, minflt - minflt0, majflt - majflt0);
+	}
+	return 0;
+}
+
+/*
+  Delay between a frame played and the same frame captured: measured,
+  or the capture latency reported by the backend
+*/
+static jack_nframes_t round_trip(struct engine *e)
+{
+	if (e->latency_set)
+		return e->latency;
+	return (e->input_latency_range.min + e->input_latency_range.max) / 2;
+}
+
+/*
+  Put the end of the pre-roll in front of the take that starts
+  The take normally starts skip frames (a round trip) after the beat, the
+  pre-roll takes the place of these frames first
+  With a metronome, the pre-roll is made of whole beats so that the take
+  stays on the click when it is replayed
+*/
+static void adopt_preroll(struct engine *e, struct buffer *b)
+{
+	size_t avail = e->preroll.frames + e->skip;
+	size_t want = e->preroll_frames;
+
+	if (e->metronome.tempo.bpm != 0 && e->metronome.bpm > 0) {
+		double beat = (double) e->metronome.beep->srate * 60 / e->metronome.bpm;
+		size_t beats = (size_t) ((double) want / beat);
+		while (beats > 0 && (size_t) lrint((double) beats * beat) > avail)
+			beats--;
+		want = (size_t) lrint((double) beats * beat);
+	} else if (want > avail) {
+		want = avail;
+	}
+
+	if (want <= e->skip) {
+		e->skip -= (jack_nframes_t) want;
+		return;
+	}
+	// indexing the pre-roll could take longer than a period: the take is
+	// recorded without an index, the main loop builds it afterwards
+	if (buffer_adopt(b, &e->preroll, want - e->skip) > 0)
+		b->peaks = NULL;
+	e->skip = 0;
+}
+
+/*
+  Move back to the start of the take, or of its A-B region
+  A calibrated take is already aligned, otherwise skip the capture latency
+*/
+static void rewind_take(struct engine *e)
+{
+	if (e->stretching)
+		stretch_restart(e->stretch, 0);
+	if (e->region_end > 0)
+		buffer_seek(e->b, &e->region_start);
+	else if (e->latency_set)
+		buffer_rewind(e->b, 0);
+	else
+		buffer_rewind(e->b, (e->input_latency_range.min + e->input_latency_range.max) / 2);
+}
+
+/*
+  The main loop cycles through 3 states:
+  - MODE_RECORD: the audio input is stored in a buffer
+  - MODE_LISTEN: playback the buffer
+  - MODE_PAUSE:  wait
+  The natural sequence is PAUSE > RECORD > LISTEN > PAUSE
+
+  In MODE_PAUSE, we may switch back directly to MODE_LISTEN, which
+  restarts playback of the current audio buffer.
+
+  MODE_LIWAIT and MODE_REWAIT wait for synchronization with the
+  metronome. As soon as we are in sync with the metronome (at the
+  start of the next click), recording/playback begins.
+
+  From MODE_PAUSE, a loop handed over by the main loop goes through
+  MODE_LOWAIT to MODE_LOOP in the same way, and back to MODE_PAUSE.
+*/
+void change_mode(struct engine *e, char m)
+{
+	struct layer *layer;
+
+	if (m != 0) {
+		e->mode = m;
+	} else {
+		switch (e->mode) {
+		case MODE_RECORD:
+			e->mode = MODE_LIWAIT;
+			if (e->stream != NULL)
+				stream_end(e->stream);
+			// set the offset to the start of the buffer
+			buffer_rewind(e->b, 0);
+			if (e->stretching)
+				stretch_restart(e->stretch, 0);
+			break;
+		case MODE_LISTEN:
+			e->mode = MODE_PAUSED;
+			rewind_take(e);
+			break;
+		case MODE_PAUSED:
+			e->mode = MODE_REWAIT;
+			// record in the spare take, the last one stays in the history
+			// without a spare, the last take is overwritten and its chunks
+			// go back to the arena
+			if (e->spare != NULL) {
+				e->b = e->spare;
+				e->spare = NULL;
+			}
+			buffer_reset(e->b);
+			if (e->b->peaks != NULL)
+				peaks_reset(e->b->peaks);
+			e->region_end = 0;
+			report_take(e, MSG_SPARE);
+			e->skip = e->latency;
+			e->starting = 1;
+			if (e->stream != NULL)
+				stream_begin(e->stream);
+			break;
+		case MODE_LOWAIT:
+		case MODE_LOOP:
+			e->mode = MODE_PAUSED;
+			// keep the layer being recorded as it is, and give the loop back
+			layer = loop_stop(e->loop);
+			if (layer != NULL)
+				report_loop(e, MSG_LAYER, layer);
+			report_loop(e, MSG_LOOP, NULL);
+			e->loop = NULL;
+			break;
+		}
+	}
+	// let the main loop know about the new mode
+	report_message(e, MSG_MODE, e->mode);
+}
+
+/*
+  Move the playback position to c
+  With fade, the frames that would have been played next are kept, and
+  faded out over the first frames played from c, so the jump doesn't click
+*/
+static void jump(struct engine *e, const struct cursor *c, int fade)
+{
+	jack_default_audio_sample_t *seam[MAX_CHANNELS];
+	jack_nframes_t got;
+	unsigned int k;
+
+	if (fade) {
+		for (k = 0; k < e->nchannels; k++)
+			seam[k] = e->seam + k * SEAM_FRAMES;
+		got = buffer_read(e->b, seam, 0, SEAM_FRAMES);
+		for (k = 0; k < e->nchannels; k++)
+			memset(seam[k] + got, 0, (SEAM_FRAMES - got) * sizeof(jack_default_audio_sample_t));
+		e->seam_pos = 0;
+	}
+	buffer_seek(e->b, c);
+}
+
+// crossfade the n frames just played at offset with what was left before the jump
+static void fade_seam(struct engine *e, jack_default_audio_sample_t **out, jack_nframes_t offset, jack_nframes_t n)
+{
+	jack_nframes_t len = SEAM_FRAMES - e->seam_pos, i;
+	unsigned int k;
+
+	if (len > n)
+		len = n;
+	for (k = 0; k < e->nchannels; k++) {
+		jack_default_audio_sample_t *o = out[k] + offset;
+		const jack_default_audio_sample_t *s = e->seam + k * SEAM_FRAMES + e->seam_pos;
+		for (i = 0; i < len; i++) {
+			float g = (float) (e->seam_pos + i + 1) / (SEAM_FRAMES + 1);
+			o[i] = g * o[i] + (1 - g) * s[i];
+		}
+	}
+	e->seam_pos += len;
+}
+
+/*
+  Play n frames of the take at offset in out
+  With an A-B region, playback jumps back to its start when it reaches
+  its end, anywhere in the period: the cursor was found by the main loop,
+  the jump is O(1) and allocates nothing
+  Returns the number of frames played, less than n at the end of the take
+*/
+static jack_nframes_t play_take(struct engine *e, struct buffer *b, jack_default_audio_sample_t **out,
+				jack_nframes_t offset, jack_nframes_t n)
+{
+	int region = e->region_end > e->region_start.frame;
+	jack_nframes_t done = 0;
+
+	while (done < n) {
+		jack_nframes_t len = n - done, got;
+		if (region && buffer_tell(b) >= e->region_end)
+			jump(e, &e->region_start, 1);
+		if (region && len > e->region_end - buffer_tell(b))
+			len = (jack_nframes_t) (e->region_end - buffer_tell(b));
+		got = buffer_read(b, out, offset + done, len);
+		if (e->seam_pos < SEAM_FRAMES)
+			fade_seam(e, out, offset + done, got);
+		done += got;
+		if (got < len)
+			break;
+	}
+	return done;
+}
+
+/*
+  Frame of the take being heard: a stretched take is played behind the
+  position it is read from, by what is queued in the worker
+  In a region, that may be before its start, at the end of the last pass
+*/
+static size_t heard(struct engine *e)
+{
+	size_t position = buffer_tell(e->b), lag, len;
+
+	if (!e->stretching)
+		return position;
+	lag = stretch_lag(e->stretch);
+	if (e->region_end > e->region_start.frame && position >= e->region_start.frame) {
+		len = e->region_end - e->region_start.frame;
+		lag %= len;
+		return position - e->region_start.frame >= lag ? position - lag : position + len - lag;
+	}
+	return position > lag ? position - lag : 0;
+}
+
+/*
+  Play n frames of the take at offset in out, at the speed set by the
+  main loop
+  Away from 100%, the frames of the take are pushed to the stretch worker
+  as it needs them, and what it produced is played: two copies, the
+  stretch itself runs in the worker
+  The period where the speed leaves 100% is still played as it is, faded
+  out, the worker output fades in; the one where it comes back fades out
+  the worker output, and the take goes on from the frame being heard,
+  behind the ones pushed to the worker: a handful of chunks to walk
+  Returns the number of frames played, less than n at the end of the take
+*/
+static jack_nframes_t play(struct engine *e, struct buffer *b, jack_default_audio_sample_t **out,
+			   jack_nframes_t offset, jack_nframes_t n)
+{
+	struct stretch *s = e->stretch;
+	unsigned int speed = atomic_load_explicit(&e->speed, memory_order_relaxed);
+	jack_default_audio_sample_t *seam[MAX_CHANNELS];
+	jack_nframes_t want, got, len, i;
+	struct cursor c;
+	unsigned int k;
+
+	if (s == NULL || (speed == SPEED_NORMAL && !e->stretching))
+		return play_take(e, b, out, offset, n);
+
+	if (speed == SPEED_NORMAL) {
+		buffer_locate(b, heard(e), &c);
+		for (k = 0; k < e->nchannels; k++)
+			seam[k] = e->seam + k * SEAM_FRAMES;
+		stretch_pull(s, seam, 0, SEAM_FRAMES);
+		e->seam_pos = 0;
+		stretch_restart(s, 0);
+		e->stretching = 0;
+		buffer_seek(b, &c);
+		return play_take(e, b, out, offset, n);
+	}
+
+	if (!e->stretching) {
+		got = play_take(e, b, out, offset, n);
+		len = got < SEAM_FRAMES ? got : SEAM_FRAMES;
+		for (k = 0; k < e->nchannels; k++)
+			for (i = 0; i < len; i++)
+				out[k][offset + got - len + i] *= (float) (len - i) / (float) (len + 1);
+		stretch_restart(s, 0);
+		e->stretching = 1;
+		return got;
+	}
+
+	atomic_store_explicit(&s->speed, speed, memory_order_relaxed);
+	for (want = stretch_wants(s, n); want > 0; want -= got) {
+		len = want < STRETCH_SCRATCH_FRAMES ? want : STRETCH_SCRATCH_FRAMES;
+		got = play_take(e, b, s->feed, 0, len);
+		stretch_push(s, s->feed, 0, got);
+		if (got < len)
+			break;
+	}
+	got = stretch_pull(s, out, offset, n);
+
+	// the end of the take: once the worker has played what it could,
+	// less than a segment is left
+	if (got < n && (e->region_end <= e->region_start.frame && buffer_tell(b) >= b->frames)
+	    && ringbuffer_read_space(&s->input) < STRETCH_WINDOW * e->nchannels * sizeof(jack_default_audio_sample_t))
+		return got;
+	return n;
+}
@@ -0,0 +1,144 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <jack/jack.h>
+
+#include "buffer.h"
+#include "ringbuffer.h"
+#include "metronome.h"
+
+struct stream;
+struct stretch;
+struct stats;
+struct meter;
+
+// the click fades in or out over this many frames when it is (un)muted
+#define CLICK_RAMP_FRAMES 256
+// playback jumps fade over this many frames
+#define SEAM_FRAMES 256
+// seek step, in seconds
+#define SEEK_SECONDS 5
+
+/*
+  Recording/playback core, independent of the audio backend
+  The backend calls engine_process() once per period from its audio
+  thread, the rest of the program only talks to it through the rings
+*/
+struct engine
+{
+	// the take being recorded or played, and an empty one for the next
+	// recording, both handed over by the main loop
+	struct buffer *b;
+	struct buffer *spare;
+	unsigned int nchannels;
+	struct stream *stream;
+	struct stats *stats;
+	// input levels, if set
+	struct meter *meter;
+
+	// owned by the audio thread, only changed through messages
+	struct metronome metronome;
+	// set by the main loop, the gain follows it in the audio thread
+	atomic_int click_on;
+	float click_gain;
+
+	// follow the transport of the backend, if it has one
+	char follow_transport;
+	char rolling;
+
+	// punch-in/out positions in frames, on the transport if it is followed,
+	// on the engine clock (frames since the start) otherwise
+	uint64_t clock;
+	uint64_t punch_in;
+	uint64_t punch_out;
+	char punch_armed;
+
+	// loop/overdub, handed over by the main loop
+	struct loop *loop;
+
+	// measured round trip latency, the first latency frames of a take are skipped
+	struct calibration *calibration;
+	jack_nframes_t latency;
+	char latency_set;
+	jack_nframes_t skip;
+	jack_latency_range_t input_latency_range;
+
+	// the last input, kept while not recording: up to preroll_frames of it
+	// are put in front of the next take
+	struct buffer preroll;
+	jack_nframes_t preroll_frames;
+	char starting;
+	char mode;
+
+	// A-B region of the take being played, repeated until it is cleared:
+	// at region_end, playback jumps back to region_start
+	struct cursor region_start;
+	size_t region_end;
+	// what followed the position before the last jump, faded out over
+	// the first SEAM_FRAMES frames after it
+	jack_default_audio_sample_t seam[MAX_CHANNELS * SEAM_FRAMES];
+	jack_nframes_t seam_pos;
+	// playback position, published at the end of every period
+	atomic_size_t position;
+	// variable speed playback, if set: the speed in percent is set by the
+	// main loop, stretching is set while the take goes through the worker
+	struct stretch *stretch;
+	atomic_uint speed;
+	char stretching;
+
+	// the only channels between the audio thread and the rest of the program
+	struct ringbuffer to_process;
+	struct ringbuffer from_process;
+	// a byte is written there in the periods that post messages, if it is set
+	int wakeup;
+	size_t posted;
+};
+
+/*
+  State of an external transport at the start of a period
+  The tempo fields are only valid if bbt is set
+*/
+struct transport
+{
+	char rolling;
+	jack_nframes_t frame;
+	char bbt;
+	double bpm;
+	unsigned int beats_per_bar;
+	unsigned int beat;
+	double beat_fraction;
+	double resolution;
+};
+
+/*
+  Buffers of one period, provided by the backend
+  transport is NULL if the backend doesn't have one, or if it isn't followed
+*/
+struct period
+{
+	jack_default_audio_sample_t *in[MAX_CHANNELS];
+	jack_default_audio_sample_t *out[MAX_CHANNELS];
+	jack_default_audio_sample_t *metronome;
+	jack_latency_range_t capture_latency;
+	const struct transport *transport;
+};
+
+int engine_init(struct engine *e, struct buffer *b, unsigned int nchannels);
+void engine_destroy(struct engine *e);
+int engine_process(struct engine *e, jack_nframes_t nframes, struct period *p);
+void change_mode(struct engine *e, char m);
+void engine_click(struct engine *e, int on);
+void engine_speed(struct engine *e, unsigned int speed);
+void engine_set_punch(struct engine *e, uint64_t in, uint64_t out);
+int send_calibration(struct ringbuffer *r, struct calibration *c);
+int send_latency(struct ringbuffer *r, size_t frames);
+int send_take(struct ringbuffer *r, char type, struct buffer *take);
+int send_chunks(struct ringbuffer *r, struct chunk *head, struct chunk *tail);
+int send_loop(struct ringbuffer *r, char type, struct loop *l, struct layer *layer, float gain);
+int send_message(struct ringbuffer *r, char type, char m, const struct tempo *t);
+int send_cursor(struct ringbuffer *r, char type, struct buffer *take, const struct cursor *c, size_t frames);
+
+#endif // ENGINE_H
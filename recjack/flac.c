@@ -0,0 +1,679 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <jack/jack.h>
+
+#include "recjack.h"
+#include "wave.h"
+#include "convert.h"
+#include "flac.h"
+
+#define BATCH_FRAMES ((size_t) FLAC_BLOCK * FLAC_BATCH_BLOCKS)
+// largest Rice parameter, 15 is the escape code
+#define RICE_MAX 14
+
+enum { SUBFRAME_CONSTANT, SUBFRAME_VERBATIM, SUBFRAME_FIXED };
+
+// channel assignments of a stereo frame, besides independent channels
+enum { STEREO_LEFT_SIDE = 8, STEREO_SIDE_RIGHT, STEREO_MID_SIDE };
+
+static uint8_t crc8_table[256];
+static uint16_t crc16_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/*
+  Bit writer, MSB first
+  The buffer is sized for the worst case, there is no bounds check
+*/
+struct bits
+{
+	uint8_t *buf;
+	size_t len;
+	uint64_t acc;
+	unsigned int n;
+};
+
+/*
+  How a channel of a frame is coded, and its size in bits
+  The Rice parameters are per partition of the residual
+*/
+struct subframe
+{
+	unsigned int type;
+	unsigned int order;
+	unsigned int porder;
+	unsigned int params[1 << FLAC_MAX_PARTITION];
+	uint64_t bits;
+};
+
+/*
+  Shared state of the encoder
+  The workers take batches of frames in turn, encode them in parallel
+  and write them in order
+*/
+struct flac_encoder
+{
+	pthread_mutex_t lock;
+	pthread_cond_t turn;
+	int fd;
+	int error;
+
+	// read cursor over the take, or the mapped file
+	struct buffer src;
+	const struct wave_map *map;
+	unsigned int nchannels;
+	unsigned long srate;
+	unsigned int rate_code;
+	size_t frames;
+
+	size_t next_frame;
+	unsigned long next_batch;
+	unsigned long next_write;
+
+	// for the STREAMINFO block
+	size_t bytes;
+	unsigned int min_frame;
+	unsigned int max_frame;
+};
+
+struct worker
+{
+	struct flac_encoder *enc;
+	pthread_t thread;
+	// a batch of planar samples, as floats then 16-bit
+	jack_default_audio_sample_t *fbuf;
+	int16_t *pcm;
+	// a frame: the channels, plus side and mid for stereo
+	int32_t *x;
+	int32_t *res;
+	struct bits out;
+};
+
+static void crc_init(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 256; i++) {
+		unsigned int c8 = i, c16 = i << 8;
+		for (j = 0; j < 8; j++) {
+			c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : c8 << 1;
+			c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : c16 << 1;
+		}
+		crc8_table[i] = (uint8_t) c8;
+		crc16_table[i] = (uint16_t) c16;
+	}
+}
+
+static uint8_t crc8(const uint8_t *p, size_t n)
+{
+	uint8_t c = 0;
+
+	while (n-- > 0)
+		c = crc8_table[c ^ *p++];
+	return c;
+}
+
+static uint16_t crc16(const uint8_t *p, size_t n)
+{
+	uint16_t c = 0;
+
+	while (n-- > 0)
+		c = (uint16_t) ((c << 8) ^ crc16_table[(c >> 8) ^ *p++]);
+	return c;
+}
+
+static void put_bits(struct bits *w, uint32_t v, unsigned int n)
+{
+	w->acc = (w->acc << n) | (v & (uint32_t) ((1ULL << n) - 1));
+	w->n += n;
+	while (w->n >= 8) {
+		w->n -= 8;
+		w->buf[w->len++] = (uint8_t) (w->acc >> w->n);
+	}
+}
+
+static void put_zeros(struct bits *w, uint32_t n)
+{
+	while (n > 32) {
+		put_bits(w, 0, 32);
+		n -= 32;
+	}
+	put_bits(w, 0, n);
+}
+
+// signed residual, folded to unsigned then Rice coded with parameter k
+static void put_rice(struct bits *w, int32_t r, unsigned int k)
+{
+	uint32_t u = ((uint32_t) r << 1) ^ (uint32_t) (r >> 31);
+
+	put_zeros(w, u >> k);
+	put_bits(w, (1U << k) | (u & ((1U << k) - 1)), k + 1);
+}
+
+static void put_align(struct bits *w)
+{
+	if (w->n > 0)
+		put_bits(w, 0, 8 - w->n);
+}
+
+// frame numbers are coded like UTF-8 characters
+static void put_utf8(struct bits *w, uint32_t v)
+{
+	unsigned int nb, i;
+
+	if (v < 0x80) {
+		put_bits(w, v, 8);
+		return;
+	}
+	for (nb = 2; nb < 6 && v >= 1U << (5 * nb + 1); nb++)
+		;
+	put_bits(w, ((0xFF00U >> nb) & 0xFF) | (v >> (6 * (nb - 1))), 8);
+	for (i = nb - 1; i > 0; i--)
+		put_bits(w, 0x80 | ((v >> (6 * (i - 1))) & 0x3F), 8);
+}
+
+static unsigned int rate_code(unsigned long srate)
+{
+	switch (srate) {
+	case 88200: return 1;
+	case 176400: return 2;
+	case 192000: return 3;
+	case 8000: return 4;
+	case 16000: return 5;
+	case 22050: return 6;
+	case 24000: return 7;
+	case 32000: return 8;
+	case 44100: return 9;
+	case 48000: return 10;
+	case 96000: return 11;
+	default: return 0; // read from STREAMINFO
+	}
+}
+
+/*
+  The stream header: the marker and the STREAMINFO block
+  The frame sizes are only known at the end, the header is written
+  again then
+*/
+static void flac_header(uint8_t *p, const struct flac_encoder *enc)
+{
+	struct bits w = {p, 0, 0, 0};
+	unsigned int block = enc->frames < FLAC_BLOCK ? (unsigned int) enc->frames : FLAC_BLOCK;
+	unsigned int i;
+
+	put_bits(&w, 0x664C6143, 32); // fLaC
+	// last metadata block, STREAMINFO, 34 bytes
+	put_bits(&w, 0x80, 8);
+	put_bits(&w, 34, 24);
+	put_bits(&w, block, 16);
+	put_bits(&w, block, 16);
+	put_bits(&w, enc->min_frame == UINT_MAX ? 0 : enc->min_frame, 24);
+	put_bits(&w, enc->max_frame, 24);
+	put_bits(&w, (uint32_t) enc->srate, 20);
+	put_bits(&w, enc->nchannels - 1, 3);
+	put_bits(&w, DEPTH - 1, 5);
+	put_bits(&w, (uint32_t) ((uint64_t) enc->frames >> 32), 4);
+	put_bits(&w, (uint32_t) enc->frames, 32);
+	// no MD5 signature, it would have to be computed in order
+	for (i = 0; i < 4; i++)
+		put_bits(&w, 0, 32);
+}
+
+// residual of the fixed predictor of the given order, from x[order] on
+static void fixed_residual(int32_t *res, const int32_t *x, unsigned int n, unsigned int order)
+{
+	unsigned int i;
+
+	switch (order) {
+	case 0:
+		for (i = 0; i < n; i++)
+			res[i] = x[i];
+		break;
+	case 1:
+		for (i = 1; i < n; i++)
+			res[i] = x[i] - x[i - 1];
+		break;
+	case 2:
+		for (i = 2; i < n; i++)
+			res[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+		break;
+	case 3:
+		for (i = 3; i < n; i++)
+			res[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+		break;
+	case 4:
+		for (i = 4; i < n; i++)
+			res[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+		break;
+	}
+}
+
+/*
+  Bits of a partition of count residuals summing to sum once folded,
+  with the best Rice parameter
+  (sum >> k) is never less than the sum of the shifted residuals, this
+  is an upper bound of the exact size
+*/
+static uint64_t rice_bits(uint64_t sum, unsigned int count, unsigned int *param)
+{
+	uint64_t best = UINT64_MAX;
+	unsigned int k;
+
+	for (k = 0; k <= RICE_MAX; k++) {
+		uint64_t bits = (uint64_t) count * (k + 1) + (sum >> k);
+		if (bits < best) {
+			best = bits;
+			*param = k;
+		}
+	}
+	return best;
+}
+
+/*
+  Size of the residual with the best partition order
+  The sums of the finest partitions are merged two by two for the
+  coarser orders
+*/
+static uint64_t residual_bits(struct subframe *sf, const int32_t *res, unsigned int n, unsigned int order)
+{
+	uint64_t sums[1 << FLAC_MAX_PARTITION];
+	unsigned int params[1 << FLAC_MAX_PARTITION];
+	unsigned int pmax = FLAC_MAX_PARTITION, p, i, j;
+	uint64_t best = UINT64_MAX;
+
+	// the partitions must split the frame evenly, and be longer than the warm-up
+	while (pmax > 0 && ((n & ((1U << pmax) - 1)) != 0 || (n >> pmax) <= order))
+		pmax--;
+	for (i = 0; i < 1U << pmax; i++) {
+		uint64_t s = 0;
+		for (j = i == 0 ? order : i * (n >> pmax); j < (i + 1) * (n >> pmax); j++)
+			s += ((uint32_t) res[j] << 1) ^ (uint32_t) (res[j] >> 31);
+		sums[i] = s;
+	}
+
+	for (p = pmax; ; p--) {
+		uint64_t bits = 2 + 4;
+		for (i = 0; i < 1U << p; i++)
+			bits += 4 + rice_bits(sums[i], (n >> p) - (i == 0 ? order : 0), &params[i]);
+		if (bits < best) {
+			best = bits;
+			sf->porder = p;
+			memcpy(sf->params, params, (1U << p) * sizeof(unsigned int));
+		}
+		if (p == 0)
+			break;
+		for (i = 0; i < 1U << (p - 1); i++)
+			sums[i] = sums[2 * i] + sums[2 * i + 1];
+	}
+	return best;
+}
+
+/*
+  Pick the smallest coding of a channel: constant, verbatim, or one of
+  the fixed predictors
+*/
+static void analyze(struct subframe *sf, const int32_t *x, unsigned int n, unsigned int bps, int32_t *res)
+{
+	unsigned int i, order;
+
+	for (i = 1; i < n && x[i] == x[0]; i++)
+		;
+	if (i >= n) {
+		sf->type = SUBFRAME_CONSTANT;
+		sf->bits = 8 + bps;
+		return;
+	}
+
+	sf->type = SUBFRAME_VERBATIM;
+	sf->bits = 8 + (uint64_t) n * bps;
+	for (order = 0; order <= FLAC_MAX_ORDER && order < n; order++) {
+		struct subframe f;
+		fixed_residual(res, x, n, order);
+		f.bits = 8 + (uint64_t) order * bps + residual_bits(&f, res, n, order);
+		if (f.bits < sf->bits) {
+			f.type = SUBFRAME_FIXED;
+			f.order = order;
+			*sf = f;
+		}
+	}
+}
+
+static void write_subframe(struct bits *w, const struct subframe *sf, const int32_t *x, unsigned int n,
+			   unsigned int bps, int32_t *res)
+{
+	unsigned int i, p;
+
+	if (sf->type == SUBFRAME_CONSTANT) {
+		put_bits(w, 0x00, 8);
+		put_bits(w, (uint32_t) x[0], bps);
+		return;
+	}
+	if (sf->type == SUBFRAME_VERBATIM) {
+		put_bits(w, 0x02, 8);
+		for (i = 0; i < n; i++)
+			put_bits(w, (uint32_t) x[i], bps);
+		return;
+	}
+
+	put_bits(w, (0x08 | sf->order) << 1, 8);
+	for (i = 0; i < sf->order; i++)
+		put_bits(w, (uint32_t) x[i], bps);
+	fixed_residual(res, x, n, sf->order);
+	// Rice coding with 4-bit parameters
+	put_bits(w, 0, 2);
+	put_bits(w, sf->porder, 4);
+	for (p = 0, i = sf->order; p < 1U << sf->porder; p++) {
+		unsigned int end = (p + 1) * (n >> sf->porder), k = sf->params[p];
+		put_bits(w, k, 4);
+		for (; i < end; i++)
+			put_rice(w, res[i], k);
+	}
+}
+
+/*
+  Encode n frames of the batch from offset first as one FLAC frame
+  Stereo frames are also tried as left/side, side/right and mid/side
+*/
+static void encode_frame(struct worker *wk, size_t first, unsigned int n, uint32_t number)
+{
+	const struct flac_encoder *enc = wk->enc;
+	struct bits *w = &wk->out;
+	struct subframe sf[MAX_CHANNELS];
+	unsigned int bps[MAX_CHANNELS];
+	const int32_t *x[MAX_CHANNELS];
+	unsigned int nch = enc->nchannels, k, i, assignment = nch - 1, a = 0, b = 1;
+	size_t start = w->len;
+
+	for (k = 0; k < nch; k++) {
+		int32_t *dst = wk->x + (size_t) k * FLAC_BLOCK;
+		const int16_t *src = wk->pcm + k * BATCH_FRAMES + first;
+		for (i = 0; i < n; i++)
+			dst[i] = src[i];
+		x[k] = dst;
+		bps[k] = DEPTH;
+	}
+
+	if (nch == 2) {
+		int32_t *side = wk->x + 2 * FLAC_BLOCK, *mid = wk->x + 3 * FLAC_BLOCK;
+		uint64_t best;
+		for (i = 0; i < n; i++) {
+			side[i] = x[0][i] - x[1][i];
+			mid[i] = (x[0][i] + x[1][i]) >> 1;
+		}
+		x[2] = side;
+		x[3] = mid;
+		bps[2] = DEPTH + 1;
+		bps[3] = DEPTH;
+		for (k = 0; k < 4; k++)
+			analyze(&sf[k], x[k], n, bps[k], wk->res);
+
+		best = sf[0].bits + sf[1].bits;
+		if (sf[0].bits + sf[2].bits < best) {
+			best = sf[0].bits + sf[2].bits;
+			assignment = STEREO_LEFT_SIDE;
+			b = 2;
+		}
+		if (sf[2].bits + sf[1].bits < best) {
+			best = sf[2].bits + sf[1].bits;
+			assignment = STEREO_SIDE_RIGHT;
+			a = 2;
+			b = 1;
+		}
+		if (sf[3].bits + sf[2].bits < best) {
+			assignment = STEREO_MID_SIDE;
+			a = 3;
+			b = 2;
+		}
+	} else {
+		for (k = 0; k < nch; k++)
+			analyze(&sf[k], x[k], n, bps[k], wk->res);
+	}
+
+	// frame header, fixed block size
+	put_bits(w, 0xFFF8, 16);
+	// 12 is 4096 frames, 7 a 16-bit size at the end of the header
+	put_bits(w, n == FLAC_BLOCK ? 12 : 7, 4);
+	put_bits(w, enc->rate_code, 4);
+	put_bits(w, assignment, 4);
+	// 16 bits per sample
+	put_bits(w, 0x8, 4);
+	put_utf8(w, number);
+	if (n != FLAC_BLOCK)
+		put_bits(w, n - 1, 16);
+	put_bits(w, crc8(w->buf + start, w->len - start), 8);
+
+	if (nch == 2) {
+		write_subframe(w, &sf[a], x[a], n, bps[a], wk->res);
+		write_subframe(w, &sf[b], x[b], n, bps[b], wk->res);
+	} else {
+		for (k = 0; k < nch; k++)
+			write_subframe(w, &sf[k], x[k], n, bps[k], wk->res);
+	}
+	put_align(w);
+	put_bits(w, crc16(w->buf + start, w->len - start), 16);
+}
+
+static int write_all(int fd, const uint8_t *p, size_t n)
+{
+	while (n > 0) {
+		ssize_t r = write(fd, p, n);
+		if (r < 0) {
+			perror("write failed");
+			return -1;
+		}
+		p += r;
+		n -= (size_t) r;
+	}
+	return 0;
+}
+
+/*
+  Take the next batch of the take, encode it, and wait for the batches
+  before it to be written
+  The take is read under the lock, the encoding is done without it
+*/
+static void *flac_worker(void *arg)
+{
+	struct worker *wk = arg;
+	struct flac_encoder *enc = wk->enc;
+	unsigned int nch = enc->nchannels, k;
+
+	while (1) {
+		unsigned long batch;
+		unsigned int fmin = UINT_MAX, fmax = 0;
+		size_t first, n, i;
+		int ret;
+
+		pthread_mutex_lock(&enc->lock);
+		if (enc->error || enc->next_frame >= enc->frames) {
+			pthread_mutex_unlock(&enc->lock);
+			break;
+		}
+		batch = enc->next_batch++;
+		first = enc->next_frame;
+		n = enc->frames - first < BATCH_FRAMES ? enc->frames - first : BATCH_FRAMES;
+		enc->next_frame += n;
+		if (enc->map == NULL) {
+			jack_default_audio_sample_t *dst[MAX_CHANNELS];
+			for (k = 0; k < nch; k++)
+				dst[k] = wk->fbuf + k * BATCH_FRAMES;
+			buffer_read(&enc->src, dst, 0, (jack_nframes_t) n);
+		}
+		pthread_mutex_unlock(&enc->lock);
+
+		// the same 16-bit samples as in a WAV file, a mapped file is read without the lock
+		for (k = 0; k < nch; k++) {
+			int16_t *pcm = wk->pcm + k * BATCH_FRAMES;
+			jack_default_audio_sample_t *fbuf = wk->fbuf + k * BATCH_FRAMES;
+			if (enc->map != NULL && enc->map->format == SAMPLE_S16) {
+				const int16_t *src = (const int16_t *) enc->map->data + first * nch + k;
+				for (i = 0; i < n; i++)
+					pcm[i] = src[i * nch];
+				continue;
+			}
+			if (enc->map != NULL) {
+				size_t bytes = sample_bytes(enc->map->format);
+				samples_to_float(fbuf, enc->map->data + (first * nch + k) * bytes, enc->map->format, nch, n);
+			}
+			convert_channel_at(pcm, fbuf, n, first * nch + k, nch);
+		}
+
+		wk->out.len = 0;
+		for (i = 0; i < n; i += FLAC_BLOCK) {
+			size_t start = wk->out.len;
+			unsigned int len = n - i < FLAC_BLOCK ? (unsigned int) (n - i) : FLAC_BLOCK;
+			unsigned int size;
+			encode_frame(wk, i, len, (uint32_t) ((first + i) / FLAC_BLOCK));
+			size = (unsigned int) (wk->out.len - start);
+			if (size < fmin)
+				fmin = size;
+			if (size > fmax)
+				fmax = size;
+		}
+
+		pthread_mutex_lock(&enc->lock);
+		while (enc->next_write != batch && !enc->error)
+			pthread_cond_wait(&enc->turn, &enc->lock);
+		if (enc->error) {
+			pthread_mutex_unlock(&enc->lock);
+			break;
+		}
+		pthread_mutex_unlock(&enc->lock);
+
+		ret = write_all(enc->fd, wk->out.buf, wk->out.len);
+
+		pthread_mutex_lock(&enc->lock);
+		if (ret != 0)
+			enc->error = 1;
+		enc->bytes += wk->out.len;
+		if (fmin < enc->min_frame)
+			enc->min_frame = fmin;
+		if (fmax > enc->max_frame)
+			enc->max_frame = fmax;
+		enc->next_write++;
+		pthread_cond_broadcast(&enc->turn);
+		pthread_mutex_unlock(&enc->lock);
+	}
+
+	return NULL;
+}
+
+static int worker_alloc(struct worker *wk, struct flac_encoder *enc)
+{
+	unsigned int nch = enc->nchannels, nx = nch < 4 ? 4 : nch;
+
+	wk->enc = enc;
+	wk->fbuf = malloc(nch * BATCH_FRAMES * sizeof(jack_default_audio_sample_t));
+	wk->pcm = malloc(nch * BATCH_FRAMES * sizeof(int16_t));
+	wk->x = malloc(nx * FLAC_BLOCK * sizeof(int32_t));
+	wk->res = malloc(FLAC_BLOCK * sizeof(int32_t));
+	// verbatim subframes at worst, side channels have one more bit
+	wk->out.buf = malloc(FLAC_BATCH_BLOCKS * ((size_t) FLAC_BLOCK * nch * (DEPTH + 1) / 8 + nch + 32));
+	wk->out.len = 0;
+	wk->out.acc = 0;
+	wk->out.n = 0;
+	if (wk->fbuf == NULL || wk->pcm == NULL || wk->x == NULL || wk->res == NULL || wk->out.buf == NULL)
+		return -1;
+	return 0;
+}
+
+static void worker_free(struct worker *wk)
+{
+	free(wk->fbuf);
+	free(wk->pcm);
+	free(wk->x);
+	free(wk->res);
+	free(wk->out.buf);
+}
+
+/*
+  Export a take as a 16-bit FLAC file, with nthreads threads (the
+  calling one included)
+  The take is cut in batches of frames, encoded in parallel and written
+  in order, so the memory used doesn't depend on the size of the take
+  The samples are converted as for a WAV file, the FLAC file decodes to
+  the same samples
+  fd must be open for writing at the start of an empty file, bytes is
+  set to the size of the file
+*/
+int save_flac(int fd, struct buffer *b, unsigned int nthreads, size_t *bytes)
+{
+	struct flac_encoder enc;
+	struct worker workers[FLAC_MAX_THREADS];
+	uint8_t header[FLAC_HEADER_LENGTH];
+	size_t batches;
+	unsigned int i, n;
+	int ret = 0;
+
+	pthread_once(&crc_once, crc_init);
+
+	memset(&enc, 0, sizeof(struct flac_encoder));
+	enc.fd = fd;
+	enc.nchannels = b->map != NULL ? b->map->nchannels : b->nchannels;
+	if (enc.nchannels > FLAC_MAX_CHANNELS) {
+		fprintf(stderr, "FLAC files have %d channels at most\n", FLAC_MAX_CHANNELS);
+		return -1;
+	}
+	// read through a copy, the position of the take is left alone
+	enc.src = *b;
+	buffer_rewind(&enc.src, 0);
+	enc.map = b->map;
+	enc.srate = b->srate;
+	enc.rate_code = rate_code(b->srate);
+	enc.frames = b->frames;
+	enc.min_frame = UINT_MAX;
+
+	flac_header(header, &enc);
+	if (write_all(fd, header, FLAC_HEADER_LENGTH) != 0)
+		return -1;
+
+	batches = (enc.frames + BATCH_FRAMES - 1) / BATCH_FRAMES;
+	n = nthreads < FLAC_MAX_THREADS ? nthreads : FLAC_MAX_THREADS;
+	if (n > batches)
+		n = (unsigned int) batches;
+	if (n == 0)
+		n = 1;
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < n; i++) {
+		if (worker_alloc(&workers[i], &enc) != 0) {
+			worker_free(&workers[i]);
+			break;
+		}
+	}
+	if (i == 0) {
+		fprintf(stderr, "cannot allocate the FLAC encoder\n");
+		return -1;
+	}
+	n = i;
+
+	pthread_mutex_init(&enc.lock, NULL);
+	pthread_cond_init(&enc.turn, NULL);
+	// fewer threads if they can't be created, the calling thread works too
+	for (i = 1; i < n; i++)
+		if (pthread_create(&workers[i].thread, NULL, flac_worker, &workers[i]) != 0)
+			break;
+	flac_worker(&workers[0]);
+	while (--i > 0)
+		pthread_join(workers[i].thread, NULL);
+	for (i = 0; i < n; i++)
+		worker_free(&workers[i]);
+	pthread_cond_destroy(&enc.turn);
+	pthread_mutex_destroy(&enc.lock);
+
+	if (enc.error)
+		return -1;
+
+	// now with the frame sizes
+	flac_header(header, &enc);
+	if (pwrite(fd, header, FLAC_HEADER_LENGTH, 0) != FLAC_HEADER_LENGTH) {
+		perror("write failed");
+		ret = -1;
+	}
+	*bytes = FLAC_HEADER_LENGTH + enc.bytes;
+	return ret;
+}
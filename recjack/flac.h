@@ -0,0 +1,20 @@
+#ifndef FLAC_H
+#define FLAC_H
+
+#include <stddef.h>
+
+#include "buffer.h"
+
+// frames per FLAC frame, and FLAC frames encoded in one go by a worker
+#define FLAC_BLOCK 4096
+#define FLAC_BATCH_BLOCKS 32
+#define FLAC_MAX_THREADS 16
+#define FLAC_MAX_CHANNELS 8
+// fixed predictors only, up to this order
+#define FLAC_MAX_ORDER 4
+#define FLAC_MAX_PARTITION 6
+#define FLAC_HEADER_LENGTH 42
+
+int save_flac(int fd, struct buffer *b, unsigned int nthreads, size_t *bytes);
+
+#endif // FLAC_H
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include <jack/jack.h>
+
+#include "recjack.h"
+#include "engine.h"
+#include "history.h"
+
+#define TAKE_OF(buf) ((struct take *) ((char *) (buf) - offsetof(struct take, b)))
+
+/*
+  Set up all the slots, the first one is the current take
+  One slot is always kept for the spare take
+*/
+void history_init(struct history *h, struct arena *a, unsigned int nchannels, unsigned long srate,
+		  unsigned int max_takes, size_t max_bytes)
+{
+	unsigned int i;
+
+	memset(h, 0, sizeof(struct history));
+	h->arena = a;
+	h->nchannels = nchannels;
+	h->srate = srate;
+	h->max_takes = max_takes < MAX_TAKES - 1 ? max_takes : MAX_TAKES - 1;
+	if (h->max_takes == 0)
+		h->max_takes = 1;
+	h->max_bytes = max_bytes;
+	h->tmpdir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+	for (i = 0; i < MAX_TAKES; i++) {
+		buffer_init(&h->takes[i].b, a, nchannels);
+		h->takes[i].b.srate = srate;
+	}
+	h->current = &h->takes[0];
+}
+
+// the chunks belong to the arena, only the mapped files and the indexes are left
+void history_destroy(struct history *h)
+{
+	unsigned int i;
+
+	// a spill that isn't over is dropped
+	if (h->spilling != NULL) {
+		pthread_join(h->spill_thread, NULL);
+		close(h->spill_fd);
+		unlink(h->spill_path);
+		h->spilling = NULL;
+	}
+	for (i = 0; i < MAX_TAKES; i++) {
+		wave_map_close(&h->takes[i].map);
+		peaks_free(&h->takes[i].peaks);
+	}
+}
+
+/*
+  Play a WAV file as the first take
+*/
+int history_load(struct history *h, const char *filename)
+{
+	struct take *t = h->current;
+
+	if (wave_map_open(&t->map, filename) != 0)
+		return -1;
+	buffer_map(&t->b, &t->map);
+	// the index saved with the file, otherwise it is built when it is needed
+	if (peaks_load(&t->peaks, filename, t->b.nchannels, t->b.frames) == 0)
+		t->b.peaks = &t->peaks;
+	t->number = ++h->last_number;
+	t->used = ++h->clock;
+	return 0;
+}
+
+/*
+  The audio thread started a new take in b
+  It is the spare, unless the audio thread had none, in which case the
+  last take was overwritten
+*/
+void history_recorded(struct history *h, struct buffer *b)
+{
+	struct take *t = TAKE_OF(b);
+	struct take *last = h->current;
+
+	if (t == h->spare) {
+		h->spare = NULL;
+		// an empty take isn't worth keeping
+		if (last->b.frames == 0 && last->b.map == NULL)
+			last->number = 0;
+	} else {
+		wave_map_close(&t->map);
+	}
+	t->number = ++h->last_number;
+	t->used = ++h->clock;
+	h->current = t;
+}
+
+/*
+  The audio thread plays b from now on
+*/
+void history_select(struct history *h, struct buffer *b)
+{
+	h->current = TAKE_OF(b);
+	h->current->used = ++h->clock;
+}
+
+/*
+  The take recorded before (dir < 0) or after (dir > 0) the current one
+  NULL if there is none
+*/
+struct take *history_step(struct history *h, int dir)
+{
+	struct take *best = NULL;
+	unsigned int i, n = h->current->number;
+
+	for (i = 0; i < MAX_TAKES; i++) {
+		struct take *t = &h->takes[i];
+		if (t->number == 0 || t == h->current)
+			continue;
+		if (dir < 0 && t->number < n && (best == NULL || t->number > best->number))
+			best = t;
+		else if (dir > 0 && t->number > n && (best == NULL || t->number < best->number))
+			best = t;
+	}
+	return best;
+}
+
+// arena memory used by a take, a spilled take uses none
+static size_t take_bytes(const struct take *t)
+{
+	if (t->b.map != NULL)
+		return 0;
+	return (t->b.frames + t->b.chunk_frames - 1) / t->b.chunk_frames * sizeof(struct chunk);
+}
+
+/*
+  The least recently used take, besides the current one and the ones
+  being saved or spilled
+  If in_memory is set, only the takes that are still in the arena
+*/
+static struct take *history_lru(struct history *h, int in_memory)
+{
+	struct take *lru = NULL;
+	unsigned int i;
+
+	for (i = 0; i < MAX_TAKES; i++) {
+		struct take *t = &h->takes[i];
+		if (t->number == 0 || t == h->current || t == h->saving || t == h->spilling
+		    || (in_memory && take_bytes(t) == 0))
+			continue;
+		if (lru == NULL || t->used < lru->used)
+			lru = t;
+	}
+	return lru;
+}
+
+/*
+  Give the chunks of a take back to the arena, through the audio thread
+  which is the only one allowed to touch the free list
+*/
+static int take_release(struct take *t, struct ringbuffer *to_process)
+{
+	struct chunk *head = t->b.head, *tail = t->b.tail;
+
+	if (head != NULL && send_chunks(to_process, head, tail) != 0)
+		return -1;
+	buffer_detach(&t->b, &head, &tail);
+	return 0;
+}
+
+static int take_forget(struct take *t, struct ringbuffer *to_process)
+{
+	if (take_release(t, to_process) != 0)
+		return -1;
+	wave_map_close(&t->map);
+	t->number = 0;
+	return 0;
+}
+
+static void *spill_thread(void *arg)
+{
+	struct history *h = arg;
+
+	h->spill_ret = save_wave(h->spill_fd, &h->spill_b, SAMPLE_F32);
+	atomic_store(&h->spill_done, 1);
+	return NULL;
+}
+
+/*
+  Start moving a take from the arena to disk, in a worker thread
+  The file is written as float, so that the take is saved or replayed
+  later exactly as it was recorded
+*/
+static int spill_start(struct history *h, struct take *t)
+{
+	snprintf(h->spill_path, sizeof(h->spill_path), "%s/recjack-take-XXXXXX", h->tmpdir);
+	h->spill_fd = mkstemp(h->spill_path);
+	if (h->spill_fd < 0) {
+		perror(h->spill_path);
+		return -1;
+	}
+	h->spill_b = t->b;
+	h->spill_ret = 0;
+	atomic_store(&h->spill_done, 0);
+	if (pthread_create(&h->spill_thread, NULL, spill_thread, h) != 0) {
+		close(h->spill_fd);
+		unlink(h->spill_path);
+		return -1;
+	}
+	h->spilling = t;
+	h->spill_number = t->number;
+	return 0;
+}
+
+/*
+  Once the file is written, map it in place of the chunks of the take
+  The take stays in the arena if it was selected, saved or replaced in
+  the meantime
+  The file is removed as soon as it is mapped, it goes away with the
+  mapping
+*/
+static void spill_finish(struct history *h, struct ringbuffer *to_process)
+{
+	struct take *t = h->spilling;
+	size_t clipped = t->b.clipped;
+
+	pthread_join(h->spill_thread, NULL);
+	h->spilling = NULL;
+	if (h->spill_ret == 0 && t != h->current && t != h->saving && t->number == h->spill_number
+	    && t->b.map == NULL && wave_map_open(&t->map, h->spill_path) == 0) {
+		if (take_release(t, to_process) != 0) {
+			wave_map_close(&t->map);
+		} else {
+			buffer_map(&t->b, &t->map);
+			t->b.clipped = clipped;
+		}
+	}
+	close(h->spill_fd);
+	unlink(h->spill_path);
+}
+
+/*
+  Enforce the limits, then make sure the audio thread has a spare take
+  Called from the main loop, which also collects the spills from here
+*/
+void history_trim(struct history *h, struct ringbuffer *to_process)
+{
+	struct take *t;
+	unsigned int i, n = 0;
+	size_t bytes = 0;
+
+	if (h->spilling != NULL && atomic_load(&h->spill_done))
+		spill_finish(h, to_process);
+
+	for (i = 0; i < MAX_TAKES; i++) {
+		if (h->takes[i].number == 0)
+			continue;
+		n++;
+		if (&h->takes[i] != h->current)
+			bytes += take_bytes(&h->takes[i]);
+	}
+
+	// too many takes: forget the least recently used ones
+	while (n > h->max_takes && (t = history_lru(h, 0)) != NULL) {
+		bytes -= take_bytes(t);
+		if (take_forget(t, to_process) != 0)
+			break;
+		n--;
+	}
+
+	// too much memory: spill the least recently used take to disk, the
+	// next one once it's written
+	if (h->spilling == NULL && bytes > h->max_bytes && (t = history_lru(h, 1)) != NULL)
+		spill_start(h, t);
+
+	if (h->spare != NULL)
+		return;
+	for (i = 0; i < MAX_TAKES; i++) {
+		t = &h->takes[i];
+		if (t->number != 0 || t == h->current)
+			continue;
+		buffer_init(&t->b, h->arena, h->nchannels);
+		t->b.srate = h->srate;
+		// room to index a take as long as the arena
+		if (peaks_alloc(&t->peaks, h->nchannels, h->arena->nchunks * t->b.chunk_frames) == 0)
+			t->b.peaks = &t->peaks;
+		if (send_take(to_process, MSG_SPARE, &t->b) == 0)
+			h->spare = t;
+		break;
+	}
+}
+
+/*
+  List the takes, oldest first
+*/
+void history_print(FILE *f, const struct history *h)
+{
+	unsigned int i, last = 0;
+	size_t bytes = 0;
+
+	while (1) {
+		const struct take *t = NULL;
+		for (i = 0; i < MAX_TAKES; i++) {
+			const struct take *c = &h->takes[i];
+			if (c->number > last && (t == NULL || c->number < t->number))
+				t = c;
+		}
+		if (t == NULL)
+			break;
+		last = t->number;
+		if (t != h->current)
+			bytes += take_bytes(t);
+		fprintf(f, "%c take %u: %.1f s%s", t == h->current ? '>' : ' ', t->number,
+			(double) t->b.frames / (double) h->srate, t->b.map != NULL ? ", on disk" : "");
+		if (t->b.clipped > 0)
+			fprintf(f, ", %zu samples clipped", t->b.clipped);
+		fprintf(f, "\n");
+	}
+	fprintf(f, "%zu of %zu MB in memory, %u takes at most\n", bytes >> 20, h->max_bytes >> 20, h->max_takes);
+}
+
+/*
+  Peak index of the current take
+  A take played from a file without an index is indexed here, the first
+  time it is needed
+  Main loop only, while the audio thread isn't recording the current take
+  NULL if the index can't be allocated
+*/
+struct peaks *history_peaks(struct history *h)
+{
+	struct take *t = h->current;
+
+	if (t->b.peaks != NULL && t->peaks.frames == t->b.frames)
+		return &t->peaks;
+	if (peaks_alloc(&t->peaks, t->b.nchannels, t->b.frames) != 0)
+		return NULL;
+	peaks_scan(&t->peaks, &t->b);
+	t->b.peaks = &t->peaks;
+	return &t->peaks;
+}
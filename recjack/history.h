@@ -0,0 +1,83 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "ringbuffer.h"
+#include "wave.h"
+#include "peaks.h"
+
+#define MAX_TAKES 64
+#define DEFAULT_TAKES 8
+
+/*
+  A take of the history
+  It is either in the arena, or spilled to a WAV file mapped in memory
+  Its peak index stays in memory in both cases
+  number is 0 if the slot is free
+*/
+struct take
+{
+	struct buffer b;
+	struct wave_map map;
+	struct peaks peaks;
+	unsigned int number;
+	unsigned long used;
+};
+
+/*
+  The last takes, kept for replay
+  The slots are allocated once: a free slot is handed to the audio
+  thread as the spare take, in which the next take is recorded
+  The current take and the spare belong to the audio thread, the main
+  loop only touches the other ones
+  Beyond max_takes takes, the least recently used take is forgotten;
+  beyond max_bytes in the arena, it is spilled to disk
+  The take being saved is never forgotten nor spilled
+  Takes are spilled one at a time by a worker thread, so that the main
+  loop goes on; the file replaces the chunks once it is written
+*/
+struct history
+{
+	struct take takes[MAX_TAKES];
+	struct arena *arena;
+	unsigned int nchannels;
+	unsigned long srate;
+	unsigned int max_takes;
+	size_t max_bytes;
+	const char *tmpdir;
+
+	struct take *current;
+	struct take *spare;
+	// being saved in the background, kept as it is until it's written
+	const struct take *saving;
+	unsigned int last_number;
+	unsigned long clock;
+
+	// being spilled, b is a copy of the take for the worker
+	struct take *spilling;
+	unsigned int spill_number;
+	struct buffer spill_b;
+	char spill_path[4096];
+	int spill_fd;
+	int spill_ret;
+	pthread_t spill_thread;
+	atomic_int spill_done;
+};
+
+void history_init(struct history *h, struct arena *a, unsigned int nchannels, unsigned long srate,
+		  unsigned int max_takes, size_t max_bytes);
+void history_destroy(struct history *h);
+int history_load(struct history *h, const char *filename);
+void history_recorded(struct history *h, struct buffer *b);
+void history_select(struct history *h, struct buffer *b);
+struct take *history_step(struct history *h, int dir);
+void history_trim(struct history *h, struct ringbuffer *to_process);
+void history_print(FILE *f, const struct history *h);
+struct peaks *history_peaks(struct history *h);
+
+#endif // HISTORY_H
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <jack/jack.h>
+
+#include "buffer.h"
+#include "convert.h"
+#include "loop.h"
+#include "memory.h"
+
+#define LAYER(l, layer, k) ((layer)->buf + (size_t) (k) * (l)->capacity)
+#define MIX(l, k) ((l)->mix + (size_t) (k) * (l)->capacity)
+
+/*
+  Make a loop out of a take, skipping its first skip frames
+  The length is rounded to a whole number of beats at bpm (if it isn't 0),
+  and must leave room for the round trip latency
+  Main loop only, returns NULL if the take is too short or memory is short
+*/
+struct loop *loop_new(struct buffer *take, size_t skip, unsigned long srate, double bpm, jack_nframes_t latency)
+{
+	// read through a copy, the position of the take is left alone
+	struct buffer b = *take;
+	jack_default_audio_sample_t *dst[MAX_CHANNELS];
+	size_t frames = take->frames > skip ? take->frames - skip : 0;
+	double beat = bpm > 0 ? 60.0 * (double) srate / bpm : 0;
+	struct loop *l;
+	unsigned int k;
+
+	l = calloc(1, sizeof(struct loop));
+	if (l == NULL)
+		return NULL;
+	l->nchannels = take->nchannels;
+	if (beat > 0) {
+		l->beats = (unsigned int) lround((double) frames / beat);
+		if (l->beats == 0)
+			l->beats = 1;
+		l->length = (jack_nframes_t) ceil(l->beats * beat);
+	} else {
+		l->length = (jack_nframes_t) frames;
+	}
+	if (l->length < LOOP_MIN_FRAMES + latency) {
+		fprintf(stderr, "loop: the take is too short\n");
+		free(l);
+		return NULL;
+	}
+	l->capacity = l->length + (jack_nframes_t) (LOOP_MARGIN_SECONDS * (double) srate);
+
+	l->mix = calloc((size_t) l->capacity * l->nchannels, sizeof(jack_default_audio_sample_t));
+	if (l->mix == NULL || loop_spare(l) == NULL) {
+		loop_free(l);
+		return NULL;
+	}
+
+	// the take is the first layer
+	for (k = 0; k < l->nchannels; k++)
+		dst[k] = LAYER(l, &l->layers[0], k);
+	buffer_rewind(&b, skip);
+	l->layers[0].frames = buffer_read(&b, dst, 0, frames < l->length ? (jack_nframes_t) frames : l->length);
+	memcpy(l->mix, l->layers[0].buf, (size_t) l->capacity * l->nchannels * sizeof(jack_default_audio_sample_t));
+	l->nlayers = 1;
+
+	return l;
+}
+
+void loop_free(struct loop *l)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_LAYERS; i++)
+		free(l->layers[i].buf);
+	free(l->mix);
+	free(l);
+}
+
+/*
+  Prepare the next layer to record, silent and at full gain
+  The layers are used in order, the audio thread gets one at a time
+  Main loop only, NULL once there are MAX_LAYERS layers
+*/
+struct layer *loop_spare(struct loop *l)
+{
+	struct layer *layer;
+
+	if (l->prepared >= MAX_LAYERS)
+		return NULL;
+	layer = &l->layers[l->prepared];
+	layer->buf = calloc((size_t) l->capacity * l->nchannels, sizeof(jack_default_audio_sample_t));
+	if (layer->buf == NULL)
+		return NULL;
+	// calloc maps fresh zero pages, the audio thread mustn't be the first to write them
+	prefault(layer->buf, (size_t) l->capacity * l->nchannels * sizeof(jack_default_audio_sample_t));
+	layer->frames = 0;
+	layer->gain = 1.0F;
+	l->prepared++;
+	return layer;
+}
+
+/*
+  Audio thread: the first pass starts now
+  Recording waits for the round trip, so that the first frame of a
+  layer is what was played over the first frame of the loop
+*/
+void loop_start(struct loop *l, jack_nframes_t latency)
+{
+	l->pos = 0;
+	l->beat = 0;
+	l->rec = NULL;
+	l->wpos = 0;
+	l->switching = 1;
+	l->switch_in = latency;
+}
+
+/*
+  Audio thread: a beat of the metronome starts
+  Returns 1 if it starts a new pass
+*/
+int loop_beat(struct loop *l)
+{
+	if (l->beats > 0 && ++l->beat >= l->beats) {
+		l->beat = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+  Audio thread: change the gain of a layer by delta
+  Returns -1 if too many changes are still in progress
+*/
+int loop_correct(struct loop *l, const struct layer *layer, float delta)
+{
+	unsigned int c;
+
+	for (c = 0; c < MAX_CORRECTIONS; c++) {
+		struct correction *cr = &l->corrections[c];
+		if (cr->left == 0) {
+			cr->layer = layer;
+			cr->delta = delta;
+			cr->pos = l->pos;
+			cr->left = l->capacity;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// apply the next n frames of a gain change, from the playback position on
+static void loop_correction(struct loop *l, struct correction *cr, jack_nframes_t n)
+{
+	unsigned int k;
+
+	if (n > cr->left)
+		n = cr->left;
+	while (n > 0) {
+		jack_nframes_t len = l->capacity - cr->pos;
+		if (len > n)
+			len = n;
+		for (k = 0; k < l->nchannels; k++)
+			mix_add(MIX(l, k) + cr->pos, LAYER(l, cr->layer, k) + cr->pos, cr->delta, len);
+		cr->pos = (cr->pos + len) % l->capacity;
+		cr->left -= len;
+		n -= len;
+	}
+}
+
+/*
+  The layer being recorded is over, start the next one if overdubbing
+  started tells the audio thread to ask for a new spare
+*/
+static struct layer *loop_switch(struct loop *l)
+{
+	struct layer *done = l->rec;
+
+	if (done != NULL)
+		done->frames = l->wpos;
+	l->rec = NULL;
+	if (l->overdub && l->spare != NULL) {
+		l->rec = l->spare;
+		l->spare = NULL;
+		l->wpos = 0;
+		l->started = 1;
+	}
+	return done;
+}
+
+// store the input in the layer, and add it to the mix for the next passes
+static void loop_record(struct loop *l, jack_default_audio_sample_t **in, jack_nframes_t offset, jack_nframes_t n)
+{
+	unsigned int k;
+
+	if (n > l->capacity - l->wpos)
+		n = l->capacity - l->wpos;
+	for (k = 0; k < l->nchannels; k++) {
+		jack_default_audio_sample_t *dst = LAYER(l, l->rec, k) + l->wpos;
+		memcpy(dst, in[k] + offset, n * sizeof(jack_default_audio_sample_t));
+		mix_add(MIX(l, k) + l->wpos, dst, l->rec->gain, n);
+	}
+	l->wpos += n;
+}
+
+/*
+  Audio thread: play n frames of the mix at offset in out, and record
+  the same frames of in if overdubbing
+  A new pass starts at wrap (an offset in the period, or beyond it), or
+  at the end of the loop without a metronome; the layer being recorded
+  ends latency frames later
+  Whatever the number of layers, only the mix is read
+  Returns the layer completed in this period, if any
+*/
+struct layer *loop_process(struct loop *l, jack_default_audio_sample_t **in, jack_default_audio_sample_t **out,
+			   jack_nframes_t offset, jack_nframes_t n, jack_nframes_t wrap, jack_nframes_t latency)
+{
+	struct layer *done = NULL;
+	jack_nframes_t i, len;
+	unsigned int k, c;
+
+	// gain changes first, so that they are heard at once
+	for (c = 0; c < MAX_CORRECTIONS; c++)
+		if (l->corrections[c].left > 0)
+			loop_correction(l, &l->corrections[c], n);
+
+	// playback
+	for (i = offset; i < offset + n; i += len) {
+		if (i == wrap || l->pos >= l->capacity || (l->beats == 0 && l->pos >= l->length)) {
+			l->pos = 0;
+			l->switching = 1;
+			l->switch_in = i - offset + latency;
+		}
+		len = offset + n - i;
+		if (i < wrap && wrap - i < len)
+			len = wrap - i;
+		if (len > l->capacity - l->pos)
+			len = l->capacity - l->pos;
+		if (l->beats == 0 && len > l->length - l->pos)
+			len = l->length - l->pos;
+		for (k = 0; k < l->nchannels; k++)
+			memcpy(out[k] + i, MIX(l, k) + l->pos, len * sizeof(jack_default_audio_sample_t));
+		l->pos += len;
+	}
+
+	// recording, a round trip behind
+	for (i = 0; i < n; i += len) {
+		len = n - i;
+		if (l->switching) {
+			if (l->switch_in <= i) {
+				done = loop_switch(l);
+				l->switching = 0;
+			} else if (l->switch_in - i < len) {
+				len = l->switch_in - i;
+			}
+		}
+		if (l->rec != NULL)
+			loop_record(l, in, offset + i, len);
+	}
+	if (l->switching)
+		l->switch_in -= n;
+
+	return done;
+}
+
+/*
+  Audio thread: stop looping
+  Returns the layer that was being recorded, as far as it went
+*/
+struct layer *loop_stop(struct loop *l)
+{
+	struct layer *done = l->rec;
+
+	if (done != NULL)
+		done->frames = l->wpos;
+	l->rec = NULL;
+	return done;
+}
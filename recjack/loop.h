@@ -0,0 +1,88 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stddef.h>
+
+#include <jack/jack.h>
+
+#include "buffer.h"
+
+#define MAX_LAYERS 32
+#define MAX_CORRECTIONS 4
+#define LAYER_GAIN_STEP 0.1F
+#define LAYER_GAIN_MAX 2.0F
+// shortest loop, so that a pass is always longer than a period and the round trip
+#define LOOP_MIN_FRAMES 8192
+// room left at the end of the layers if the click slows down
+#define LOOP_MARGIN_SECONDS 0.25
+
+/*
+  One layer of the loop: capacity frames per channel, planar
+  The first layer is the take the loop was made from
+*/
+struct layer
+{
+	jack_default_audio_sample_t *buf;
+	jack_nframes_t frames;
+	float gain;
+};
+
+/*
+  Gain change of a layer, applied to the mix a bit at a time, just
+  ahead of the playback position, until it went around the whole loop
+*/
+struct correction
+{
+	const struct layer *layer;
+	float delta;
+	jack_nframes_t pos;
+	jack_nframes_t left;
+};
+
+/*
+  Loop/overdub
+  The layers are summed in mix, which is all the audio thread plays, so
+  that a period costs the same whatever the number of layers
+  While overdubbing, each pass is recorded as a new layer, and added to
+  the mix as it comes in, a round trip behind the playback position
+  A pass lasts beats beats of the metronome, or length frames without one
+*/
+struct loop
+{
+	unsigned int nchannels;
+	jack_nframes_t capacity;
+	jack_nframes_t length;
+	unsigned int beats;
+	jack_default_audio_sample_t *mix;
+
+	// audio thread
+	jack_nframes_t pos;
+	unsigned int beat;
+	char overdub;
+	char switching;
+	jack_nframes_t switch_in;
+	struct layer *rec;
+	jack_nframes_t wpos;
+	struct layer *spare;
+	char started;
+	struct correction corrections[MAX_CORRECTIONS];
+
+	// main loop
+	struct layer layers[MAX_LAYERS];
+	unsigned int nlayers;
+	unsigned int prepared;
+	unsigned int selected;
+};
+
+struct loop *loop_new(struct buffer *take, size_t skip, unsigned long srate, double bpm, jack_nframes_t latency);
+void loop_free(struct loop *l);
+struct layer *loop_spare(struct loop *l);
+
+void loop_start(struct loop *l, jack_nframes_t latency);
+int loop_beat(struct loop *l);
+int loop_correct(struct loop *l, const struct layer *layer, float delta);
+struct layer *loop_process(struct loop *l, jack_default_audio_sample_t **in, jack_default_audio_sample_t **out,
+			   jack_nframes_t offset, jack_nframes_t n, jack_nframes_t wrap, jack_nframes_t latency);
+struct layer *loop_stop(struct loop *l);
+
+#endif // LOOP_H
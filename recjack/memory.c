@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "memory.h"
+
+// set once the address space is locked, prefault locks what it touches
+static int locked;
+
+/*
+  Lock the address space in RAM, so that the audio thread never waits
+  for a page to be read back
+  Only what is mapped now: the files mapped later (spilled or loaded
+  takes, saves) would be read in whole and count against the limit,
+  the buffers allocated later for the audio thread are locked by
+  prefault
+  Fails when RLIMIT_MEMLOCK is too low, recording then goes on unlocked
+*/
+int memory_lock(void)
+{
+	if (mlockall(MCL_CURRENT) != 0) {
+		int err = errno;
+		struct rlimit rl;
+
+		fprintf(stderr, "cannot lock the memory: %s\n", strerror(err));
+		if ((err == ENOMEM || err == EPERM) && getrlimit(RLIMIT_MEMLOCK, &rl) == 0
+		    && rl.rlim_cur != RLIM_INFINITY)
+			fprintf(stderr, "the limit is %lu kB, see ulimit -l\n", (unsigned long) rl.rlim_cur >> 10);
+		return -1;
+	}
+	locked = 1;
+	return 0;
+}
+
+/*
+  Touch every page of a buffer the audio thread will write to, so that
+  the first fault happens here rather than in the callback, and lock it
+  if the memory was locked before it was allocated
+  The content is left as it is
+*/
+void prefault(void *addr, size_t size)
+{
+	volatile char *p = addr;
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t off;
+
+	for (off = 0; off < size; off += page)
+		p[off] = p[off];
+	if (size > 0)
+		p[size - 1] = p[size - 1];
+	// best effort, like the rest: the buffer stays usable unlocked
+	if (locked && size > 0 && mlock(addr, size) != 0)
+		perror("mlock");
+}
+
+/*
+  Page faults of the calling thread so far, 0 where the kernel can't
+  tell them apart from the ones of the other threads
+*/
+void thread_faults(long *minor, long *major)
+{
+#ifdef RUSAGE_THREAD
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+		*minor = ru.ru_minflt;
+		*major = ru.ru_majflt;
+		return;
+	}
+#endif
+	*minor = 0;
+	*major = 0;
+}
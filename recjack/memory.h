@@ -0,0 +1,13 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+
+// explicit huge pages, the arena is rounded up to a multiple of them
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+int memory_lock(void);
+void prefault(void *addr, size_t size);
+void thread_faults(long *minor, long *major);
+
+#endif // MEMORY_H
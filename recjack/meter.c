@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <jack/jack.h>
+
+#include "meter.h"
+#include "convert.h"
+
+static double to_db(double v);
+static unsigned int bar_position(double db, unsigned int width);
+
+void meter_init(struct meter *m, unsigned int nchannels)
+{
+	unsigned int k;
+
+	memset(m, 0, sizeof(struct meter));
+	m->nchannels = nchannels;
+	for (k = 0; k < nchannels; k++) {
+		m->rms_db[k] = METER_FLOOR_DB;
+		m->hold_db[k] = METER_FLOOR_DB;
+	}
+}
+
+/*
+  Audio thread: measure n frames of every input, from offset
+  Returns the number of samples that clip, so that the caller can count
+  them in the take
+*/
+unsigned long meter_process(struct meter *m, jack_default_audio_sample_t **in, jack_nframes_t offset,
+			    jack_nframes_t n)
+{
+	unsigned long clips = 0;
+	unsigned int k;
+
+	for (k = 0; k < m->nchannels; k++) {
+		struct level l = {m->acc_peak[k], 0, 0};
+		measure_level(&l, in[k] + offset, n);
+		m->acc_peak[k] = l.peak;
+		m->acc_energy[k] += l.energy;
+		m->acc_clips[k] += l.clips;
+		clips += l.clips;
+	}
+	m->acc_frames += n;
+
+	// the main loop has taken the last levels, hand these over
+	if (!atomic_load(&m->ready)) {
+		for (k = 0; k < m->nchannels; k++) {
+			m->peak[k] = m->acc_peak[k];
+			m->energy[k] = m->acc_energy[k];
+			m->clips[k] = m->acc_clips[k];
+			m->acc_peak[k] = 0;
+			m->acc_energy[k] = 0;
+			m->acc_clips[k] = 0;
+		}
+		m->frames = m->acc_frames;
+		m->acc_frames = 0;
+		atomic_store(&m->ready, 1);
+	}
+	return clips;
+}
+
+/*
+  Main loop: take the levels measured since the last call, if the audio
+  thread has handed them over
+  The peak hold falls slowly, so that short peaks stay visible
+  Returns 1 if there are new levels
+*/
+int meter_read(struct meter *m)
+{
+	unsigned int k;
+
+	if (!atomic_load(&m->ready))
+		return 0;
+	for (k = 0; k < m->nchannels; k++) {
+		double peak_db = to_db(m->peak[k]);
+		m->rms_db[k] = m->frames > 0 ? to_db(sqrt(m->energy[k] / (double) m->frames)) : METER_FLOOR_DB;
+		m->hold_db[k] -= METER_FALL_DB;
+		if (m->hold_db[k] < peak_db)
+			m->hold_db[k] = peak_db;
+		m->total_clips[k] += m->clips[k];
+	}
+	atomic_store(&m->ready, 0);
+	return 1;
+}
+
+static double to_db(double v)
+{
+	double db = v > 0 ? 20 * log10(v) : METER_FLOOR_DB;
+
+	return db > METER_FLOOR_DB ? db : METER_FLOOR_DB;
+}
+
+// how many characters of a bar of width characters are lit at db
+static unsigned int bar_position(double db, unsigned int width)
+{
+	double x = (db - METER_FLOOR_DB) / -METER_FLOOR_DB;
+
+	if (x <= 0)
+		return 0;
+	if (x >= 1)
+		return width;
+	return (unsigned int) lrint(x * width);
+}
+
+/*
+  Draw the levels on one line, over the previous one
+  Each channel gets a bar from METER_FLOOR_DB to 0 dBFS: '=' up to the
+  RMS level and '|' at the peak hold, followed by the peak hold in dB
+*/
+void meter_print(FILE *f, const struct meter *m, const char *status)
+{
+	unsigned int width = METER_WIDTH / m->nchannels;
+	unsigned long clips = 0;
+	unsigned int i, k;
+
+	if (width < METER_MIN_WIDTH)
+		width = METER_MIN_WIDTH;
+	fprintf(f, "\r%-9s", status);
+	for (k = 0; k < m->nchannels; k++) {
+		unsigned int rms = bar_position(m->rms_db[k], width);
+		unsigned int hold = bar_position(m->hold_db[k], width);
+		fputs(" [", f);
+		for (i = 0; i < width; i++)
+			fputc(i < rms ? '=' : (i + 1 == hold ? '|' : ' '), f);
+		fprintf(f, "]%4ld", lrint(m->hold_db[k]));
+		clips += m->total_clips[k];
+	}
+	if (clips > 0)
+		fprintf(f, "  %lu clipped", clips);
+	// clear what is left of the previous line
+	fputs("\033[K", f);
+	fflush(f);
+}
@@ -0,0 +1,54 @@
+#ifndef METER_H
+#define METER_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include <jack/jack.h>
+
+#include "buffer.h"
+
+// the terminal meter is redrawn at this interval
+#define METER_INTERVAL_MS 40
+#define METER_WIDTH 48
+#define METER_MIN_WIDTH 8
+#define METER_FLOOR_DB -60.0
+// the peak hold falls by this much at every redraw
+#define METER_FALL_DB 1.0
+
+/*
+  Input levels, measured by the audio thread in one pass over each period
+  The audio thread adds up the periods until the main loop has taken the
+  last levels (ready cleared), then hands the new ones over in the
+  published fields and sets ready
+*/
+struct meter
+{
+	unsigned int nchannels;
+
+	// audio thread
+	float acc_peak[MAX_CHANNELS];
+	double acc_energy[MAX_CHANNELS];
+	unsigned long acc_clips[MAX_CHANNELS];
+	size_t acc_frames;
+
+	// published, owned by the main loop while ready is set
+	atomic_int ready;
+	float peak[MAX_CHANNELS];
+	double energy[MAX_CHANNELS];
+	unsigned long clips[MAX_CHANNELS];
+	size_t frames;
+
+	// main loop, what is displayed
+	double rms_db[MAX_CHANNELS];
+	double hold_db[MAX_CHANNELS];
+	unsigned long total_clips[MAX_CHANNELS];
+};
+
+void meter_init(struct meter *m, unsigned int nchannels);
+unsigned long meter_process(struct meter *m, jack_default_audio_sample_t **in, jack_nframes_t offset,
+			    jack_nframes_t n);
+int meter_read(struct meter *m);
+void meter_print(FILE *f, const struct meter *m, const char *status);
+
+#endif // METER_H
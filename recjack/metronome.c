@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
@@ -6,33 +7,253 @@
 
 #include "metronome.h"
 
-// create the sound sample for a metronome click at the chosen BPM
-struct click *generate_click(unsigned int bpm, unsigned long srate, int freq, float amplitude, unsigned int beep_ratio)
+static void make_wavetable(jack_default_audio_sample_t *buf, jack_nframes_t size, double omega, float amplitude)
 {
-	struct click *click = malloc(sizeof(struct click));
-	memset(click, 0, sizeof(struct click));
-
-	click->size = (jack_nframes_t) (60 * srate / bpm);
-	jack_nframes_t beep_frames = click->size / beep_ratio;
-	// if bpm is too low, don't let the click get too long
-	if (bpm < 60)
-		beep_frames = (jack_nframes_t) (srate / beep_ratio);
-	double omega = 2 * M_PI * freq / srate;
-	click->buf = malloc(click->size * sizeof(jack_default_audio_sample_t));
 	jack_nframes_t k;
-	for (k = 0; k < beep_frames; k++)
-		click->buf[k] = (jack_default_audio_sample_t) (amplitude * sin(k * omega));
-	for (k = beep_frames; k < click->size; k++)
-		click->buf[k] = 0;
 
-	return click;
+	for (k = 0; k < size; k++)
+		buf[k] = (jack_default_audio_sample_t) (amplitude * sin(k * omega));
+}
+
+// create the sound samples of the beeps, as long as the beeps get at the lowest tempos
+struct beep *generate_beep(unsigned long srate, int freq, float amplitude, unsigned int beep_ratio)
+{
+	struct beep *beep = malloc(sizeof(struct beep));
+	memset(beep, 0, sizeof(struct beep));
+
+	beep->srate = srate;
+	beep->ratio = beep_ratio;
+	beep->size = (jack_nframes_t) (srate / beep_ratio);
+	double omega = 2 * M_PI * freq / (double) srate;
+	beep->buf = malloc(beep->size * sizeof(jack_default_audio_sample_t));
+	beep->accent = malloc(beep->size * sizeof(jack_default_audio_sample_t));
+	beep->sub = malloc(beep->size * sizeof(jack_default_audio_sample_t));
+	// the accent is an octave higher, the subdivisions are softer
+	make_wavetable(beep->buf, beep->size, omega, amplitude);
+	make_wavetable(beep->accent, beep->size, 2 * omega, amplitude);
+	make_wavetable(beep->sub, beep->size, omega, amplitude / 2);
+
+	return beep;
+}
+
+void free_beep(struct beep *beep)
+{
+	if (beep != NULL) {
+		free(beep->buf);
+		free(beep->accent);
+		free(beep->sub);
+		free(beep);
+	}
+}
+
+/*
+  A plain tempo: bpm beats per minute, no accent, no subdivision, no ramp
+*/
+void tempo_init(struct tempo *t, double bpm)
+{
+	memset(t, 0, sizeof(struct tempo));
+	t->bpm = bpm;
+	t->beats_per_bar = 1;
+	t->subdivisions = 1;
+}
+
+/*
+  Read a time signature such as 3/4 or 7/8
+  Only the beats per bar are kept, the tempo is given in those beats
+*/
+int parse_signature(struct tempo *t, const char *s)
+{
+	unsigned int n, d;
+
+	if (sscanf(s, "%u/%u", &n, &d) != 2 || n == 0 || d == 0)
+		return -1;
+	t->beats_per_bar = n;
+	return 0;
+}
+
+/*
+  Read a tempo ramp: target BPM and length in beats, such as 140:32
+*/
+int parse_ramp(struct tempo *t, const char *s)
+{
+	double bpm;
+	unsigned int beats;
+
+	if (sscanf(s, "%lf:%u", &bpm, &beats) != 2 || bpm <= 0 || bpm > MAX_BPM || beats == 0)
+		return -1;
+	t->ramp_bpm = bpm;
+	t->ramp_beats = beats;
+	return 0;
+}
+
+void metronome_init(struct metronome *m, const struct beep *beep)
+{
+	memset(m, 0, sizeof(struct metronome));
+	m->beep = beep;
+}
+
+static void start_tempo(struct metronome *m, const struct tempo *t)
+{
+	m->tempo = *t;
+	m->bpm = t->bpm;
+	m->ramp_left = t->ramp_beats;
+	m->ramp_step = t->ramp_beats > 0 ? (t->ramp_bpm - t->bpm) / t->ramp_beats : 0;
+	if (m->tempo.beats_per_bar == 0)
+		m->tempo.beats_per_bar = 1;
+	if (m->tempo.subdivisions == 0)
+		m->tempo.subdivisions = 1;
+	m->beat %= m->tempo.beats_per_bar;
+}
+
+/*
+  Switch to a new tempo right now, the next tick starts a bar
+*/
+void metronome_set(struct metronome *m, const struct tempo *t)
+{
+	m->beat = 0;
+	m->sub = 0;
+	start_tempo(m, t);
+	m->pending = 0;
+	m->next_tick = 0;
+	m->sound = NULL;
+	m->sound_size = 0;
+	m->sound_pos = 0;
+}
+
+/*
+  Switch to a new tempo at the next beat
+  Starting or stopping the metronome doesn't wait
+*/
+void metronome_schedule(struct metronome *m, const struct tempo *t)
+{
+	if (m->tempo.bpm == 0 || t->bpm == 0) {
+		metronome_set(m, t);
+	} else {
+		m->next = *t;
+		m->pending = 1;
+	}
+}
+
+/*
+  Write at most n frames: the end of the current beep, then silence
+  Stops early when the next tick is due, returns the number of frames written
+*/
+jack_nframes_t metronome_render(struct metronome *m, jack_default_audio_sample_t *buf, jack_nframes_t n)
+{
+	jack_nframes_t len = 0;
+
+	if (m->next_tick <= 0)
+		return 0;
+	if (ceil(m->next_tick) < n)
+		n = (jack_nframes_t) ceil(m->next_tick);
+
+	if (m->sound_pos < m->sound_size) {
+		len = m->sound_size - m->sound_pos;
+		if (len > n)
+			len = n;
+		memcpy(buf, m->sound + m->sound_pos, len * sizeof(jack_default_audio_sample_t));
+		m->sound_pos += len;
+	}
+	memset(buf + len, 0, (n - len) * sizeof(jack_default_audio_sample_t));
+	m->next_tick -= n;
+
+	return n;
 }
 
-void free_click(struct click *click)
+/*
+  Start the tick that is due, and schedule the next one
+  A new tempo is applied on beats only, the ramp moves once per beat
+  Returns 1 if the tick is on a beat, 0 for a subdivision
+*/
+int metronome_tick(struct metronome *m)
 {
-	if (click != NULL) {
-		free(click->buf);
-		free(click);
-		click = NULL;
+	int on_beat = m->sub == 0;
+	double tick_length;
+
+	if (on_beat && m->pending) {
+		start_tempo(m, &m->next);
+		m->pending = 0;
+	}
+
+	tick_length = 60.0 * (double) m->beep->srate / (m->bpm * m->tempo.subdivisions);
+	if (m->sub != 0)
+		m->sound = m->beep->sub;
+	else if (m->beat == 0 && m->tempo.beats_per_bar > 1)
+		m->sound = m->beep->accent;
+	else
+		m->sound = m->beep->buf;
+	// the beep takes 1/ratio of the tick, but doesn't get too long at low tempos
+	m->sound_size = (jack_nframes_t) (tick_length / m->beep->ratio);
+	if (m->sound_size > m->beep->size)
+		m->sound_size = m->beep->size;
+	m->sound_pos = 0;
+	m->next_tick += tick_length;
+
+	if (++m->sub >= m->tempo.subdivisions) {
+		m->sub = 0;
+		if (++m->beat >= m->tempo.beats_per_bar)
+			m->beat = 0;
+		// the beat is over, move along the ramp
+		if (m->ramp_left > 0) {
+			m->bpm += m->ramp_step;
+			if (--m->ramp_left == 0)
+				m->bpm = m->tempo.ramp_bpm;
+		}
+	}
+
+	return on_beat;
+}
+
+/*
+  Follow an external tempo and position: bpm, and beat_fraction into
+  the beat-th beat of the bar (from 0), at the current write position
+  The position is rounded down to resolution (a fraction of a beat), so
+  the true position of the next tick is at most that much earlier than
+  it seems: the phase is only nudged into that window, and narrows down
+  period after period
+  The metronome jumps to the position if it is far off, or if force is
+  set (the transport has just started or moved)
+*/
+void metronome_follow(struct metronome *m, double bpm, unsigned int beats_per_bar,
+		      unsigned int beat, double beat_fraction, double resolution, int force)
+{
+	unsigned int subdivisions = m->tempo.subdivisions > 0 ? m->tempo.subdivisions : 1;
+	double tick_length = 60.0 * (double) m->beep->srate / (bpm * subdivisions);
+	double window = resolution * subdivisions * tick_length;
+	double ticks = beat_fraction * subdivisions;
+	double next = ceil(ticks);
+	double next_tick = (next - ticks) * tick_length;
+	double diff;
+
+	if (beats_per_bar == 0)
+		beats_per_bar = 1;
+	// distance to the tick we would play, modulo a tick
+	diff = fmod(next_tick - m->next_tick, tick_length);
+	if (diff > tick_length / 2)
+		diff -= tick_length;
+	else if (diff < -tick_length / 2)
+		diff += tick_length;
+
+	m->pending = 0;
+	m->ramp_left = 0;
+	m->tempo.bpm = bpm;
+	m->tempo.beats_per_bar = beats_per_bar;
+	m->tempo.subdivisions = subdivisions;
+	m->bpm = bpm;
+	if (!force && diff > -FOLLOW_TOLERANCE - window && diff < FOLLOW_TOLERANCE + window) {
+		if (diff < 0)
+			m->next_tick += diff;
+		else if (diff > window)
+			m->next_tick += diff - window;
+		return;
+	}
+
+	// start in the middle of the window
+	m->next_tick = next_tick - window / 2;
+	m->sub = (unsigned int) next;
+	m->beat = beat % beats_per_bar;
+	if (m->sub >= subdivisions) {
+		m->sub = 0;
+		m->beat = (m->beat + 1) % beats_per_bar;
 	}
 }
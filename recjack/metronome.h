@@ -1,15 +1,82 @@
 #ifndef METRONOME_H
 #define METRONOME_H
 
-struct click
+/*
+  Wavetables of the longest beeps, computed once for the sample rate:
+  the normal beep, the accented one for the first beat of a bar, and a
+  softer one for the subdivisions
+*/
+struct beep
 {
 	jack_default_audio_sample_t *buf;
+	jack_default_audio_sample_t *accent;
+	jack_default_audio_sample_t *sub;
 	jack_nframes_t size;
+	unsigned long srate;
+	unsigned int ratio;
+};
+
+/*
+  Tempo settings, as chosen by the user
+  A tempo of 0 BPM means that there's no metronome
+  The first beat of a bar is accented when there's more than one beat
+  per bar; bpm counts the beats of the time signature whatever its unit,
+  like the JACK transport does, so 7/8 at 120 is 120 eighth notes
+  Each beat is split into subdivisions clicks
+  If ramp_beats isn't 0, the tempo moves linearly from bpm to ramp_bpm
+  over that many beats
+*/
+struct tempo
+{
+	double bpm;
+	unsigned int beats_per_bar;
+	unsigned int subdivisions;
+	double ramp_bpm;
+	unsigned int ramp_beats;
+};
+
+/*
+  Metronome state, owned by the audio thread
+  The position of the next tick is kept with a fractional part, so that
+  the tempo doesn't drift whatever the sample rate
+*/
+struct metronome
+{
+	const struct beep *beep;
+	struct tempo tempo;
+	struct tempo next;
+	char pending;
+
+	double bpm;
+	double ramp_step;
+	unsigned int ramp_left;
+
+	double next_tick;
+	unsigned int beat;
+	unsigned int sub;
+
+	const jack_default_audio_sample_t *sound;
+	jack_nframes_t sound_size;
+	jack_nframes_t sound_pos;
 };
 
 #define DEFAULT_BPM 60
+#define MAX_BPM 1000
+// frames of slack when following an external transport
+#define FOLLOW_TOLERANCE 16
+
+struct beep *generate_beep(unsigned long srate, int freq, float amplitude, unsigned int beep_ratio);
+void free_beep(struct beep *beep);
+void tempo_init(struct tempo *t, double bpm);
+int parse_signature(struct tempo *t, const char *s);
+int parse_ramp(struct tempo *t, const char *s);
 
-struct click *generate_click(unsigned int bpm, unsigned long srate, int freq, float amplitude, unsigned int beep_ratio);
-void free_click(struct click *click);
+void metronome_init(struct metronome *m, const struct beep *beep);
+void metronome_set(struct metronome *m, const struct tempo *t);
+void metronome_schedule(struct metronome *m, const struct tempo *t);
+jack_nframes_t metronome_render(struct metronome *m, jack_default_audio_sample_t *buf, jack_nframes_t n);
+int metronome_tick(struct metronome *m);
+void metronome_follow(struct metronome *m, double bpm, unsigned int beats_per_bar,
+		      unsigned int beat, double beat_fraction, double resolution, int force);
 
 #endif // METRONOME_H
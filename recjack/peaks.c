@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <jack/jack.h>
+
+#include "peaks.h"
+#include "memory.h"
+
+#define PEAKS_MAGIC "RJPK"
+#define PEAKS_VERSION 1
+// frames converted at a time when a mapped take is indexed
+#define SCAN_FRAMES 256
+#define OVERVIEW_FLOOR_DB -48.0
+
+/*
+  Header of the sidecar file, followed by the bins of each level, first
+  level first: all the bins of the first level, only the complete ones
+  of the others
+  The file is in the byte order of the machine that wrote it
+*/
+struct peaks_header
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t nchannels;
+	uint32_t block;
+	uint32_t factor;
+	uint32_t levels;
+	uint64_t frames;
+};
+
+// frames covered by a bin of level l
+static size_t bin_frames(unsigned int l)
+{
+	size_t n = PEAK_BLOCK;
+
+	while (l-- > 0)
+		n *= PEAK_FACTOR;
+	return n;
+}
+
+// bins of level l that hold something: the complete ones, and the last one of the first level
+static size_t level_bins(const struct peaks *p, unsigned int l)
+{
+	if (l == 0)
+		return (p->frames + PEAK_BLOCK - 1) / PEAK_BLOCK;
+	return p->frames / bin_frames(l);
+}
+
+/*
+  Allocate the bins for a take of up to frames frames
+  The arrays of a previous take are kept if they are large enough
+  The audio thread writes to them, they are faulted in here
+*/
+int peaks_alloc(struct peaks *p, unsigned int nchannels, size_t frames)
+{
+	size_t capacity = (frames + PEAK_BLOCK - 1) / PEAK_BLOCK;
+	unsigned int l;
+
+	if (p->level[0] != NULL && p->nchannels == nchannels && p->capacity >= capacity) {
+		peaks_reset(p);
+		return 0;
+	}
+	peaks_free(p);
+	p->nchannels = nchannels;
+	p->capacity = capacity;
+	for (l = 0; l < PEAK_LEVELS; l++) {
+		size_t n = (capacity / (bin_frames(l) / PEAK_BLOCK) + 1) * nchannels;
+		p->level[l] = calloc(n, sizeof(struct range));
+		if (p->level[l] == NULL) {
+			peaks_free(p);
+			return -1;
+		}
+		prefault(p->level[l], n * sizeof(struct range));
+	}
+	return 0;
+}
+
+void peaks_free(struct peaks *p)
+{
+	unsigned int l;
+
+	for (l = 0; l < PEAK_LEVELS; l++) {
+		free(p->level[l]);
+		p->level[l] = NULL;
+	}
+	p->capacity = 0;
+	p->frames = 0;
+}
+
+/*
+  Forget the frames indexed, the bins are overwritten as they are reused
+  Audio thread, when a take is started over
+*/
+void peaks_reset(struct peaks *p)
+{
+	p->frames = 0;
+}
+
+// add bins src to dst, or copy them if dst is the first one
+static void merge(struct range *dst, const struct range *src, unsigned int nchannels, int first)
+{
+	unsigned int k;
+
+	for (k = 0; k < nchannels; k++) {
+		if (first) {
+			dst[k] = src[k];
+			continue;
+		}
+		if (src[k].min < dst[k].min)
+			dst[k].min = src[k].min;
+		if (src[k].max > dst[k].max)
+			dst[k].max = src[k].max;
+		dst[k].energy += src[k].energy;
+	}
+}
+
+// add n samples to a bin, the first ones of a bin start it over
+static void measure(struct range *r, const jack_default_audio_sample_t *x, jack_nframes_t n, int first)
+{
+	if (first) {
+		r->min = x[0];
+		r->max = x[0];
+		r->energy = 0;
+	}
+	measure_range(r, x, n);
+}
+
+// bin of the first level is complete: merge it into its parent, and so on up
+static void complete(struct peaks *p, size_t bin)
+{
+	unsigned int l;
+
+	for (l = 0; l + 1 < PEAK_LEVELS; l++) {
+		merge(p->level[l + 1] + bin / PEAK_FACTOR * p->nchannels, p->level[l] + bin * p->nchannels,
+		      p->nchannels, bin % PEAK_FACTOR == 0);
+		if (bin % PEAK_FACTOR != PEAK_FACTOR - 1)
+			break;
+		bin /= PEAK_FACTOR;
+	}
+}
+
+/*
+  Index n frames taken from offset in each channel of src, appended to
+  the take
+  Audio thread, no allocation: beyond the capacity, frames are ignored
+*/
+void peaks_append(struct peaks *p, jack_default_audio_sample_t **src, jack_nframes_t offset, jack_nframes_t n)
+{
+	jack_nframes_t done = 0;
+	unsigned int k;
+
+	while (done < n) {
+		size_t bin = p->frames / PEAK_BLOCK;
+		jack_nframes_t pos = (jack_nframes_t) (p->frames % PEAK_BLOCK);
+		jack_nframes_t len = PEAK_BLOCK - pos;
+
+		if (bin >= p->capacity)
+			return;
+		if (len > n - done)
+			len = n - done;
+		for (k = 0; k < p->nchannels; k++)
+			measure(p->level[0] + bin * p->nchannels + k, src[k] + offset + done, len, pos == 0);
+		done += len;
+		p->frames += len;
+		if (pos + len == PEAK_BLOCK)
+			complete(p, bin);
+	}
+}
+
+/*
+  Index the whole take again
+  The chunks of a take in the arena are read in place, a mapped take is
+  converted a few frames at a time
+*/
+void peaks_scan(struct peaks *p, const struct buffer *b)
+{
+	jack_default_audio_sample_t *src[MAX_CHANNELS];
+	unsigned int k;
+
+	peaks_reset(p);
+	if (b->map == NULL) {
+		const struct chunk *c;
+		for (c = b->head; c != NULL; c = c->next) {
+			for (k = 0; k < p->nchannels; k++)
+				src[k] = (jack_default_audio_sample_t *) CHUNK_CHANNEL(b, c, k);
+			peaks_append(p, src, c->start, c->frames - c->start);
+		}
+	} else {
+		jack_default_audio_sample_t buf[MAX_CHANNELS * SCAN_FRAMES];
+		struct buffer r = *b;
+		jack_nframes_t n;
+
+		for (k = 0; k < p->nchannels; k++)
+			src[k] = buf + k * SCAN_FRAMES;
+		buffer_rewind(&r, 0);
+		while ((n = buffer_read(&r, src, 0, SCAN_FRAMES)) > 0)
+			peaks_append(p, src, 0, n);
+	}
+}
+
+// merge the bins [lo, hi) of level l into out, with the coarsest bins that fit
+static void gather(const struct peaks *p, unsigned int l, size_t lo, size_t hi, struct range *out, int *first)
+{
+	size_t i;
+
+	if (l + 1 < PEAK_LEVELS) {
+		size_t plo = (lo + PEAK_FACTOR - 1) / PEAK_FACTOR, phi = hi / PEAK_FACTOR;
+		if (phi > level_bins(p, l + 1))
+			phi = level_bins(p, l + 1);
+		if (plo < phi) {
+			gather(p, l, lo, plo * PEAK_FACTOR, out, first);
+			gather(p, l + 1, plo, phi, out, first);
+			gather(p, l, phi * PEAK_FACTOR, hi, out, first);
+			return;
+		}
+	}
+	for (i = lo; i < hi; i++) {
+		merge(out, p->level[l] + i * p->nchannels, p->nchannels, *first);
+		*first = 0;
+	}
+}
+
+/*
+  Levels of each channel from frame from to frame to, rounded out to
+  whole bins of the first level
+  At most 2 * PEAK_FACTOR bins per level are read, whatever the length
+  Returns the number of frames covered, 0 if the range is empty
+*/
+size_t peaks_get(const struct peaks *p, size_t from, size_t to, struct range *out)
+{
+	size_t lo = from / PEAK_BLOCK, hi = (to + PEAK_BLOCK - 1) / PEAK_BLOCK;
+	int first = 1;
+
+	if (hi > level_bins(p, 0))
+		hi = level_bins(p, 0);
+	if (lo >= hi)
+		return 0;
+	gather(p, 0, lo, hi, out, &first);
+	return (hi * PEAK_BLOCK < p->frames ? hi * PEAK_BLOCK : p->frames) - lo * PEAK_BLOCK;
+}
+
+// name of the sidecar file of filename, to be freed
+static char *sidecar(const char *filename)
+{
+	size_t len = strlen(filename) + sizeof(PEAKS_EXT);
+	char *path = malloc(len);
+
+	if (path != NULL)
+		snprintf(path, len, "%s%s", filename, PEAKS_EXT);
+	return path;
+}
+
+/*
+  Write the index next to the file the take was saved to
+*/
+int peaks_save(const struct peaks *p, const char *filename)
+{
+	struct peaks_header h = {PEAKS_MAGIC, PEAKS_VERSION, p->nchannels, PEAK_BLOCK, PEAK_FACTOR, PEAK_LEVELS,
+				 p->frames};
+	char *path = sidecar(filename);
+	FILE *f;
+	unsigned int l;
+	int ret = 0;
+
+	if (path == NULL)
+		return -1;
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		perror(path);
+		free(path);
+		return -1;
+	}
+	if (fwrite(&h, sizeof(h), 1, f) != 1)
+		ret = -1;
+	for (l = 0; l < PEAK_LEVELS && ret == 0; l++) {
+		size_t n = level_bins(p, l) * p->nchannels;
+		if (fwrite(p->level[l], sizeof(struct range), n, f) != n)
+			ret = -1;
+	}
+	if (fclose(f) != 0)
+		ret = -1;
+	if (ret != 0) {
+		perror(path);
+		remove(path);
+	}
+	free(path);
+	return ret;
+}
+
+/*
+  Read the index saved next to filename
+  Fails if there is none, or if it doesn't match the take anymore
+*/
+int peaks_load(struct peaks *p, const char *filename, unsigned int nchannels, size_t frames)
+{
+	struct peaks_header h;
+	char *path = sidecar(filename);
+	FILE *f;
+	unsigned int l;
+	int ret = -1;
+
+	if (path == NULL)
+		return -1;
+	f = fopen(path, "rb");
+	free(path);
+	if (f == NULL)
+		return -1;
+	if (fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, PEAKS_MAGIC, 4) == 0 && h.version == PEAKS_VERSION
+	    && h.nchannels == nchannels && h.block == PEAK_BLOCK && h.factor == PEAK_FACTOR
+	    && h.levels == PEAK_LEVELS && h.frames == frames && peaks_alloc(p, nchannels, frames) == 0) {
+		p->frames = frames;
+		ret = 0;
+		for (l = 0; l < PEAK_LEVELS && ret == 0; l++) {
+			size_t n = level_bins(p, l) * nchannels;
+			if (fread(p->level[l], sizeof(struct range), n, f) != n)
+				ret = -1;
+		}
+		if (ret != 0)
+			peaks_reset(p);
+	}
+	fclose(f);
+	return ret;
+}
+
+// minutes and seconds
+static void format_time(char *s, size_t size, double seconds)
+{
+	snprintf(s, size, "%ld:%04.1f", (long) (seconds / 60), fmod(seconds, 60));
+}
+
+/*
+  Draw the whole take, one line per channel, each column showing the
+  peak of its part of the take: from ' ' below OVERVIEW_FLOOR_DB to '#'
+  at full scale, '!' if it clipped
+*/
+void peaks_print(FILE *f, const struct peaks *p, unsigned long srate)
+{
+	static const char glyphs[] = " .:-=+*#";
+	struct range out[MAX_CHANNELS];
+	double seconds = (double) p->frames / (double) srate;
+	char start[32], end[32];
+	size_t width = level_bins(p, 0) < OVERVIEW_WIDTH ? level_bins(p, 0) : OVERVIEW_WIDTH;
+	size_t i;
+	unsigned int k;
+
+	if (width == 0) {
+		fprintf(f, "empty take\n");
+		return;
+	}
+	for (k = 0; k < p->nchannels; k++) {
+		fprintf(f, "%2u [", k + 1);
+		for (i = 0; i < width; i++) {
+			double peak, db;
+			int g;
+			peaks_get(p, p->frames * i / width, p->frames * (i + 1) / width, out);
+			peak = fmax(-out[k].min, out[k].max);
+			db = peak > 0 ? 20 * log10(peak) : OVERVIEW_FLOOR_DB;
+			g = (int) ((db - OVERVIEW_FLOOR_DB) / -OVERVIEW_FLOOR_DB * (sizeof(glyphs) - 1));
+			if (g < 0)
+				g = 0;
+			if (g > (int) sizeof(glyphs) - 2)
+				g = (int) sizeof(glyphs) - 2;
+			fputc(peak >= 1.0 ? '!' : glyphs[g], f);
+		}
+		fprintf(f, "]\n");
+	}
+	// the length of the take under the end of the lines
+	format_time(start, sizeof(start), 0);
+	format_time(end, sizeof(end), seconds);
+	fprintf(f, "    %s%*s, %.1f s per column\n", start, (int) (width + 1 - strlen(start)), end,
+		seconds / (double) width);
+}
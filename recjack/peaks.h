@@ -0,0 +1,50 @@
+#ifndef PEAKS_H
+#define PEAKS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include <jack/jack.h>
+
+#include "buffer.h"
+#include "convert.h"
+
+// frames per bin of the finest level
+#define PEAK_BLOCK 1024
+// bins of a level per bin of the next one
+#define PEAK_FACTOR 8
+// a bin of the last level covers PEAK_BLOCK * PEAK_FACTOR^5 frames, 12 minutes at 48 kHz
+#define PEAK_LEVELS 6
+#define PEAKS_EXT ".peaks"
+#define OVERVIEW_WIDTH 64
+
+/*
+  Peak index of a take: a pyramid of min/max/energy bins
+  Bin i of level l covers the frames from i * PEAK_BLOCK * PEAK_FACTOR^l,
+  a bin holds one struct range per channel
+  The audio thread indexes the frames as they are recorded: the last bin
+  of the first level is filled in place, and a bin that is complete is
+  merged into its parent, which costs O(1) per bin on average
+  The arrays are allocated by the main loop, for the longest possible take
+*/
+struct peaks
+{
+	unsigned int nchannels;
+	// bins of the first level
+	size_t capacity;
+	struct range *level[PEAK_LEVELS];
+	// frames indexed
+	size_t frames;
+};
+
+int peaks_alloc(struct peaks *p, unsigned int nchannels, size_t frames);
+void peaks_free(struct peaks *p);
+void peaks_reset(struct peaks *p);
+void peaks_append(struct peaks *p, jack_default_audio_sample_t **src, jack_nframes_t offset, jack_nframes_t n);
+void peaks_scan(struct peaks *p, const struct buffer *b);
+size_t peaks_get(const struct peaks *p, size_t from, size_t to, struct range *out);
+int peaks_save(const struct peaks *p, const char *filename);
+int peaks_load(struct peaks *p, const char *filename, unsigned int nchannels, size_t frames);
+void peaks_print(FILE *f, const struct peaks *p, unsigned long srate);
+
+#endif // PEAKS_H
@@ -4,10 +4,11 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <time.h>
 #include <errno.h>
-
-#include <pthread.h>
+#include <getopt.h>
+#include <math.h>
 
 #include <jack/jack.h>
 
@@ -15,405 +16,565 @@
 	"m toggles the metronome (if a BPM has been set)\n"	\
 	"s saves the buffer to a file\n"			\
 	"r replays the last recording\n"			\
+	"[ and ] replay the previous/next take\n"		\
+	", and . seek back/forward, < and > by one beat\n"	\
+	"a and b mark a region of the take to repeat, x clears it\n" \
+	"{ and } slow down/speed up playback, at the same pitch\n" \
+	"k lists the takes\n"					\
+	"w draws an overview of the current take\n"		\
+	"o loops the current take, then toggles overdub\n"	\
+	"1-9 select a layer of the loop, +/- change its gain\n"	\
+	"t shows the audio callback timings\n"			\
+	"v shows/hides the input meter\n"			\
+	"l measures the latency (connect an output to an input)\n" \
 	"up/down increases/decreases the click by 10 BPM\n"	\
 	"right/left increases/decreases the click by 1 BPM\n"	\
 	"q exits"
 
+#define USAGE_MSG "usage: %s [-M record buffer MB] [--stream[=tag]] [--dither] [--format=wav|flac] [--depth=16|24|float]\n" \
+	"       [-l file.wav] [-c channels] [--stats=file] [--meter]\n" \
+	"       [--takes=n] [--takes-mb=MB] [--preroll=s] [--seek=s] [--speed=x] [--lock-memory] [--huge-pages]\n" \
+	"       [--signature=beats/unit] [--subdivide=n] [--ramp=bpm:beats] [--transport] [--punch=in:out]\n" \
+	"       [--calibrate] [--latency=frames]\n" \
+	"       [--offline=file.wav|sine|noise|silence [--rate=Hz] [--period=frames] [--seconds=s] [-o file.wav]]\n" \
+	"       [bpm]\n"
+
 #include "recjack.h"
 #include "metronome.h"
-
-static jack_port_t *input_port;
-static jack_port_t *output_port;
-static jack_port_t *metronome_port;
-static jack_client_t *client;
-
-static struct click *click = NULL;
-static jack_nframes_t click_offset = 0;
-static pthread_mutex_t click_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-static jack_latency_range_t input_latency_range;
-
-static char mode;
-
-#define STOPPED 0
-#define RUNNING 1
-static char metronome_state = STOPPED;
-void connect_physical(jack_port_t *port, unsigned long flags, unsigned int n);
-void connect_metronome(void);
-void disconnect_metronome(void);
-void toggle_metronome(void);
-void metronome_synchronize(jack_nframes_t offset, jack_nframes_t *delay);
-void init_jack(void);
-void init_finish(void);
+#include "stream.h"
+#include "stats.h"
+#include "meter.h"
+#include "calibrate.h"
+#include "history.h"
+#include "loop.h"
+#include "save.h"
+#include "memory.h"
+#include "peaks.h"
+#include "stretch.h"
+#include "flac.h"
+#include "wave.h"
+#include "convert.h"
+#include "engine.h"
+#include "backend.h"
+
+static unsigned int nchannels = 1;
+static struct engine engine;
+static struct backend *backend;
+static struct stats stats;
+// input levels, drawn in the terminal if show_meter is set
+static struct meter meter;
+static int show_meter;
+// the audio thread writes to wakeup[1] when it posts messages
+static int wakeup[2] = {-1, -1};
+// the beep is computed once, tempo changes only send the new settings
+static struct beep *beep;
+static struct tempo tempo;
+// the last takes, the current one is being recorded or played
+static struct history history;
+
+// the mode as last reported by the audio thread, 0 while a change is pending
+static char ui_mode;
+
+// latency measurement being analyzed, if any
+static struct calibration *calibrating;
+
+// loop handed to the audio thread, if any
+static struct loop *looping;
+static char overdub;
+
+// A-B region of the current take, in frames, mark_b is 0 until it is set
+static size_t mark_a, mark_b;
+static int mark_set;
+// seek step, in seconds
+static double seek_seconds = SEEK_SECONDS;
+// playback speed in percent, takes are stretched by a worker thread
+static unsigned int speed = SPEED_NORMAL;
+
+// takes are saved in the background, one at a time
+static struct saver saver;
+static enum save_format save_format = FORMAT_WAV;
+static enum sample_format save_sample = SAMPLE_S16;
+
+void request_mode(char m);
+void request_calibration(void);
+void request_loop(void);
+void request_gain(float delta);
+void request_seek(double delta);
+void request_mark(char m, double beat);
+void request_speed(int delta);
+void read_ahead(void);
+void check_calibration(void);
+void check_save(void);
+void request_take(int dir);
+void process_messages(void);
+void interactive(int calibrate);
 void display_help(void);
+const char *mode_name(char m);
 
 /*
-  Connect port to available physical ports
-  If n = 0, connect to all ports
-  Otherwise, connect to the first n ports
+  Build a file name from the current date and time, a tag and an extension
+  Filename format: [date]_[time]_[tag].[ext]
+  The returned string must be freed
 */
-void connect_physical(jack_port_t *port, unsigned long flags, unsigned int n)
+char *make_filename(const char *tag, const char *ext)
 {
-	unsigned int i;
+	char date[DATELEN];
+	char *filename = malloc(DATELEN+strlen(tag) + 1+strlen(ext) + 1);
+	time_t t;
+	struct tm lt;
+
+	t = time(NULL);
+	if (localtime_r(&t, &lt) == NULL) {
+		perror("localtime");
+		memset(&lt, 0, sizeof(struct tm));
+	}
+	strftime(date, DATELEN, DATEFMT, &lt);
+	sprintf(filename, FILEFMT, date, tag, ext);
 
-	const char **ports = jack_get_ports(client, NULL, NULL, JackPortIsPhysical|flags);
-	if (ports == NULL) {
-		fprintf(stderr, "no physical port found\n");
-		exit(1);
+	return filename;
+}
+
+/*
+  Save the current audio buffer to a file
+  Ask the user for a tag to put in the filename
+  Filename format: [date]_[time]_[tag].[ext]
+  The file is written in the background, check_save reports when it's done
+  Returns 0 if the save started
+*/
+int save_buffer(struct buffer *b)
+{
+	// ask for a filename and write to disk
+	char name[10];
+	int ret = -1;
+
+	if (atomic_load(&saver.running)) {
+		printf("\na take is still being saved to %s\n", saver.filename);
+		return -1;
 	}
+	while (1) {
+		memset(name, 0, 10);
+		printf("\nFilename (max 10 chars, press . to cancel, date/time will be added automatically):\n  > ");
+		int n = scanf("%10s", name);
+		if (n > 0) {
+			if (name[0] == '.' && name[1] == 0) {
+				// don't save
+				printf("buffer not saved\n");
+				break;
+			} else {
+				char *filename = make_filename(name, format_extension(save_format));
 
-	for (i = 0; ports[i] != NULL && (n == 0 || i < n); i++) {
-		if (flags & JackPortIsInput) {
-			if (jack_connect(client, jack_port_name(port), ports[i]))
-				fprintf(stderr, "cannot connect physical port\n");
-		} else if (flags & JackPortIsOutput) {
-			if (jack_connect(client, ports[i], jack_port_name(port)))
-				fprintf(stderr, "cannot connect physical port\n");
+				int fd = open(filename, O_RDONLY); // check that the file doesn't exist
+				if (fd > 0) {
+					printf("%s already exists, choose another file name or cancel\n", filename);
+					close(fd);
+					free(filename);
+					continue;
+				}
+
+				fd = open(filename, O_CREAT|O_RDWR, FILEPERM);
+				if (fd < 0) {
+					perror("couldn't create the file");
+					free(filename);
+					continue;
+				}
+				if (save_start(&saver, fd, filename, b, save_format, save_sample) != 0) {
+					fprintf(stderr, "cannot start saving\n");
+					close(fd);
+					unlink(filename);
+					free(filename);
+					break;
+				}
+				printf("saving to %s\n", filename);
+				ret = 0;
+				break;
+			}
 		}
 	}
+	printf("Waiting...");
+	fflush(stdout);
+	return ret;
+}
 
-	free(ports);
+/*
+  Report the save that just ended, if any, with the time it took and the
+  size of the file
+  Its take may then be forgotten or spilled again
+*/
+void check_save(void)
+{
+	unsigned int nchannels = saver.b.map != NULL ? saver.b.map->nchannels : saver.b.nchannels;
+	size_t wave_bytes = wave_file_size(saver.b.frames, nchannels, SAMPLE_S16);
+
+	if (!save_finish(&saver))
+		return;
+	history.saving = NULL;
+	if (saver.ret != 0) {
+		printf("\ncouldn't save %s", saver.filename);
+		unlink(saver.filename);
+	} else {
+		printf("\ntake saved to %s: %.1f MB in %.2f s", saver.filename,
+		       (double) saver.bytes / (1 << 20), saver.seconds);
+		if (saver.format != FORMAT_WAV)
+			printf(" (%.0f%% of WAV)", 100.0 * (double) saver.bytes / (double) wave_bytes);
+	}
+	free(saver.filename);
+	saver.filename = NULL;
+	fflush(stdout);
 }
 
 /*
-  Connect the metronome port to all the physical output ports
+  Ask the audio thread to switch mode (0 for the next mode in the sequence)
+  Until the audio thread confirms the change, the mode is unknown
 */
-void connect_metronome(void)
+void request_mode(char m)
 {
-	if (metronome_state == STOPPED) {
-		connect_physical(metronome_port, JackPortIsInput, 0);
+	if (send_message(&engine.to_process, MSG_MODE, m, NULL) == 0)
+		ui_mode = 0;
+}
 
-		metronome_state = RUNNING;
+/*
+  Ask the audio thread to play the take before (dir < 0) or after the
+  current one, and replay it
+*/
+void request_take(int dir)
+{
+	struct take *t = history_step(&history, dir);
+
+	if (t == NULL) {
+		printf("\nno %s take", dir < 0 ? "previous" : "next");
+		fflush(stdout);
+		return;
 	}
+	if (send_take(&engine.to_process, MSG_TAKE, &t->b) == 0)
+		request_mode(MODE_LIWAIT);
 }
 
 /*
-  Disconnect the metronome port from all the physical output ports
+  Make a loop of the current take and hand it to the audio thread
+  The take is aligned the same way as when it is replayed
 */
-void disconnect_metronome(void)
+void request_loop(void)
 {
-	if (metronome_state == RUNNING) {
-		const char **ports = jack_port_get_connections(metronome_port);
-		if (ports == NULL)
-			return;
-		int i = 0;
-		while (ports[i] != NULL) {
-			if (jack_disconnect(client, jack_port_name(metronome_port), ports[i]))
-				fprintf(stderr, "cannot disconnect output port\n");
-			i++;
-		}
-		free(ports);
-		metronome_state = STOPPED;
+	jack_nframes_t capture = (engine.input_latency_range.min + engine.input_latency_range.max) / 2;
+	struct loop *l;
+
+	l = loop_new(&history.current->b, engine.latency_set ? 0 : capture, history.srate, tempo.bpm,
+		     engine.latency_set ? engine.latency : capture);
+	if (l == NULL)
+		return;
+	// the audio thread doesn't have it yet, the first spare layer can be set directly
+	l->spare = loop_spare(l);
+	if (send_loop(&engine.to_process, MSG_LOOP, l, NULL, 0) != 0) {
+		loop_free(l);
+		return;
 	}
+	looping = l;
+	overdub = 0;
 }
 
 /*
-  Change metronome state: connected -> disconnected or disconnected -> connected
+  Frames per beat of the metronome, 0 if it is off
 */
-void toggle_metronome(void)
+static double beat_frames(int metronome_on)
 {
-	if (metronome_state == STOPPED)
-		connect_metronome();
-	else if (metronome_state == RUNNING)
-		disconnect_metronome();
+	if (!metronome_on || tempo.bpm == 0)
+		return 0;
+	return (double) history.srate * 60.0 / tempo.bpm;
 }
 
 /*
-  JACK callback function
-  If JACK exits, stop running.
+  The beat of the current take nearest to frame
+  The beats are counted from where replay starts, so that the take plays
+  in time with the metronome from any of them
 */
-void jack_shutdown(void *__attribute__((__unused__))arg)
+static size_t snap_beat(size_t frame, double beat)
 {
-	exit(1);
+	size_t origin = engine.latency_set ? 0
+		: (engine.input_latency_range.min + engine.input_latency_range.max) / 2;
+
+	if (beat == 0)
+		return frame;
+	if (frame <= origin)
+		return origin;
+	return origin + (size_t) llround(round((double) (frame - origin) / beat) * beat);
 }
 
 /*
-  Synchronize the mode switch for recording/playing with a metronome click
-
-  If we were waiting for synchronization with a new click and we reach
-  the beginning of a new click, start recording/playing.
-
-  Store the current offset in delay
+  Move the playback position of the current take by delta frames
+  With a region, the position stays in it
+  The chunks are walked here, the audio thread only jumps to the cursor
 */
-void metronome_synchronize(jack_nframes_t offset, jack_nframes_t *delay)
+void request_seek(double delta)
 {
-	if (click_offset == 0 && (mode == MODE_REWAIT || mode == MODE_LIWAIT)) {
-		if (mode == MODE_REWAIT)
-			mode = MODE_RECORD;
-		else if (mode == MODE_LIWAIT)
-			mode = MODE_LISTEN;
-		// and offset with the right number of frames to get synchronization
-		if (delay != NULL)
-			*delay = offset;
+	struct buffer *b = &history.current->b;
+	double to = (double) atomic_load_explicit(&engine.position, memory_order_relaxed) + delta;
+	double lo = 0, hi = (double) b->frames;
+	struct cursor c;
+
+	if (mark_b > 0) {
+		lo = (double) mark_a;
+		hi = (double) mark_b - 1;
 	}
+	if (to > hi)
+		to = hi;
+	if (to < lo)
+		to = lo;
+	buffer_locate(b, (size_t) to, &c);
+	if (send_cursor(&engine.to_process, MSG_SEEK, b, &c, 0) == 0)
+		printf("\nat %.1f s", (double) c.frame / (double) history.srate);
+	fflush(stdout);
 }
 
 /*
-  JACK callback function
-  - first, process the metronome output
-  - then, handle the recording/playback
+  Mark the start (a) or the end (b) of the region at the playback
+  position, or clear the region (x)
+  With the metronome on, the marks snap to its beats and the region is a
+  whole number of beats long, it repeats in time
+  The audio thread gets the region once both marks are set
 */
-int process(jack_nframes_t nframes, void *arg)
+void request_mark(char m, double beat)
 {
-	// metronome
-	jack_nframes_t record_offset = 0;
-	if (pthread_mutex_trylock(&click_mutex) != 0) {
-		// mutex unavailable, don't output anything and wait for the next cycle
-		click_offset += nframes;
-	} else {
-		jack_default_audio_sample_t *buf;
-		jack_nframes_t remaining = nframes; // how many samples do we need to fill the buffer?
-		jack_nframes_t written = 0; // how many samples have been written to the buffer?
-		buf = (jack_default_audio_sample_t *) jack_port_get_buffer(metronome_port, nframes);
-
-		// has a metronome been set up?
-		// no metronome
-		// write some silence, skip waiting mode and start recording/playing immediately
-		if (click == NULL) {
-			if (mode == MODE_REWAIT)
-				mode = MODE_RECORD;
-			if (mode == MODE_LIWAIT)
-				mode = MODE_LISTEN;
-			memset(buf, 0, nframes * sizeof(jack_default_audio_sample_t));
+	struct buffer *b = &history.current->b;
+	size_t pos = atomic_load_explicit(&engine.position, memory_order_relaxed);
+	struct cursor c;
+
+	if (m == 'b' && !mark_set) {
+		printf("\nmark the start of the region first");
+	} else if (m == 'b') {
+		size_t end = pos;
+		if (beat != 0) {
+			double beats = round((double) (pos > mark_a ? pos - mark_a : 0) / beat);
+			end = mark_a + (size_t) llround((beats < 1 ? 1 : beats) * beat);
+		}
+		if (end > b->frames)
+			end = b->frames;
+		if (end <= mark_a) {
+			printf("\nthe end of the region must come after its start");
 		} else {
-			// click != NULL -- we do have a metronome
-			// copy the whole click as many times as necessary to fill the buffer
-			while ((click->size - click_offset) < remaining) {
-				metronome_synchronize(written, &record_offset);
-
-				memcpy(buf + written, click->buf + click_offset,
-				       (click->size - click_offset) * sizeof(jack_default_audio_sample_t));
-				remaining -= click->size - click_offset;
-				written += click->size - click_offset;
-				click_offset = 0;
-			}
-
-			// and complete if there's still some room in the buffer
-			if (remaining > 0) {
-				metronome_synchronize(written, &record_offset);
-
-				memcpy(buf + written, click->buf + click_offset,
-				       remaining * sizeof(jack_default_audio_sample_t));
-				click_offset += remaining;
+			buffer_locate(b, mark_a, &c);
+			if (send_cursor(&engine.to_process, MSG_REGION, b, &c, end) == 0) {
+				mark_b = end;
+				printf("\nrepeating %.1f s to %.1f s", (double) mark_a / (double) history.srate,
+				       (double) mark_b / (double) history.srate);
 			}
 		}
-		pthread_mutex_unlock(&click_mutex);
-	}
-	// end metronome
-
-	// recording/playing
-	if (pthread_mutex_trylock(&buffer_mutex) == 0) {
-		jack_default_audio_sample_t *s;
-		struct buffer *b = (struct buffer *) arg;
-		jack_nframes_t record_size = nframes - record_offset;
-		size_t size = sizeof(jack_default_audio_sample_t) * record_size;
-		size_t offset = sizeof(jack_default_audio_sample_t) * record_offset;
-
-		if (mode == MODE_RECORD) {
-			jack_latency_range_t range;
-			jack_port_get_latency_range(input_port, JackCaptureLatency, &range);
-			if (range.min != input_latency_range.min || range.max != input_latency_range.max) {
-				input_latency_range.min = range.min;
-				input_latency_range.max = range.max;
-				//printf("Latency change: %d-%d\n", range.min, range.max);
-			}
-
-			// make the buffer larger and append the sample
-			s = jack_port_get_buffer(input_port, nframes);
-			b->size += size;
-			b->buf = realloc(b->buf, b->size);
-			memcpy(b->buf + b->offset, s + offset, size);
-			b->offset += size;
-		} else if (mode == MODE_LISTEN) {
-			// get a sample from the buffer and play it
-			s = jack_port_get_buffer(output_port, nframes);
-			memset(s, 0, offset);
-			// not enough data in the recording buffer to fill the output buffer?
-			if (size > (b->size - b->offset)) {
-				// write all we have, fill the rest with zeroes
-				memcpy(s + offset, b->buf + b->offset, b->size - b->offset);
-				memset(s + offset + b->size - b->offset, 0, size - (b->size - b->offset));
-				pthread_mutex_unlock(&buffer_mutex);
-				// playback complete, switch mode
-				change_mode(b, 0);
-			} else {
-				memcpy(s + offset, b->buf + b->offset, size);
-				b->offset += size;
-			}
-		} else {
-			// if we are neither recording nor playing, write some silence
-			s = jack_port_get_buffer(output_port, nframes);
-			memset(s, 0, nframes * sizeof(jack_default_audio_sample_t));
+	} else {
+		// a new start clears the region, until its end is marked
+		if (mark_b > 0) {
+			buffer_locate(b, 0, &c);
+			if (send_cursor(&engine.to_process, MSG_REGION, b, &c, 0) != 0)
+				return;
+			mark_b = 0;
 		}
-		pthread_mutex_unlock(&buffer_mutex);
+		mark_set = m == 'a';
+		mark_a = snap_beat(pos < b->frames ? pos : b->frames, beat);
+		if (m == 'a')
+			printf("\nregion from %.1f s", (double) mark_a / (double) history.srate);
+		else
+			printf("\nregion cleared");
 	}
-
-	return 0;
+	fflush(stdout);
 }
 
 /*
-  Save the current audio buffer to a file
-  Ask the user for a tag to put in the filename
-  Filename format: [date]_[time]_[tag].[ext]
+  A take played from a file is read ahead of the audio thread, which
+  would otherwise wait for the disk in the callback, and so is the start
+  of the region it comes back to
+  The audio thread starts playing on a beat without a message, the main
+  loop still sees LIWAIT while the take is played
 */
-int save_buffer(struct buffer *b)
+void read_ahead(void)
 {
-	// ask for a filename and write to disk
-	char name[10];
-	char saved = 0;
-	while (!saved) {
-		memset(name, 0, 10);
-		printf("\nFilename (max 10 chars, press . to cancel, date/time will be added automatically):\n  > ");
-		int n = scanf("%10s", name);
-		if (n > 0) {
-			if (name[0] == '.' && name[1] == 0) {
-				// don't save
-				printf("buffer not saved\n");
-				break;
-			} else {
-				// filename format: [date]_[time]_[tag].[ext]
-				char *date = malloc(DATELEN);
-				char *filename = malloc(DATELEN+strlen(name) + 1+strlen(FILEEXT) + 1);
-				time_t t;
-				struct tm lt;
-
-				t = time(NULL);
-				if (localtime_r(&t, &lt) == NULL) {
-					perror("localtime");
-					// couldn't save, go back to what we were doing
-				}
-				strftime(date, DATELEN, DATEFMT, &lt);
-				sprintf(filename, FILEFMT, date, name, FILEEXT);
-				free(date);
+	const struct buffer *b = &history.current->b;
+	size_t ahead = READAHEAD_SECONDS * history.srate;
+
+	if (b->map == NULL || (ui_mode != MODE_LISTEN && ui_mode != MODE_LIWAIT))
+		return;
+	wave_map_prefetch(b->map, atomic_load_explicit(&engine.position, memory_order_relaxed), ahead);
+	if (mark_b > 0)
+		wave_map_prefetch(b->map, mark_a, ahead);
+}
 
-				int fd = open(filename, O_RDONLY); // check that the file doesn't exist
-				if (fd > 0) {
-					printf("%s already exists, choose another file name or cancel\n", filename);
-					close(fd);
-					continue;
-				}
+/*
+  Change the playback speed, the pitch stays the same
+  The audio thread picks it up at its next period
+*/
+void request_speed(int delta)
+{
+	int s = (int) speed + delta;
 
-				fd = open(filename, O_CREAT|O_WRONLY, FILEPERM);
-				if (fd < 0) {
-					perror("couldn't create the file");
-					continue;
-				}
-				write_wave_header(fd, b->srate, b->size / sizeof(jack_default_audio_sample_t));
-				write_wave_samples(fd, b->size / sizeof(jack_default_audio_sample_t), b->buf);
-				close(fd);
-				printf("buffer saved to %s\n", filename);
-				free(filename);
-				break;
-			}
-		}
+	if (engine.stretch == NULL) {
+		printf("\nvariable speed playback isn't available");
+		fflush(stdout);
+		return;
 	}
-	mode = MODE_PAUSED;
-	printf("Waiting...");
+	if (s < SPEED_MIN)
+		s = SPEED_MIN;
+	if (s > SPEED_MAX)
+		s = SPEED_MAX;
+	speed = (unsigned int) s;
+	engine_speed(&engine, speed);
+	printf("\nspeed %u%%", speed);
 	fflush(stdout);
-	return 0;
 }
 
 /*
-  The main loop cycles through 3 states:
-  - MODE_RECORD: the audio input is stored in a buffer
-  - MODE_LISTEN: playback the buffer
-  - MODE_PAUSE:  wait
-  The natural sequence is PAUSE > RECORD > LISTEN > PAUSE
-
-  In MODE_PAUSE, we may switch back directly to MODE_LISTEN, which
-  restarts playback of the current audio buffer.
-
-  MODE_LIWAIT and MODE_REWAIT wait for synchronization with the
-  metronome. As soon as we are in sync with the metronome (at the
-  start of the next click), recording/playback begins.
+  Change the gain of the selected layer of the loop
+  The audio thread corrects the mix over the next pass
 */
-void change_mode(struct buffer *b, char m)
+void request_gain(float delta)
 {
-	if (m != 0) {
-		mode = m;
-		printf("\nPlaying recorded bit...");
-		fflush(stdout);
+	struct layer *layer = &looping->layers[looping->selected];
+	float gain = layer->gain + delta;
+
+	if (gain < LAYER_GAIN_STEP / 2)
+		gain = 0;
+	if (gain > LAYER_GAIN_MAX)
+		gain = LAYER_GAIN_MAX;
+	if (send_loop(&engine.to_process, MSG_GAIN, looping, layer, gain - layer->gain) == 0)
+		layer->gain = gain;
+	printf("\nlayer %u: gain %.1f", looping->selected + 1, layer->gain);
+	fflush(stdout);
+}
+
+/*
+  Ask the audio thread to measure the round trip latency
+*/
+void request_calibration(void)
+{
+	struct calibration *c;
+
+	if (calibrating != NULL)
+		return;
+	c = calibration_new();
+	if (c == NULL) {
+		fprintf(stderr, "cannot allocate the calibration buffers\n");
+		return;
+	}
+	if (send_calibration(&engine.to_process, c) != 0)
+		calibration_free(c);
+}
+
+/*
+  If the analysis of the latency is over, report it and apply it
+*/
+void check_calibration(void)
+{
+	if (calibrating == NULL || !calibration_finish(calibrating))
+		return;
+
+	if (calibrating->latency < 0) {
+		printf("\nlatency: no clear peak (quality %.1f), check that an output is connected to the first input",
+		       calibrating->quality);
+	} else if (send_latency(&engine.to_process, (size_t) calibrating->latency) != 0) {
+		printf("\nlatency: %ld frames round trip, couldn't be applied, use --latency=%ld",
+		       calibrating->latency, calibrating->latency);
 	} else {
-		pthread_mutex_lock(&buffer_mutex);
-		switch (mode) {
-		case MODE_RECORD:
-			mode = MODE_LIWAIT;
-			printf("\nPlaying recorded bit...");
+		printf("\nlatency: %ld frames round trip (quality %.0f), use --latency=%ld to skip the measurement",
+		       calibrating->latency, calibrating->quality, calibrating->latency);
+	}
+	fflush(stdout);
+	calibration_free(calibrating);
+	calibrating = NULL;
+}
+
+/*
+  Handle the messages sent by the audio thread: print the new mode,
+  keep track of the takes, and start the analysis of a latency capture
+*/
+void process_messages(void)
+{
+	struct message msg;
+	struct buffer *b;
+
+	while (ringbuffer_read_space(&engine.from_process) >= sizeof(struct message)) {
+		ringbuffer_read(&engine.from_process, &msg, sizeof(struct message));
+		if (msg.type == MSG_CALIBRATE) {
+			if (msg.calibration->pos < CALIBRATION_FRAMES) {
+				printf("\nlatency: can only be measured while waiting");
+				calibration_free(msg.calibration);
+			} else if (calibration_analyze(msg.calibration) != 0) {
+				calibration_free(msg.calibration);
+			} else {
+				calibrating = msg.calibration;
+			}
 			fflush(stdout);
-			// set the offset to the start of the buffer
-			b->offset = 0;
-			break;
-		case MODE_LISTEN:
-			mode = MODE_PAUSED;
-			printf("\nWaiting...");
+		} else if (msg.type == MSG_LOOP) {
+			printf("\nloop over, %u layers", msg.loop->nlayers);
 			fflush(stdout);
-			b->offset = 0;
-			b->offset = (input_latency_range.min + input_latency_range.max) / 2;
-			break;
-		case MODE_PAUSED:
-			mode = MODE_REWAIT;
-			printf("\nRecording...");
+			loop_free(msg.loop);
+			looping = NULL;
+		} else if (msg.type == MSG_LAYER) {
+			// the layers come back in order
+			msg.loop->nlayers++;
+			printf("\nlayer %u recorded", msg.loop->nlayers);
 			fflush(stdout);
-			// reset the buffer before starting to record
-			free(b->buf);
-			b->buf = NULL;
-			b->size = 0;
-			b->offset = 0;
+		} else if (msg.type == MSG_OVERDUB) {
+			// the spare is being recorded, the next one must be there before the next pass
+			struct layer *spare = loop_spare(msg.loop);
+			if (spare == NULL)
+				printf("\nno room for more layers");
+			else
+				send_loop(&engine.to_process, MSG_LAYER, msg.loop, spare, 0);
+			fflush(stdout);
+		} else if (msg.type == MSG_GAIN) {
+			msg.layer->gain -= msg.gain;
+			printf("\nlayer gain unchanged, too many changes at once");
+			fflush(stdout);
+		} else if (msg.type == MSG_SPARE) {
+			history_recorded(&history, msg.take);
+			// the audio thread dropped the region with the take
+			mark_set = 0;
+			mark_b = 0;
+		} else if (msg.type == MSG_TAKE) {
+			history_select(&history, msg.take);
+			mark_set = 0;
+			mark_b = 0;
+			printf("\ntake %u (%.1f s%s)", history.current->number,
+			       (double) msg.take->frames / (double) msg.take->srate,
+			       msg.take->map != NULL ? ", on disk" : "");
+			fflush(stdout);
+		} else if (msg.type == MSG_MODE) {
+			ui_mode = msg.mode;
+			b = &history.current->b;
+			if (ui_mode == MODE_LIWAIT) {
+				// a take that started with a pre-roll has no index yet
+				if (b->map == NULL && b->peaks == NULL)
+					history_peaks(&history);
+				printf("\nPlaying recorded bit...");
+				if (b->dropped > 0)
+					printf(" (record buffer full, %zu frames dropped)", b->dropped);
+				if (b->clipped > 0)
+					printf(" (%zu samples clipped)", b->clipped);
+			} else if (ui_mode == MODE_PAUSED) {
+				printf("\nWaiting...");
+			} else if (ui_mode == MODE_REWAIT) {
+				printf("\nRecording...");
+			} else if (ui_mode == MODE_CALIBRATE) {
+				printf("\nMeasuring the latency...");
+			} else if (ui_mode == MODE_LOWAIT && looping != NULL) {
+				if (looping->beats > 0)
+					printf("\nLooping %u beats...", looping->beats);
+				else
+					printf("\nLooping %.1f s...", (double) looping->length / (double) history.srate);
+			}
 			fflush(stdout);
-			break;
 		}
-		pthread_mutex_unlock(&buffer_mutex);
 	}
 }
 
 /*
-  Main:
-  - Parse command-line arguments
-  - Initialize JACK
+  Interactive session:
   - Initialize the terminal
-  - Main loop
+  - Main loop, asleep until a key is hit or the audio thread has news
   - read a keystroke from the terminal to get a command
 */
-int main(int argc, char **argv)
+void interactive(int calibrate)
 {
 	char c;
-	struct buffer b;
-	b.buf = NULL;
-	b.offset = 0;
-	b.size = 0;
-	b.frames_off = 0;
-	b.srate = 0;
-
-	printf("Type h for some help\nHit space to start or stop recording\n\n");
-
-	// read bpm on the command line
-	// no bpm, no metronome
-	unsigned int bpm = 0;
-	if (argc == 1) {
-		printf("metronome: no bpm provided, disabling the metronome for now\n");
-	} else {
-		bpm = (unsigned int) atoi(argv[1]);
-		printf("metronome: %d bpm\n", bpm);
-	}
-
-	init_jack();
-
-	// set callbacks
-	jack_set_process_callback(client, process, (void *) &b);
-	jack_on_shutdown(client, jack_shutdown, 0);
-
-	init_finish();
-
-	b.srate = jack_get_sample_rate(client);
-	if (bpm != 0) {
-		pthread_mutex_lock(&click_mutex);
-		click = generate_click(bpm, b.srate, 440, 0.5F, 10);
-		pthread_mutex_unlock(&click_mutex);
-		connect_metronome();
-	} else {
-		click = NULL;
-	}
+	char drain[64];
+	int metronome_on = tempo.bpm != 0;
+	struct pollfd fds[2] = {{.fd = STDIN, .events = POLLIN}, {.fd = wakeup[0], .events = POLLIN}};
 
 	//
 	// Initialize the terminal
@@ -431,31 +592,124 @@ int main(int argc, char **argv)
 	//
 	// start the main loop
 	//
-	mode = MODE_PAUSED;
-	printf("Waiting...");
+	if (history.current->b.map != NULL)
+		printf("Playing...");
+	else
+		printf("Waiting...");
 	fflush(stdout);
 
+	if (calibrate)
+		request_calibration();
+
 	while (1) {
+		// no timeout unless something has to be checked at intervals
+		int timeout = -1;
+		if (show_meter)
+			timeout = METER_INTERVAL_MS;
+		else if (calibrating != NULL || atomic_load(&saver.running) || history.spilling != NULL
+			 || (history.current->b.map != NULL && (ui_mode == MODE_LIWAIT || ui_mode == MODE_LISTEN)))
+			timeout = CHECK_INTERVAL_MS;
+		if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		if (fds[1].revents & POLLIN)
+			while (read(wakeup[0], drain, sizeof(drain)) > 0)
+				;
+
+		process_messages();
+		read_ahead();
+		// the old takes are sent to disk from here, never from the audio thread
+		history_trim(&history, &engine.to_process);
+		check_calibration();
+		check_save();
+		// the meter is redrawn when the audio thread has new levels
+		if (show_meter && meter_read(&meter))
+			meter_print(stdout, &meter, mode_name(ui_mode));
 		if (read(STDIN, &c, 1) == 1) {
 			if (c == ' ')
-				change_mode(&b, 0);
-			else if (c == 'm' && bpm != 0)
-				toggle_metronome();
-			else if (c == 's' && mode == MODE_PAUSED) {
+				request_mode(0);
+			else if (c == 'm' && tempo.bpm != 0) {
+				metronome_on = !metronome_on;
+				engine_click(&engine, metronome_on);
+			} else if (c == 's' && ui_mode == MODE_PAUSED) {
 				// there's something in the buffer and we want to save it
 				// temporarily reset the terminal
 				ttystate.c_lflag |= ICANON;
 				fcntl(STDIN, F_SETFL, flags);
 				tcsetattr(STDIN, TCSANOW, &ttystate);
 
-				save_buffer(&b);
+				if (save_buffer(&history.current->b) == 0)
+					history.saving = history.current;
 
 				ttystate.c_lflag &= (tcflag_t) ~ICANON;
 				fcntl(STDIN, F_SETFL, flags | O_NONBLOCK);
 				tcsetattr(STDIN, TCSANOW, &ttystate);
-			} else if (c == 'r' && mode == MODE_PAUSED) // replay
-				change_mode(&b, MODE_LIWAIT);
-			else if (c == 'q')
+			} else if (c == 'r' && ui_mode == MODE_PAUSED) // replay
+				request_mode(MODE_LIWAIT);
+			else if ((c == '[' || c == ']')
+				 && (ui_mode == MODE_PAUSED || ui_mode == MODE_LIWAIT || ui_mode == MODE_LISTEN))
+				request_take(c == '[' ? -1 : 1);
+			else if ((c == ',' || c == '.' || c == '<' || c == '>' || c == 'a' || c == 'b' || c == 'x')
+				 && (ui_mode == MODE_PAUSED || ui_mode == MODE_LIWAIT || ui_mode == MODE_LISTEN)) {
+				// with the metronome on, playback moves by whole beats and stays in time
+				double beat = beat_frames(metronome_on);
+				double step = seek_seconds * (double) history.srate;
+				if (beat != 0)
+					step = fmax(round(step / beat), 1) * beat;
+				if (c == ',' || c == '.')
+					request_seek(c == ',' ? -step : step);
+				else if (c != '<' && c != '>')
+					request_mark(c, beat);
+				else if (beat != 0)
+					request_seek(c == '<' ? -beat : beat);
+				else
+					printf("\nno metronome, no beats to seek to");
+				fflush(stdout);
+			}
+			else if (c == '{' || c == '}')
+				request_speed(c == '{' ? -SPEED_STEP : SPEED_STEP);
+			else if (c == 'o' && ui_mode == MODE_PAUSED && looping == NULL)
+				request_loop();
+			else if (c == 'o' && looping != NULL && (ui_mode == MODE_LOWAIT || ui_mode == MODE_LOOP)) {
+				overdub = !overdub;
+				if (send_message(&engine.to_process, MSG_OVERDUB, overdub, NULL) == 0)
+					printf("\noverdub %s", overdub ? "on, from the next pass" : "off at the end of the pass");
+				fflush(stdout);
+			} else if (c >= '1' && c <= '9' && looping != NULL) {
+				if ((unsigned int) (c - '1') < looping->nlayers) {
+					looping->selected = (unsigned int) (c - '1');
+					printf("\nlayer %u: gain %.1f", looping->selected + 1,
+					       looping->layers[looping->selected].gain);
+					fflush(stdout);
+				}
+			} else if ((c == '+' || c == '-') && looping != NULL)
+				request_gain(c == '+' ? LAYER_GAIN_STEP : -LAYER_GAIN_STEP);
+			else if (c == 'k') {
+				printf("\n");
+				history_print(stdout, &history);
+			} else if (c == 'w' && ui_mode != MODE_REWAIT && ui_mode != MODE_RECORD) {
+				// the current take isn't being recorded, its index can be read
+				struct peaks *p = history_peaks(&history);
+				printf("\n");
+				if (p != NULL)
+					peaks_print(stdout, p, history.srate);
+			} else if (c == 'l' && ui_mode == MODE_PAUSED)
+				request_calibration();
+			else if (c == 'v') {
+				// the meter takes the status line, give it back when it's hidden
+				show_meter = !show_meter;
+				if (show_meter)
+					printf("\n");
+				else
+					printf("\r\033[K%s...", mode_name(ui_mode));
+				fflush(stdout);
+			} else if (c == 't') {
+				struct stats_summary sum;
+				stats_get(&stats, &sum);
+				printf("\n");
+				stats_print(stdout, &sum);
+			} else if (c == 'q')
 				break;
 			else if (c == 'h')
 				display_help();
@@ -476,107 +730,495 @@ int main(int argc, char **argv)
 						bpm_var = 0;
 
 					if (bpm_var != 0) {
-						// metronome has changed, generate the new sound
-						struct click *click_tmp = click;
-						click = NULL;
-						free_click(click_tmp);
-						if (bpm == 0) {
+						// metronome has changed, the audio thread switches to the new tempo at the next beat
+						// a manual change ends the ramp, if there's one
+						if (tempo.ramp_beats > 0) {
+							tempo.bpm = tempo.ramp_bpm;
+							tempo.ramp_beats = 0;
+						}
+						if (tempo.bpm == 0) {
 							// set to default bpm when first starting the metronome
-							bpm = (unsigned int) DEFAULT_BPM;
-						} else if (((int) bpm + bpm_var) > 0) {
-							bpm = (unsigned int) ((int) bpm + bpm_var);
+							tempo.bpm = DEFAULT_BPM;
+						} else if (tempo.bpm + bpm_var > 0) {
+							tempo.bpm += bpm_var;
+							if (tempo.bpm > MAX_BPM)
+								tempo.bpm = MAX_BPM;
 						} else {
-							bpm = 0;
+							tempo.bpm = 0;
+							send_message(&engine.to_process, MSG_CLICK, 0, &tempo);
 							printf("metronome disabled\n");
 							continue;
 						}
-						printf("bpm: %d\n", bpm);
-						click_tmp = generate_click(bpm, b.srate, 440, 0.5F, 10);
-						click_offset = 0;
-						pthread_mutex_lock(&click_mutex);
-						click = click_tmp;
-						pthread_mutex_unlock(&click_mutex);
-						connect_metronome();
+						printf("bpm: %g\n", tempo.bpm);
+						send_message(&engine.to_process, MSG_CLICK, 0, &tempo);
+						metronome_on = 1;
+						engine_click(&engine, metronome_on);
 					}
 				}
 			}
 		}
-		usleep(250000);
 	}
 
 	printf("\nExiting.\n");
 	// set the terminal back to normal
 	ttystate.c_lflag |= ICANON;
 	tcsetattr(STDIN, TCSANOW, &ttystate);
+}
 
-	pthread_mutex_destroy(&click_mutex);
+/*
+  Main:
+  - Parse command-line arguments
+  - Initialize the audio backend and the engine
+  - Run the interactive session, or the offline one
+*/
+int main(int argc, char **argv)
+{
+	int opt;
+	struct arena arena;
+	struct buffer *b;
+	unsigned long srate;
+	size_t arena_mb = DEFAULT_ARENA_MB;
+	unsigned int max_takes = DEFAULT_TAKES;
+	long takes_mb = -1;
+	struct stream stream_data;
+	struct stretch stretch_data;
+	const char *stream_tag = NULL;
+	int dither = 0;
+	const char *load = NULL;
+	const char *offline = NULL;
+	const char *output = NULL;
+	unsigned long offline_rate = DEFAULT_OFFLINE_RATE;
+	jack_nframes_t period = DEFAULT_PERIOD;
+	double seconds = DEFAULT_OFFLINE_SECONDS;
+	const char *stats_file = NULL;
+	const char *signature = NULL;
+	const char *ramp = NULL;
+	unsigned int subdivisions = 1;
+	int follow_transport = 0;
+	double punch_in = 0, punch_out = 0;
+	double preroll = 0;
+	int lock_memory = 0, huge_pages = 0;
+	int calibrate = 0;
+	long latency = -1;
+	static const struct option options[] = {
+		{"memory", required_argument, NULL, 'M'},
+		{"stream", optional_argument, NULL, 'S'},
+		{"dither", no_argument, NULL, 'D'},
+		{"load", required_argument, NULL, 'l'},
+		{"channels", required_argument, NULL, 'c'},
+		{"offline", required_argument, NULL, 'O'},
+		{"rate", required_argument, NULL, 'R'},
+		{"period", required_argument, NULL, 'P'},
+		{"seconds", required_argument, NULL, 'T'},
+		{"output", required_argument, NULL, 'o'},
+		{"stats", required_argument, NULL, 'I'},
+		{"signature", required_argument, NULL, 'G'},
+		{"subdivide", required_argument, NULL, 'B'},
+		{"ramp", required_argument, NULL, 'A'},
+		{"transport", no_argument, NULL, 'J'},
+		{"punch", required_argument, NULL, 'U'},
+		{"calibrate", no_argument, NULL, 'K'},
+		{"latency", required_argument, NULL, 'N'},
+		{"takes", required_argument, NULL, 'H'},
+		{"takes-mb", required_argument, NULL, 'E'},
+		{"format", required_argument, NULL, 'F'},
+		{"depth", required_argument, NULL, 'W'},
+		{"meter", no_argument, NULL, 'V'},
+		{"preroll", required_argument, NULL, 'Y'},
+		{"lock-memory", no_argument, NULL, 'L'},
+		{"huge-pages", no_argument, NULL, 'Q'},
+		{"seek", required_argument, NULL, 'X'},
+		{"speed", required_argument, NULL, 'Z'},
+		{NULL, 0, NULL, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "M:l:c:o:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'M':
+			arena_mb = (size_t) atol(optarg);
+			break;
+		case 'S':
+			stream_tag = optarg != NULL ? optarg : STREAM_TAG;
+			break;
+		case 'D':
+			dither = 1;
+			break;
+		case 'l':
+			load = optarg;
+			break;
+		case 'c':
+			nchannels = (unsigned int) atoi(optarg);
+			if (nchannels < 1 || nchannels > MAX_CHANNELS) {
+				fprintf(stderr, "the number of channels must be between 1 and %d\n", MAX_CHANNELS);
+				exit(1);
+			}
+			break;
+		case 'O':
+			offline = optarg;
+			break;
+		case 'R':
+			offline_rate = (unsigned long) atol(optarg);
+			break;
+		case 'P':
+			period = (jack_nframes_t) atoi(optarg);
+			break;
+		case 'T':
+			seconds = atof(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'I':
+			stats_file = optarg;
+			break;
+		case 'V':
+			show_meter = 1;
+			break;
+		case 'Y':
+			preroll = atof(optarg);
+			if (preroll < 0) {
+				fprintf(stderr, "the pre-roll can't be negative\n");
+				exit(1);
+			}
+			break;
+		case 'X':
+			seek_seconds = atof(optarg);
+			if (seek_seconds <= 0) {
+				fprintf(stderr, "the seek step must be positive\n");
+				exit(1);
+			}
+			break;
+		case 'Z':
+			speed = (unsigned int) lround(atof(optarg) * 100);
+			if (speed < SPEED_MIN || speed > SPEED_MAX) {
+				fprintf(stderr, "the speed must be between %g and %g\n", SPEED_MIN / 100.0, SPEED_MAX / 100.0);
+				exit(1);
+			}
+			break;
+		case 'L':
+			lock_memory = 1;
+			break;
+		case 'Q':
+			huge_pages = 1;
+			break;
+		case 'G':
+			signature = optarg;
+			break;
+		case 'B':
+			subdivisions = (unsigned int) atoi(optarg);
+			if (subdivisions < 1 || subdivisions > 16) {
+				fprintf(stderr, "the number of subdivisions must be between 1 and 16\n");
+				exit(1);
+			}
+			break;
+		case 'A':
+			ramp = optarg;
+			break;
+		case 'J':
+			follow_transport = 1;
+			break;
+		case 'K':
+			calibrate = 1;
+			break;
+		case 'N':
+			latency = atol(optarg);
+			break;
+		case 'H':
+			max_takes = (unsigned int) atoi(optarg);
+			if (max_takes < 1 || max_takes > MAX_TAKES - 1) {
+				fprintf(stderr, "the number of takes must be between 1 and %d\n", MAX_TAKES - 1);
+				exit(1);
+			}
+			break;
+		case 'E':
+			takes_mb = atol(optarg);
+			break;
+		case 'F':
+			if (parse_format(&save_format, optarg) != 0) {
+				fprintf(stderr, "%s: unknown format, expected wav or flac\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'W':
+			if (parse_depth(&save_sample, optarg) != 0) {
+				fprintf(stderr, "%s: unknown depth, expected 16, 24 or float\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'U':
+			if (sscanf(optarg, "%lf:%lf", &punch_in, &punch_out) != 2
+			    || punch_in < 0 || punch_out <= punch_in) {
+				fprintf(stderr, "%s: invalid punch, expected in:out in seconds\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, USAGE_MSG, argv[0]);
+			exit(1);
+		}
+	}
+	if (save_format == FORMAT_FLAC && nchannels > FLAC_MAX_CHANNELS) {
+		fprintf(stderr, "FLAC files have %d channels at most\n", FLAC_MAX_CHANNELS);
+		exit(1);
+	}
+	if (save_format == FORMAT_FLAC && save_sample != SAMPLE_S16) {
+		fprintf(stderr, "FLAC files are 16-bit only\n");
+		exit(1);
+	}
 
-	// shutdown JACK
-	jack_client_close(client);
+	if (offline == NULL)
+		printf("Type h for some help\nHit space to start or stop recording\n\n");
 
-	return 0;
-}
+	// read bpm on the command line
+	// no bpm, no metronome
+	// the tempo may be fractional
+	double bpm = 0;
+	if (optind >= argc) {
+		printf("metronome: no bpm provided, disabling the metronome for now\n");
+	} else {
+		bpm = atof(argv[optind]);
+		if (bpm < 0 || bpm > MAX_BPM) {
+			fprintf(stderr, "the tempo must be between 0 and %d bpm\n", MAX_BPM);
+			exit(1);
+		}
+		printf("metronome: %g bpm\n", bpm);
+	}
+	tempo_init(&tempo, bpm);
+	tempo.subdivisions = subdivisions;
+	if (signature != NULL && parse_signature(&tempo, signature) != 0) {
+		fprintf(stderr, "%s: invalid time signature\n", signature);
+		exit(1);
+	}
+	if (ramp != NULL && parse_ramp(&tempo, ramp) != 0) {
+		fprintf(stderr, "%s: invalid tempo ramp, expected bpm:beats\n", ramp);
+		exit(1);
+	}
 
+	// select the conversion kernel before any file is written
+	convert_init(dither);
 
-void display_help()
-{
-	printf("\n\nInterface help:\n");
-	printf("%s\n", HELP_MSG);
-}
+	// preallocate the record arena, the audio thread only takes chunks from it
+	if (arena_init(&arena, arena_mb << 20, huge_pages) != 0) {
+		fprintf(stderr, "cannot allocate %zu MB for the record buffer\n", arena_mb);
+		exit(1);
+	}
+	if (huge_pages)
+		printf("record buffer: %s\n", arena.huge == ARENA_HUGETLB ? "huge pages"
+		       : arena.huge == ARENA_THP ? "transparent huge pages" : "no huge pages available");
+	// all of it is going to be locked anyway, pay for the faults now
+	if (lock_memory)
+		prefault(arena.chunks, arena.bytes);
+
+	if (offline != NULL)
+		backend = backend_file_new(offline, offline_rate, period, seconds);
+	else
+		backend = backend_jack_new();
+	if (backend->open(backend, nchannels) != 0)
+		exit(1);
+	srate = backend->sample_rate(backend);
 
+	// by default, the old takes may use half of the arena, the rest goes to disk
+	if (takes_mb < 0)
+		takes_mb = (long) arena_mb / 2;
+	history_init(&history, &arena, nchannels, srate, max_takes, (size_t) takes_mb << 20);
+	b = &history.current->b;
 
-/*
-  Setup JACK
-*/
-void init_jack()
-{
-	const char *client_name = "recjack";
-	jack_status_t status;
-
-	client = jack_client_open(client_name, JackNullOption, &status);
-	if (client == NULL) {
-		fprintf(stderr, "jack_client_open failed, status = 0x%2.0x\n", status);
-		if (status & JackServerFailed)
-			fprintf(stderr, "Unable to connect to JACK server\n");
+	if (engine_init(&engine, b, nchannels) != 0) {
+		fprintf(stderr, "cannot allocate the message rings\n");
 		exit(1);
 	}
 
-	if (status & JackServerStarted)
-		fprintf(stderr, "JACK server started\n");
-	if (status & JackNameNotUnique) {
-		client_name = jack_get_client_name(client);
-		fprintf(stderr, "unique name '%s' assigned\n", client_name);
+	meter_init(&meter, nchannels);
+	engine.meter = &meter;
+	if (offline == NULL) {
+		if (pipe(wakeup) != 0) {
+			perror("pipe");
+			exit(1);
+		}
+		// neither the audio thread nor the main loop may block on it
+		fcntl(wakeup[0], F_SETFL, fcntl(wakeup[0], F_GETFL) | O_NONBLOCK);
+		fcntl(wakeup[1], F_SETFL, fcntl(wakeup[1], F_GETFL) | O_NONBLOCK);
+		engine.wakeup = wakeup[1];
+	}
+
+	// the spare take for the first recording is waiting in the ring
+	history_trim(&history, &engine.to_process);
+	beep = generate_beep(srate, 440, 0.5F, 10);
+	metronome_init(&engine.metronome, beep);
+	metronome_set(&engine.metronome, &tempo);
+	engine.follow_transport = (char) (follow_transport && offline == NULL);
+	if (latency >= 0) {
+		engine.latency = (jack_nframes_t) latency;
+		engine.latency_set = 1;
+	}
+	if (preroll > 0) {
+		engine.preroll_frames = (jack_nframes_t) (preroll * (double) srate);
+		printf("pre-roll: %gs\n", preroll);
+	}
+	if (punch_out > 0) {
+		engine_set_punch(&engine, (uint64_t) (punch_in * (double) srate),
+				 (uint64_t) (punch_out * (double) srate));
+		printf("punch-in at %gs, punch-out at %gs\n", punch_in, punch_out);
 	}
 
-	// create an input port (recording) and two output ports (playback, metronome)
-	input_port = jack_port_register(client, "input", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-	output_port = jack_port_register(client, "output", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
-	metronome_port = jack_port_register(client, "metronome", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+	// every take is also written to disk as it is recorded
+	if (stream_tag != NULL) {
+		if (stream_start(&stream_data, stream_tag, srate, nchannels, save_sample) != 0) {
+			fprintf(stderr, "cannot start the stream writer\n");
+			exit(1);
+		}
+		engine.stream = &stream_data;
+		printf("streaming takes to disk\n");
+	}
+
+	// takes are replayed at other speeds through a worker, interactively only
+	if (offline == NULL) {
+		if (stretch_start(&stretch_data, nchannels) != 0) {
+			fprintf(stderr, "cannot start the stretch worker, takes are played at 100%%\n");
+		} else {
+			engine.stretch = &stretch_data;
+			engine_speed(&engine, speed);
+			if (speed != SPEED_NORMAL)
+				printf("playback speed: %u%%\n", speed);
+		}
+	}
 
-	if ((input_port == NULL) || (output_port == NULL) || (metronome_port == NULL)) {
-		fprintf(stderr, "no more JACK ports available\n");
+	// time every period of the audio callback
+	if (stats_start(&stats, srate) != 0) {
+		fprintf(stderr, "cannot start the stats thread\n");
 		exit(1);
 	}
-}
+	engine.stats = &stats;
 
-void init_finish()
-{
-	if (jack_activate(client)) {
-		fprintf(stderr, "cannot activate client\n");
+	// everything the audio thread touches is allocated, keep it in RAM,
+	// what is allocated later for it (loops, calibration) is locked as
+	// it is prefaulted
+	if (lock_memory && memory_lock() == 0)
+		printf("memory locked\n");
+
+	// play an existing take, straight from the mapped file, mapped after
+	// the lock so that it isn't read in whole
+	if (load != NULL && offline == NULL && history_load(&history, load) != 0)
 		exit(1);
+	// the audio thread isn't running yet, the initial state can be set directly
+	if (b->map != NULL) {
+		engine.mode = MODE_LIWAIT;
+		if (b->map->srate != srate)
+			fprintf(stderr, "%s: sample rate is %lu, JACK runs at %lu\n", load, b->map->srate, srate);
+		if (b->map->nchannels != nchannels)
+			fprintf(stderr, "%s: %u channels, playing %u\n", load, b->map->nchannels, nchannels);
 	}
+	ui_mode = engine.mode;
+
+	if (backend->start(backend, &engine) != 0)
+		exit(1);
 
-	// connect the first physical input port to the input port
-	connect_physical(input_port, JackPortIsOutput, 1);
+	if (offline == NULL) {
+		interactive(calibrate);
+	} else {
+		process_messages();
+		printf("\n");
+		if (output != NULL) {
+			size_t bytes;
+			struct peaks *p;
+			int fd = open(output, O_CREAT|O_TRUNC|O_RDWR, FILEPERM);
+			if (fd < 0 || save_file(fd, &history.current->b, save_format, save_sample, &bytes) != 0) {
+				perror(output);
+			} else {
+				printf("take saved to %s: %.1f MB\n", output, (double) bytes / (1 << 20));
+				// with its index next to it, like the takes saved interactively
+				if ((p = history_peaks(&history)) != NULL)
+					peaks_save(p, output);
+			}
+			if (fd >= 0)
+				close(fd);
+		}
+	}
 
-	// connect the output port to all physical outputs
-	connect_physical(output_port, JackPortIsInput, 0);
+	// shutdown the backend
+	backend->close(backend);
+
+	// the audio thread is stopped, the writer can finish the current take
+	if (engine.stream != NULL)
+		stream_stop(engine.stream);
+	if (engine.stretch != NULL)
+		stretch_stop(engine.stretch);
+
+	process_messages();
+	// the audio thread is gone, a loop it still had is ours
+	if (looping != NULL)
+		loop_free(looping);
+	while (calibrating != NULL) {
+		usleep(10000);
+		check_calibration();
+	}
+	// the take being saved is still needed
+	if (atomic_load(&saver.running)) {
+		printf("waiting for %s to be written\n", saver.filename);
+		while (atomic_load(&saver.running)) {
+			usleep(10000);
+			check_save();
+		}
+		printf("\n");
+	}
+	engine_destroy(&engine);
+	free_beep(beep);
+	if (wakeup[0] >= 0) {
+		close(wakeup[0]);
+		close(wakeup[1]);
+	}
 
-	jack_port_get_latency_range(input_port, JackCaptureLatency, &input_latency_range);
-	//printf("Input latency range: %d-%d\n", input_latency_range.min, input_latency_range.max);
-	jack_latency_range_t range;
-	jack_port_get_latency_range(output_port, JackPlaybackLatency, &range);
-	//printf("Output latency: %d-%d\n", range.min, range.max);
-	jack_port_get_latency_range(metronome_port, JackPlaybackLatency, &range);
-	//printf("Metronome latency: %d-%d\n", range.min, range.max);
+	// last summary, with every period timed
+	stats_stop(&stats);
+	if (offline != NULL) {
+		struct stats_summary sum;
+		stats_get(&stats, &sum);
+		printf("page faults in the callback: %lu minor, %lu major\n", sum.minor_faults, sum.major_faults);
+	}
+	if (stats_file != NULL) {
+		struct stats_summary sum;
+		FILE *f = fopen(stats_file, "w");
+		if (f == NULL) {
+			perror(stats_file);
+		} else {
+			stats_get(&stats, &sum);
+			stats_print(f, &sum);
+			fclose(f);
+		}
+	}
+
+	history_destroy(&history);
+	arena_destroy(&arena);
+
+	return 0;
+}
+
+
+/*
+  Name of a mode, as shown in front of the meter
+*/
+const char *mode_name(char m)
+{
+	switch (m) {
+	case MODE_REWAIT:
+	case MODE_RECORD:
+		return "Recording";
+	case MODE_LIWAIT:
+	case MODE_LISTEN:
+		return "Playing";
+	case MODE_LOWAIT:
+	case MODE_LOOP:
+		return "Looping";
+	case MODE_CALIBRATE:
+		return "Measuring";
+	case MODE_PAUSED:
+		return "Waiting";
+	}
+	return "";
+}
+
+void display_help()
+{
+	printf("\n\nInterface help:\n");
+	printf("%s\n", HELP_MSG);
 }
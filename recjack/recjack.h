@@ -6,6 +6,15 @@
 
 #include <jack/jack.h>
 
+#include "buffer.h"
+#include "ringbuffer.h"
+#include "metronome.h"
+#include "convert.h"
+
+struct calibration;
+struct loop;
+struct layer;
+
 #define DIR_OUT 1
 #define DIR_IN 2
 
@@ -15,6 +24,9 @@
 #define MODE_PAUSED 3
 #define MODE_REWAIT 4
 #define MODE_LIWAIT 5
+#define MODE_CALIBRATE 6
+#define MODE_LOWAIT 7
+#define MODE_LOOP 8
 
 #define FILEEXT "wav"
 #define DATEFMT "%Y-%m-%d_%H-%M"
@@ -23,21 +35,73 @@
 #define FILEPERM S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH
 
 #define KEY_ESCAPE 27
+// the main loop checks the work done in the background at this interval
+#define CHECK_INTERVAL_MS 50
+
+#define MSG_MODE 1
+#define MSG_CLICK 2
+#define MSG_STREAM_START 3
+#define MSG_STREAM_STOP 4
+#define MSG_CALIBRATE 5
+#define MSG_LATENCY 6
+#define MSG_TAKE 7
+#define MSG_SPARE 8
+#define MSG_RELEASE 9
+#define MSG_LOOP 10
+#define MSG_OVERDUB 11
+#define MSG_LAYER 12
+#define MSG_GAIN 13
+#define MSG_SEEK 14
+#define MSG_REGION 15
+#define MESSAGE_RING_SIZE 64
 
-struct buffer
+/*
+  Messages exchanged with the JACK thread
+  MSG_MODE:  main loop -> JACK: switch mode (0 for the next mode in the sequence)
+             JACK -> main loop: the mode has changed
+  MSG_CLICK: main loop -> JACK: use this tempo from the next beat on
+  MSG_STREAM_START/MSG_STREAM_STOP: JACK -> stream writer: a take starts
+             or ends, frames is the number of frames pushed for the take
+  MSG_CALIBRATE: main loop -> JACK: measure the latency with this calibration
+             JACK -> main loop: the capture is complete (or was refused)
+  MSG_LATENCY: main loop -> JACK: the round trip latency is frames
+  MSG_TAKE:  main loop -> JACK: play take from now on
+             JACK -> main loop: take is the current take (unchanged if refused)
+  MSG_SPARE: main loop -> JACK: record the next take in take
+             JACK -> main loop: a new take is recorded in take
+  MSG_RELEASE: main loop -> JACK: give the chunks head..tail back to the arena
+  MSG_LOOP:  main loop -> JACK: loop with loop
+             JACK -> main loop: the loop is over (or was refused)
+  MSG_OVERDUB: main loop -> JACK: record layers over the loop if mode is 1
+             JACK -> main loop: layer starts recording, a new spare is needed
+  MSG_LAYER: main loop -> JACK: record the next layer of loop in layer
+             JACK -> main loop: layer has been recorded
+  MSG_GAIN:  main loop -> JACK: add gain to the gain of layer
+             JACK -> main loop: the change was refused
+  MSG_SEEK:  main loop -> JACK: play take from cursor
+  MSG_REGION: main loop -> JACK: repeat take from cursor to frame frames,
+             or play it through if frames is 0
+*/
+struct message
 {
-	char *buf;
-	size_t size;
-	size_t offset;
-	jack_nframes_t frames_off;
-	unsigned long srate;
+	char type;
+	char mode;
+	struct tempo tempo;
+	struct calibration *calibration;
+	size_t frames;
+	struct buffer *take;
+	struct chunk *head;
+	struct chunk *tail;
+	struct loop *loop;
+	struct layer *layer;
+	float gain;
+	struct cursor cursor;
 };
 
-void jack_shutdown(void *arg) __attribute__((noreturn));
-int process(jack_nframes_t nframes, void *arg);
-void change_mode(struct buffer *b, char m);
 int save_buffer(struct buffer *b);
-ssize_t write_wave_header(int fd, unsigned long srate, size_t wave_size);
+char *make_filename(const char *tag, const char *ext);
+ssize_t write_wave_header(int fd, unsigned long srate, unsigned int nchannels, size_t wave_size);
 int write_wave_samples(int fd, size_t size, char *buf);
+int save_wave(int fd, struct buffer *b, enum sample_format format);
 
 #endif // RECJACK_H
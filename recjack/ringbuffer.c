@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "ringbuffer.h"
+
+/*
+  Allocate a ring buffer of at least size bytes
+  The size is rounded up to a power of two, so that indexes can be masked
+*/
+int ringbuffer_init(struct ringbuffer *r, size_t size)
+{
+	size_t s = 1;
+
+	while (s < size)
+		s <<= 1;
+	r->buf = aligned_alloc(CACHE_LINE, s < CACHE_LINE ? CACHE_LINE : s);
+	if (r->buf == NULL)
+		return -1;
+	// the audio thread writes to it, fault it in now
+	memset(r->buf, 0, s < CACHE_LINE ? CACHE_LINE : s);
+	r->size = s;
+	r->mask = s - 1;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+
+	return 0;
+}
+
+void ringbuffer_free(struct ringbuffer *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+// bytes available to the consumer
+size_t ringbuffer_read_space(struct ringbuffer *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire)
+		- atomic_load_explicit(&r->tail, memory_order_relaxed);
+}
+
+// bytes available to the producer
+size_t ringbuffer_write_space(struct ringbuffer *r)
+{
+	return r->size - (atomic_load_explicit(&r->head, memory_order_relaxed)
+			  - atomic_load_explicit(&r->tail, memory_order_acquire));
+}
+
+// bytes written since the ring was created, for the producer
+size_t ringbuffer_written(struct ringbuffer *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_relaxed);
+}
+
+/*
+  Producer side: copy up to len bytes into the ring
+  Returns the number of bytes written, never blocks
+*/
+size_t ringbuffer_write(struct ringbuffer *r, const void *src, size_t len)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t space = r->size - (head - atomic_load_explicit(&r->tail, memory_order_acquire));
+	size_t off = head & r->mask;
+	size_t first;
+
+	if (len > space)
+		len = space;
+	first = r->size - off;
+	if (first > len)
+		first = len;
+	memcpy(r->buf + off, src, first);
+	memcpy(r->buf, (const char *) src + first, len - first);
+	atomic_store_explicit(&r->head, head + len, memory_order_release);
+
+	return len;
+}
+
+/*
+  Consumer side: copy up to len bytes out of the ring
+  Returns the number of bytes read, never blocks
+*/
+size_t ringbuffer_read(struct ringbuffer *r, void *dst, size_t len)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t avail = atomic_load_explicit(&r->head, memory_order_acquire) - tail;
+	size_t off = tail & r->mask;
+	size_t first;
+
+	if (len > avail)
+		len = avail;
+	first = r->size - off;
+	if (first > len)
+		first = len;
+	memcpy(dst, r->buf + off, first);
+	memcpy((char *) dst + first, r->buf, len - first);
+	atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+
+	return len;
+}
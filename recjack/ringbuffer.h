@@ -0,0 +1,31 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+
+/*
+  Wait-free single-producer/single-consumer ring buffer
+  head is only written by the producer, tail only by the consumer,
+  each on its own cache line so that the two threads don't share one
+*/
+struct ringbuffer
+{
+	_Alignas(CACHE_LINE) atomic_size_t head;
+	_Alignas(CACHE_LINE) atomic_size_t tail;
+	_Alignas(CACHE_LINE) char *buf;
+	size_t size;
+	size_t mask;
+};
+
+int ringbuffer_init(struct ringbuffer *r, size_t size);
+void ringbuffer_free(struct ringbuffer *r);
+size_t ringbuffer_read_space(struct ringbuffer *r);
+size_t ringbuffer_write_space(struct ringbuffer *r);
+size_t ringbuffer_written(struct ringbuffer *r);
+size_t ringbuffer_write(struct ringbuffer *r, const void *src, size_t len);
+size_t ringbuffer_read(struct ringbuffer *r, void *dst, size_t len);
+
+#endif // RINGBUFFER_H
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <jack/jack.h>
+
+#include "recjack.h"
+#include "wave.h"
+#include "flac.h"
+#include "save.h"
+#include "peaks.h"
+
+static const char *const extensions[] = {
+	[FORMAT_WAV] = "wav",
+	[FORMAT_FLAC] = "flac",
+};
+
+const char *format_extension(enum save_format format)
+{
+	return extensions[format];
+}
+
+int parse_format(enum save_format *format, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+		if (strcmp(name, extensions[i]) == 0) {
+			*format = (enum save_format) i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static const char *const depths[] = {
+	[SAMPLE_S16] = "16",
+	[SAMPLE_S24] = "24",
+	[SAMPLE_F32] = "float",
+};
+
+int parse_depth(enum sample_format *sample, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		if (strcmp(name, depths[i]) == 0) {
+			*sample = (enum sample_format) i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+  Write a take in the given format, bytes is set to the size of the file
+  WAV files have the given samples, FLAC files are 16-bit and encoded
+  on every core
+  fd must be open for reading and writing
+*/
+int save_file(int fd, struct buffer *b, enum save_format format, enum sample_format sample, size_t *bytes)
+{
+	unsigned int nchannels = b->map != NULL ? b->map->nchannels : b->nchannels;
+	long ncpus;
+
+	if (format == FORMAT_WAV) {
+		*bytes = wave_file_size(b->frames, nchannels, sample);
+		return save_wave(fd, b, sample);
+	}
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return save_flac(fd, b, ncpus > 0 ? (unsigned int) ncpus : 1, bytes);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static void *save_thread(void *arg)
+{
+	struct saver *s = arg;
+	double t = now();
+
+	s->ret = save_file(s->fd, &s->b, s->format, s->sample, &s->bytes);
+	if (close(s->fd) != 0) {
+		perror("close failed");
+		s->ret = -1;
+	}
+	// the index goes next to the file, so that it isn't scanned when loaded
+	if (s->ret == 0 && s->b.peaks != NULL && s->b.peaks->frames == s->b.frames)
+		peaks_save(s->b.peaks, s->filename);
+	s->seconds = now() - t;
+	atomic_store(&s->done, 1);
+	return NULL;
+}
+
+/*
+  Start saving b to the open file fd, named filename
+  The saver takes fd and filename over, filename is freed by save_finish
+  Returns -1 if a save is already running or the thread can't be started
+*/
+int save_start(struct saver *s, int fd, char *filename, struct buffer *b, enum save_format format,
+	       enum sample_format sample)
+{
+	if (atomic_load(&s->running))
+		return -1;
+	s->b = *b;
+	buffer_rewind(&s->b, 0);
+	s->fd = fd;
+	s->filename = filename;
+	s->format = format;
+	s->sample = sample;
+	s->ret = 0;
+	s->bytes = 0;
+	atomic_store(&s->done, 0);
+	if (pthread_create(&s->thread, NULL, save_thread, s) != 0)
+		return -1;
+	atomic_store(&s->running, 1);
+	return 0;
+}
+
+/*
+  Collect a save that is over, the results are left in s until the
+  next save
+  Returns 1 if a save just ended, 0 otherwise
+*/
+int save_finish(struct saver *s)
+{
+	if (!atomic_load(&s->running) || !atomic_load(&s->done))
+		return 0;
+	pthread_join(s->thread, NULL);
+	atomic_store(&s->running, 0);
+	return 1;
+}
@@ -0,0 +1,46 @@
+#ifndef SAVE_H
+#define SAVE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "convert.h"
+
+enum save_format
+{
+	FORMAT_WAV,
+	FORMAT_FLAC,
+};
+
+/*
+  Save of a take in a worker thread, so that the main loop goes on
+  b is a copy of the take: its chunks must stay in the arena until the
+  save is over
+*/
+struct saver
+{
+	pthread_t thread;
+	atomic_int running;
+	atomic_int done;
+	struct buffer b;
+	int fd;
+	char *filename;
+	enum save_format format;
+	enum sample_format sample;
+	// results
+	int ret;
+	size_t bytes;
+	double seconds;
+};
+
+const char *format_extension(enum save_format format);
+int parse_format(enum save_format *format, const char *name);
+int parse_depth(enum sample_format *sample, const char *name);
+int save_file(int fd, struct buffer *b, enum save_format format, enum sample_format sample, size_t *bytes);
+int save_start(struct saver *s, int fd, char *filename, struct buffer *b, enum save_format format,
+	       enum sample_format sample);
+int save_finish(struct saver *s);
+
+#endif // SAVE_H
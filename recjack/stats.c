@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jack/jack.h>
+
+#include "stats.h"
+
+/*
+  Audio thread: store the duration of one callback
+  If the stats thread lags behind, the timing is only counted as lost
+*/
+void stats_record(struct stats *s, const struct timespec *t0, const struct timespec *t1, jack_nframes_t nframes)
+{
+	struct timing t;
+	long ns = (t1->tv_sec - t0->tv_sec) * 1000000000L + (t1->tv_nsec - t0->tv_nsec);
+
+	t.ns = ns > (long) UINT32_MAX ? UINT32_MAX : (uint32_t) ns;
+	t.nframes = nframes;
+	if (ringbuffer_write_space(&s->timings) < sizeof(struct timing))
+		stats_count(&s->lost_timings);
+	else
+		ringbuffer_write(&s->timings, &t, sizeof(struct timing));
+}
+
+/*
+  Bump a counter, only ever written by one thread
+*/
+void stats_count(atomic_ulong *counter)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+}
+
+/*
+  Audio thread: add the page faults taken during one callback
+*/
+void stats_faults(struct stats *s, long minor, long major)
+{
+	if (minor <= 0 && major <= 0)
+		return;
+	if (minor > 0)
+		atomic_store_explicit(&s->minor_faults, atomic_load_explicit(&s->minor_faults, memory_order_relaxed)
+				      + (unsigned long) minor, memory_order_relaxed);
+	if (major > 0)
+		atomic_store_explicit(&s->major_faults, atomic_load_explicit(&s->major_faults, memory_order_relaxed)
+				      + (unsigned long) major, memory_order_relaxed);
+	stats_count(&s->fault_periods);
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+  Drain the timings and update the summary
+*/
+static void stats_update(struct stats *s)
+{
+	struct timing t;
+	uint32_t sorted[STATS_WINDOW];
+	size_t n, i;
+
+	pthread_mutex_lock(&s->lock);
+	while (ringbuffer_read(&s->timings, &t, sizeof(struct timing)) == sizeof(struct timing)) {
+		struct stats_summary *sum = &s->summary;
+		uint32_t us = t.ns / 1000;
+		double load = (double) t.ns * 1e-9 * (double) s->srate / (double) t.nframes;
+
+		if (sum->periods == 0 || t.ns < sum->min_ns)
+			sum->min_ns = t.ns;
+		if (t.ns > sum->max_ns)
+			sum->max_ns = t.ns;
+		if (load > sum->max_load)
+			sum->max_load = load;
+		for (i = 0; i < STATS_BUCKETS - 1 && us >= (1U << i); i++)
+			;
+		sum->hist[i]++;
+		sum->periods++;
+		s->total_ns += t.ns;
+		s->window[s->window_pos % STATS_WINDOW] = t.ns;
+		s->window_pos++;
+	}
+
+	if (s->summary.periods > 0) {
+		s->summary.mean_ns = s->total_ns / (double) s->summary.periods;
+		n = s->window_pos < STATS_WINDOW ? s->window_pos : STATS_WINDOW;
+		memcpy(sorted, s->window, n * sizeof(uint32_t));
+		qsort(sorted, n, sizeof(uint32_t), compare_ns);
+		s->summary.p99_ns = sorted[n * 99 / 100];
+	}
+	s->summary.xruns = atomic_load(&s->xruns);
+	s->summary.dropped_periods = atomic_load(&s->dropped_periods);
+	s->summary.lost_messages = atomic_load(&s->lost_messages);
+	s->summary.lost_timings = atomic_load(&s->lost_timings);
+	s->summary.minor_faults = atomic_load(&s->minor_faults);
+	s->summary.major_faults = atomic_load(&s->major_faults);
+	s->summary.fault_periods = atomic_load(&s->fault_periods);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void *stats_thread(void *arg)
+{
+	struct stats *s = (struct stats *) arg;
+
+	while (atomic_load(&s->running)) {
+		stats_update(s);
+		usleep(STATS_INTERVAL_MS * 1000);
+	}
+	stats_update(s);
+	return NULL;
+}
+
+int stats_start(struct stats *s, unsigned long srate)
+{
+	memset(s, 0, sizeof(struct stats));
+	s->srate = srate;
+	if (ringbuffer_init(&s->timings, STATS_RING * sizeof(struct timing)) != 0)
+		return -1;
+	pthread_mutex_init(&s->lock, NULL);
+	atomic_store(&s->running, 1);
+	if (pthread_create(&s->thread, NULL, stats_thread, s) != 0)
+		return -1;
+	return 0;
+}
+
+void stats_stop(struct stats *s)
+{
+	atomic_store(&s->running, 0);
+	pthread_join(s->thread, NULL);
+	ringbuffer_free(&s->timings);
+}
+
+// copy of the last published summary
+void stats_get(struct stats *s, struct stats_summary *sum)
+{
+	pthread_mutex_lock(&s->lock);
+	*sum = s->summary;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void stats_print(FILE *f, const struct stats_summary *sum)
+{
+	uint64_t top = 0;
+	int i, last = 0;
+
+	fprintf(f, "periods: %llu, xruns: %lu, periods with dropped frames: %lu\n",
+		(unsigned long long) sum->periods, sum->xruns, sum->dropped_periods);
+	fprintf(f, "lost messages: %lu, lost timings: %lu\n", sum->lost_messages, sum->lost_timings);
+	fprintf(f, "page faults in the callback: %lu minor, %lu major, in %lu periods\n",
+		sum->minor_faults, sum->major_faults, sum->fault_periods);
+	if (sum->periods == 0)
+		return;
+	fprintf(f, "callback: min %.1f us, mean %.1f us, p99 %.1f us, max %.1f us (max load %.1f%%)\n",
+		sum->min_ns * 1e-3, sum->mean_ns * 1e-3, sum->p99_ns * 1e-3, sum->max_ns * 1e-3,
+		sum->max_load * 100);
+
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		if (sum->hist[i] > top)
+			top = sum->hist[i];
+		if (sum->hist[i] > 0)
+			last = i;
+	}
+	for (i = 0; i <= last; i++) {
+		int bar = (int) (sum->hist[i] * 50 / top);
+		fprintf(f, "%9s%7u us %10llu %.*s\n", i == STATS_BUCKETS - 1 ? ">=" : "<",
+			i == STATS_BUCKETS - 1 ? 1U << (i - 1) : 1U << i,
+			(unsigned long long) sum->hist[i], bar,
+			"##################################################");
+	}
+}
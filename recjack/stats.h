@@ -0,0 +1,87 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <jack/jack.h>
+
+#include "ringbuffer.h"
+
+#define STATS_RING 4096
+#define STATS_WINDOW 4096
+#define STATS_BUCKETS 24
+#define STATS_INTERVAL_MS 500
+
+/*
+  Time spent in one call of the audio callback
+*/
+struct timing
+{
+	uint32_t ns;
+	jack_nframes_t nframes;
+};
+
+/*
+  Summary published by the stats thread
+  min/mean/max are over the whole session, p99 over the last
+  STATS_WINDOW periods
+  Bucket i of the histogram counts the periods that took less than
+  2^i us (and more than 2^(i-1) us)
+*/
+struct stats_summary
+{
+	uint64_t periods;
+	uint32_t min_ns;
+	uint32_t max_ns;
+	double mean_ns;
+	uint32_t p99_ns;
+	double max_load;
+	uint64_t hist[STATS_BUCKETS];
+	unsigned long xruns;
+	unsigned long dropped_periods;
+	unsigned long lost_messages;
+	unsigned long lost_timings;
+	unsigned long minor_faults;
+	unsigned long major_faults;
+	unsigned long fault_periods;
+};
+
+/*
+  Instrumentation of the audio callback
+  The audio thread only writes timings to the ring and bumps counters,
+  the stats thread turns them into a summary
+*/
+struct stats
+{
+	struct ringbuffer timings;
+	atomic_ulong xruns;
+	atomic_ulong dropped_periods;
+	atomic_ulong lost_messages;
+	atomic_ulong lost_timings;
+	// page faults taken by the audio thread, and the periods that had some
+	atomic_ulong minor_faults;
+	atomic_ulong major_faults;
+	atomic_ulong fault_periods;
+
+	unsigned long srate;
+	pthread_t thread;
+	atomic_int running;
+	pthread_mutex_t lock;
+	struct stats_summary summary;
+	uint32_t window[STATS_WINDOW];
+	size_t window_pos;
+	double total_ns;
+};
+
+int stats_start(struct stats *s, unsigned long srate);
+void stats_stop(struct stats *s);
+void stats_record(struct stats *s, const struct timespec *t0, const struct timespec *t1, jack_nframes_t nframes);
+void stats_count(atomic_ulong *counter);
+void stats_faults(struct stats *s, long minor, long major);
+void stats_get(struct stats *s, struct stats_summary *sum);
+void stats_print(FILE *f, const struct stats_summary *sum);
+
+#endif // STATS_H
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <jack/jack.h>
+
+#include "recjack.h"
+#include "wave.h"
+#include "convert.h"
+#include "stream.h"
+
+#define DRAIN_SAMPLES 4096
+
+/*
+  State of the file being written, only used by the writer thread
+*/
+struct stream_file
+{
+	char active;
+	int fd;
+	char *filename;
+	char *block;
+	size_t fill;
+	// frames taken from the ring, and the ones in the file so far
+	size_t written;
+	size_t header;
+	size_t bytes;
+	size_t flushed;
+	// a write failed, the rest of the take is dropped
+	char failed;
+};
+
+/*
+  Create a new file for a take
+  If a take has already been saved with the same name during this
+  minute, add a number to the tag
+*/
+static int stream_open(struct stream *s, struct stream_file *f)
+{
+	char tag[64];
+	unsigned int i;
+
+	for (i = 1; ; i++) {
+		if (i == 1)
+			snprintf(tag, sizeof(tag), "%s", s->tag);
+		else
+			snprintf(tag, sizeof(tag), "%s-%u", s->tag, i);
+		f->filename = make_filename(tag, FILEEXT);
+		f->fd = open(f->filename, O_CREAT|O_EXCL|O_WRONLY, FILEPERM);
+		if (f->fd >= 0 || errno != EEXIST)
+			break;
+		free(f->filename);
+	}
+	f->fill = 0;
+	f->written = 0;
+	f->bytes = 0;
+	f->flushed = 0;
+	f->failed = 0;
+	f->active = 1;
+	if (f->fd < 0) {
+		// the frames of this take will be dropped
+		perror("stream: couldn't create the file");
+		return -1;
+	}
+
+	// the header goes at the start of the first block, its sizes are patched later
+	f->fill = fill_wave_header(f->block, s->srate, s->nchannels, s->format, 0, 1);
+	f->header = f->fill;
+
+	return 0;
+}
+
+/*
+  Give up on the file after an error: it is closed, valid up to the last
+  header update, and the frames that follow are only counted
+*/
+static void stream_fail(struct stream_file *f, const char *what)
+{
+	if (what != NULL)
+		perror(what);
+	close(f->fd);
+	f->fd = -1;
+	f->fill = 0;
+	f->failed = 1;
+}
+
+/*
+  Write the block to the file, then update the header so that the file
+  is valid up to this point even if recjack crashes
+  The header only counts the frames that are in the file: the last one
+  may be cut across two blocks, and more may be waiting in the block
+*/
+static int stream_flush(struct stream *s, struct stream_file *f)
+{
+	uint8_t h[HEADER_LENGTH_DS64];
+	size_t len, done;
+	ssize_t w;
+
+	if (f->fill == 0 || f->fd < 0)
+		return 0;
+	for (done = 0; done < f->fill; done += (size_t) w) {
+		w = write(f->fd, f->block + done, f->fill - done);
+		if (w < 0 && errno == EINTR)
+			w = 0;
+		else if (w <= 0)
+			break;
+	}
+	if (done < f->fill)
+		perror("stream: write failed");
+	// whatever was written is counted, even before a failure
+	f->bytes += done;
+	f->flushed = f->bytes > f->header ? (f->bytes - f->header) / (s->nchannels * sample_bytes(s->format)) : 0;
+
+	len = fill_wave_header(h, s->srate, s->nchannels, s->format, f->flushed, 1);
+	if (pwrite(f->fd, h, len, 0) != (ssize_t) len) {
+		stream_fail(f, "stream: header update failed");
+		return -1;
+	}
+	if (done < f->fill) {
+		stream_fail(f, NULL);
+		return -1;
+	}
+	f->fill = 0;
+	return 0;
+}
+
+// append bytes to the block, writing it out each time it is full
+static void stream_copy(struct stream *s, struct stream_file *f, const char *src, size_t len)
+{
+	while (len > 0 && f->fd >= 0) {
+		size_t l = STREAM_BLOCK - f->fill;
+		if (l > len)
+			l = len;
+		memcpy(f->block + f->fill, src, l);
+		f->fill += l;
+		src += l;
+		len -= l;
+		if (f->fill == STREAM_BLOCK)
+			stream_flush(s, f);
+	}
+}
+
+/*
+  Move at most max frames from the ring to the file
+  The blocks are only written when they are full, so that all the
+  writes but the last one are STREAM_BLOCK large and aligned
+*/
+static size_t stream_drain(struct stream *s, struct stream_file *f, size_t max)
+{
+	jack_default_audio_sample_t tmp[DRAIN_SAMPLES];
+	char pcm[DRAIN_SAMPLES * sizeof(float)];
+	size_t frame = s->nchannels * sizeof(jack_default_audio_sample_t);
+	size_t done = 0;
+	char *end;
+
+	while (done < max) {
+		size_t n = DRAIN_SAMPLES / s->nchannels;
+		if (n > max - done)
+			n = max - done;
+		n = ringbuffer_read(&s->samples, tmp, n * frame) / frame;
+		if (n == 0)
+			break;
+
+		f->written += n;
+		done += n;
+		if (f->fd < 0)
+			continue;
+		end = convert_format(pcm, tmp, n * s->nchannels, s->format);
+		stream_copy(s, f, pcm, (size_t) (end - pcm));
+	}
+
+	return done;
+}
+
+// write what's left, set the final sizes in the header and report
+static void stream_close(struct stream *s, struct stream_file *f)
+{
+	size_t high = atomic_load(&s->high_water);
+
+	f->active = 0;
+	if (f->fd < 0 && !f->failed) {
+		printf("\nstream: %zu frames lost, %s couldn't be created", f->written, f->filename);
+		fflush(stdout);
+		free(f->filename);
+		return;
+	}
+	stream_flush(s, f);
+	if (f->fd >= 0 && close(f->fd) != 0) {
+		perror("stream: close failed");
+		f->failed = 1;
+	}
+	f->fd = -1;
+	if (f->failed)
+		printf("\nstream: %s is incomplete, %zu frames saved, %zu frames lost",
+		       f->filename, f->flushed, f->written - f->flushed);
+	else
+		printf("\nstream: %zu frames saved to %s (ring peak %zu%%, %zu frames lost)",
+		       f->flushed, f->filename, high * 100 / s->samples.size,
+		       atomic_load(&s->overruns));
+	fflush(stdout);
+	free(f->filename);
+}
+
+/*
+  Writer thread
+  Woken up by the JACK thread each time frames or events are pushed
+*/
+static void *stream_writer(void *arg)
+{
+	struct stream *s = (struct stream *) arg;
+	struct stream_file f;
+	struct message ev;
+	char have_ev = 0;
+
+	f.active = 0;
+	f.fd = -1;
+	f.block = aligned_alloc(4096, STREAM_BLOCK);
+	if (f.block == NULL) {
+		fprintf(stderr, "stream: cannot allocate the write block\n");
+		return NULL;
+	}
+
+	while (1) {
+		sem_wait(&s->sem);
+		while (1) {
+			if (!have_ev && ringbuffer_read_space(&s->events) >= sizeof(struct message)) {
+				ringbuffer_read(&s->events, &ev, sizeof(struct message));
+				have_ev = 1;
+			}
+
+			if (!f.active) {
+				// between takes, wait for the next one
+				if (!have_ev)
+					break;
+				if (ev.type == MSG_STREAM_START)
+					stream_open(s, &f);
+				have_ev = 0;
+				continue;
+			}
+
+			// a take is stopped once all its frames have been written
+			if (have_ev && ev.type == MSG_STREAM_STOP) {
+				stream_drain(s, &f, ev.frames - f.written);
+				if (f.written == ev.frames) {
+					stream_close(s, &f);
+					have_ev = 0;
+					continue;
+				}
+			} else {
+				stream_drain(s, &f, SIZE_MAX);
+			}
+			break;
+		}
+
+		if (!atomic_load(&s->running)) {
+			// the JACK thread is gone, save what has been recorded so far
+			if (f.active) {
+				stream_drain(s, &f, SIZE_MAX);
+				stream_close(s, &f);
+			}
+			break;
+		}
+	}
+
+	free(f.block);
+	return NULL;
+}
+
+/*
+  Allocate the rings and start the writer thread
+  The ring holds STREAM_RING_SECONDS of audio
+*/
+int stream_start(struct stream *s, const char *tag, unsigned long srate, unsigned int nchannels,
+		 enum sample_format format)
+{
+	memset(s, 0, sizeof(struct stream));
+	s->tag = tag;
+	s->srate = srate;
+	s->nchannels = nchannels;
+	s->format = format;
+	s->scratch = malloc(STREAM_SCRATCH_FRAMES * nchannels * sizeof(jack_default_audio_sample_t));
+	if (s->scratch == NULL)
+		return -1;
+	if (ringbuffer_init(&s->samples, STREAM_RING_SECONDS * srate * nchannels
+			    * sizeof(jack_default_audio_sample_t)) != 0)
+		return -1;
+	if (ringbuffer_init(&s->events, MESSAGE_RING_SIZE * sizeof(struct message)) != 0)
+		return -1;
+	sem_init(&s->sem, 0, 0);
+	atomic_store(&s->running, 1);
+	if (pthread_create(&s->thread, NULL, stream_writer, s) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+  Stop the writer thread
+  Must be called once the JACK thread doesn't push anything anymore
+*/
+void stream_stop(struct stream *s)
+{
+	atomic_store(&s->running, 0);
+	sem_post(&s->sem);
+	pthread_join(s->thread, NULL);
+	sem_destroy(&s->sem);
+	ringbuffer_free(&s->samples);
+	ringbuffer_free(&s->events);
+	free(s->scratch);
+}
+
+static void stream_event(struct stream *s, char type)
+{
+	struct message ev;
+
+	if (ringbuffer_write_space(&s->events) < sizeof(struct message))
+		return;
+	memset(&ev, 0, sizeof(struct message));
+	ev.type = type;
+	ev.frames = s->take_frames;
+	ringbuffer_write(&s->events, &ev, sizeof(struct message));
+	sem_post(&s->sem);
+}
+
+// JACK thread: a new take starts
+void stream_begin(struct stream *s)
+{
+	s->take_frames = 0;
+	atomic_store_explicit(&s->high_water, 0, memory_order_relaxed);
+	atomic_store_explicit(&s->overruns, 0, memory_order_relaxed);
+	stream_event(s, MSG_STREAM_START);
+}
+
+/*
+  JACK thread: queue recorded frames for the writer
+  The channels are interleaved on the way, so that the writer only has
+  to convert them
+  If the writer lags behind and the ring is full, the frames are lost
+  and counted as overruns
+*/
+void stream_push(struct stream *s, jack_default_audio_sample_t **bufs, jack_nframes_t offset, jack_nframes_t n)
+{
+	size_t frame = s->nchannels * sizeof(jack_default_audio_sample_t);
+	jack_nframes_t done, len, w, i, lost = 0;
+	unsigned int k;
+
+	for (done = 0; done < n; done += len) {
+		len = n - done;
+		if (len > STREAM_SCRATCH_FRAMES)
+			len = STREAM_SCRATCH_FRAMES;
+
+		// only whole frames go in the ring
+		size_t fit = ringbuffer_write_space(&s->samples) / frame;
+		w = fit < len ? (jack_nframes_t) fit : len;
+		lost += len - w;
+
+		for (k = 0; k < s->nchannels; k++)
+			for (i = 0; i < w; i++)
+				s->scratch[i * s->nchannels + k] = bufs[k][offset + done + i];
+		ringbuffer_write(&s->samples, s->scratch, w * frame);
+		s->take_frames += w;
+	}
+
+	size_t used = ringbuffer_read_space(&s->samples);
+	if (used > atomic_load_explicit(&s->high_water, memory_order_relaxed))
+		atomic_store_explicit(&s->high_water, used, memory_order_relaxed);
+	if (lost > 0)
+		atomic_store_explicit(&s->overruns,
+				      atomic_load_explicit(&s->overruns, memory_order_relaxed) + lost,
+				      memory_order_relaxed);
+	sem_post(&s->sem);
+}
+
+// JACK thread: the take is over
+void stream_end(struct stream *s)
+{
+	stream_event(s, MSG_STREAM_STOP);
+}
@@ -0,0 +1,54 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <jack/jack.h>
+
+#include "ringbuffer.h"
+#include "convert.h"
+
+#define STREAM_RING_SECONDS 4
+#define STREAM_BLOCK (256 * 1024)
+#define STREAM_TAG "take"
+#define STREAM_SCRATCH_FRAMES 1024
+
+/*
+  Record-to-disk: the JACK thread pushes the recorded frames into a
+  ring, a writer thread drains it to a WAV file in STREAM_BLOCK writes
+  The header leaves room for ds64, the file becomes RF64 past 4 GB
+  Take boundaries travel on a second ring, in order with the frames
+*/
+struct stream
+{
+	struct ringbuffer samples;
+	struct ringbuffer events;
+	sem_t sem;
+	pthread_t thread;
+	atomic_int running;
+	const char *tag;
+	unsigned long srate;
+	unsigned int nchannels;
+	enum sample_format format;
+
+	// JACK thread only
+	size_t take_frames;
+	jack_default_audio_sample_t *scratch;
+
+	// statistics for the current take, written by the JACK thread
+	atomic_size_t high_water;
+	atomic_size_t overruns;
+};
+
+int stream_start(struct stream *s, const char *tag, unsigned long srate, unsigned int nchannels,
+		 enum sample_format format);
+void stream_stop(struct stream *s);
+
+void stream_begin(struct stream *s);
+void stream_push(struct stream *s, jack_default_audio_sample_t **bufs, jack_nframes_t offset, jack_nframes_t n);
+void stream_end(struct stream *s);
+
+#endif // STREAM_H
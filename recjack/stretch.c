@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <jack/jack.h>
+
+#include "convert.h"
+#include "memory.h"
+#include "stretch.h"
+
+// input kept by the worker, the segments it chooses from and the last one
+#define STRETCH_INPUT (4 * STRETCH_WINDOW)
+// frames of the end of a segment compared with the candidates for the next one
+#define STRETCH_OVERLAP (STRETCH_WINDOW - STRETCH_HOP)
+
+/*
+  State of the worker
+  Frames are counted from the last restart, in[k][0] is frame base
+*/
+struct wsola
+{
+	jack_default_audio_sample_t *in[MAX_CHANNELS];
+	// sum of the channels, the segments are matched on it
+	jack_default_audio_sample_t *mix;
+	size_t base;
+	size_t frames;
+	// where the speed puts the next segment, and where the last one started
+	double next;
+	size_t last;
+	char started;
+	// overlap-add of the segments, the first STRETCH_HOP frames are complete
+	jack_default_audio_sample_t *acc[MAX_CHANNELS];
+	float window[STRETCH_WINDOW];
+	jack_default_audio_sample_t *scratch;
+	unsigned int seq;
+};
+
+static void wsola_free(struct wsola *w, unsigned int nchannels)
+{
+	unsigned int k;
+
+	for (k = 0; k < nchannels; k++) {
+		free(w->in[k]);
+		free(w->acc[k]);
+	}
+	free(w->mix);
+	free(w->scratch);
+	free(w);
+}
+
+static struct wsola *wsola_new(unsigned int nchannels)
+{
+	struct wsola *w = calloc(1, sizeof(struct wsola));
+	unsigned int i, k;
+
+	if (w == NULL)
+		return NULL;
+	for (k = 0; k < nchannels; k++) {
+		w->in[k] = malloc(STRETCH_INPUT * sizeof(jack_default_audio_sample_t));
+		w->acc[k] = calloc(STRETCH_WINDOW, sizeof(jack_default_audio_sample_t));
+		if (w->in[k] == NULL || w->acc[k] == NULL) {
+			wsola_free(w, nchannels);
+			return NULL;
+		}
+	}
+	w->mix = malloc(STRETCH_INPUT * sizeof(jack_default_audio_sample_t));
+	w->scratch = malloc(STRETCH_SCRATCH_FRAMES * nchannels * sizeof(jack_default_audio_sample_t));
+	if (w->mix == NULL || w->scratch == NULL) {
+		wsola_free(w, nchannels);
+		return NULL;
+	}
+	// periodic Hann window: two of them half a window apart add up to 1
+	for (i = 0; i < STRETCH_WINDOW; i++)
+		w->window[i] = (float) (0.5 - 0.5 * cos(2 * M_PI * i / STRETCH_WINDOW));
+	return w;
+}
+
+// drop the input and start again from the next frame pushed
+static void wsola_reset(struct stretch *s, struct wsola *w)
+{
+	size_t frame = s->nchannels * sizeof(jack_default_audio_sample_t);
+	unsigned int k;
+
+	while (ringbuffer_read(&s->input, w->scratch, STRETCH_SCRATCH_FRAMES * frame) > 0)
+		;
+	for (k = 0; k < s->nchannels; k++)
+		memset(w->acc[k], 0, STRETCH_WINDOW * sizeof(jack_default_audio_sample_t));
+	w->base = 0;
+	w->frames = 0;
+	w->next = 0;
+	w->last = 0;
+	w->started = 0;
+}
+
+/*
+  Read the input up to frame end
+  Returns -1 if the JACK thread hasn't pushed that far yet, what was
+  read is kept
+*/
+static int wsola_fill(struct stretch *s, struct wsola *w, size_t end)
+{
+	size_t frame = s->nchannels * sizeof(jack_default_audio_sample_t);
+	size_t n, i;
+	unsigned int k;
+
+	while (w->base + w->frames < end) {
+		n = end - w->base - w->frames;
+		if (n > STRETCH_SCRATCH_FRAMES)
+			n = STRETCH_SCRATCH_FRAMES;
+		n = ringbuffer_read(&s->input, w->scratch, n * frame) / frame;
+		if (n == 0)
+			return -1;
+		for (i = 0; i < n; i++) {
+			float sum = 0;
+			for (k = 0; k < s->nchannels; k++) {
+				w->in[k][w->frames + i] = w->scratch[i * s->nchannels + k];
+				sum += w->scratch[i * s->nchannels + k];
+			}
+			w->mix[w->frames + i] = sum;
+		}
+		w->frames += n;
+	}
+	return 0;
+}
+
+/*
+  The candidate between lo and hi that continues the last segment best:
+  the highest correlation with the frames that followed it, normalized
+  by the energy of the candidate
+  The energy slides along with the candidate, one correlation per
+  candidate is left, with the vector kernel
+*/
+static size_t wsola_search(struct wsola *w, size_t lo, size_t hi)
+{
+	const jack_default_audio_sample_t *t = w->mix + w->last + STRETCH_HOP - w->base;
+	const jack_default_audio_sample_t *x = w->mix + lo - w->base;
+	double energy = correlate(x, x, STRETCH_OVERLAP), best = -INFINITY;
+	size_t c, p = lo;
+
+	for (c = lo; c <= hi; c++, x++) {
+		double score = correlate(t, x, STRETCH_OVERLAP) / sqrt(energy > 1e-9 ? energy : 1e-9);
+		if (score > best) {
+			best = score;
+			p = c;
+		}
+		energy += (double) x[STRETCH_OVERLAP] * x[STRETCH_OVERLAP] - (double) x[0] * x[0];
+	}
+	return p;
+}
+
+/*
+  Add the next segment and send STRETCH_HOP frames to the JACK thread
+  The worker stays two periods ahead of the JACK thread, no more, so
+  that a change of speed is heard at once
+  Returns -1 if there's nothing to do until the JACK thread runs again
+*/
+static int wsola_hop(struct stretch *s, struct wsola *w)
+{
+	size_t frame = s->nchannels * sizeof(jack_default_audio_sample_t);
+	size_t ahead = 2 * atomic_load_explicit(&s->period, memory_order_relaxed) + STRETCH_HOP;
+	double speed = atomic_load_explicit(&s->speed, memory_order_relaxed) / 100.0;
+	double a = w->next;
+	size_t lo = 0, hi = 0, from = 0, p, keep, i;
+	unsigned int k;
+
+	if (ringbuffer_read_space(&s->output) >= ahead * frame
+	    || ringbuffer_write_space(&s->output) < STRETCH_HOP * frame
+	    || ringbuffer_write_space(&s->marks) < sizeof(size_t))
+		return -1;
+	if (w->started) {
+		lo = a > STRETCH_TOLERANCE ? (size_t) (a - STRETCH_TOLERANCE) : 0;
+		hi = (size_t) a + STRETCH_TOLERANCE;
+		from = w->last + STRETCH_HOP;
+	}
+	if (wsola_fill(s, w, (hi > from ? hi : from) + STRETCH_WINDOW) != 0)
+		return -1;
+	p = w->started ? wsola_search(w, lo, hi) : 0;
+
+	for (k = 0; k < s->nchannels; k++) {
+		const jack_default_audio_sample_t *x = w->in[k] + p - w->base;
+		jack_default_audio_sample_t *acc = w->acc[k];
+		for (i = 0; i < STRETCH_WINDOW; i++)
+			acc[i] += w->window[i] * x[i];
+		for (i = 0; i < STRETCH_HOP; i++)
+			w->scratch[i * s->nchannels + k] = acc[i];
+		memmove(acc, acc + STRETCH_HOP, STRETCH_OVERLAP * sizeof(jack_default_audio_sample_t));
+		memset(acc + STRETCH_OVERLAP, 0, STRETCH_HOP * sizeof(jack_default_audio_sample_t));
+	}
+	// the mark first: the JACK thread finds it once it reads the frames
+	ringbuffer_write(&s->marks, &p, sizeof(size_t));
+	ringbuffer_write(&s->output, w->scratch, STRETCH_HOP * frame);
+
+	w->last = p;
+	w->next = a + STRETCH_HOP * speed;
+	w->started = 1;
+
+	// the next search only looks from there
+	keep = w->next > STRETCH_TOLERANCE ? (size_t) (w->next - STRETCH_TOLERANCE) : 0;
+	if (keep > w->last + STRETCH_HOP)
+		keep = w->last + STRETCH_HOP;
+	if (keep > w->base) {
+		size_t drop = keep - w->base;
+		for (k = 0; k < s->nchannels; k++)
+			memmove(w->in[k], w->in[k] + drop, (w->frames - drop) * sizeof(jack_default_audio_sample_t));
+		memmove(w->mix, w->mix + drop, (w->frames - drop) * sizeof(jack_default_audio_sample_t));
+		w->base = keep;
+		w->frames -= drop;
+	}
+	return 0;
+}
+
+/*
+  Worker thread
+  Woken up by the JACK thread each time it pushes or plays frames
+*/
+static void *stretch_worker(void *arg)
+{
+	struct stretch *s = (struct stretch *) arg;
+	struct wsola *w = s->w;
+	unsigned int seq;
+
+	while (1) {
+		sem_wait(&s->sem);
+		if (!atomic_load(&s->running))
+			break;
+		seq = atomic_load_explicit(&s->requested, memory_order_acquire);
+		if (seq != w->seq) {
+			wsola_reset(s, w);
+			w->seq = seq;
+			atomic_store_explicit(&s->acked, seq, memory_order_release);
+		}
+		while (atomic_load_explicit(&s->requested, memory_order_relaxed) == w->seq && wsola_hop(s, w) == 0)
+			;
+	}
+	return NULL;
+}
+
+/*
+  Allocate the rings and the worker state, and start the worker thread
+*/
+int stretch_start(struct stretch *s, unsigned int nchannels)
+{
+	size_t frame = nchannels * sizeof(jack_default_audio_sample_t);
+	unsigned int k;
+
+	memset(s, 0, sizeof(struct stretch));
+	s->nchannels = nchannels;
+	s->fade_pos = STRETCH_FADE_FRAMES;
+	atomic_init(&s->speed, SPEED_NORMAL);
+	s->scratch = malloc(STRETCH_SCRATCH_FRAMES * frame);
+	s->feed[0] = malloc(STRETCH_SCRATCH_FRAMES * frame);
+	if (s->scratch == NULL || s->feed[0] == NULL)
+		return -1;
+	// the JACK thread touches these, they must not fault there
+	prefault(s->scratch, STRETCH_SCRATCH_FRAMES * frame);
+	prefault(s->feed[0], STRETCH_SCRATCH_FRAMES * frame);
+	for (k = 1; k < nchannels; k++)
+		s->feed[k] = s->feed[0] + k * STRETCH_SCRATCH_FRAMES;
+	if (ringbuffer_init(&s->input, STRETCH_RING_FRAMES * frame) != 0)
+		return -1;
+	if (ringbuffer_init(&s->output, STRETCH_RING_FRAMES * frame) != 0)
+		return -1;
+	if (ringbuffer_init(&s->marks, STRETCH_RING_FRAMES / STRETCH_HOP * sizeof(size_t)) != 0)
+		return -1;
+	s->w = wsola_new(nchannels);
+	if (s->w == NULL)
+		return -1;
+	sem_init(&s->sem, 0, 0);
+	atomic_store(&s->running, 1);
+	if (pthread_create(&s->thread, NULL, stretch_worker, s) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+  Stop the worker thread
+  Must be called once the JACK thread doesn't play anything anymore
+*/
+void stretch_stop(struct stretch *s)
+{
+	atomic_store(&s->running, 0);
+	sem_post(&s->sem);
+	pthread_join(s->thread, NULL);
+	sem_destroy(&s->sem);
+	wsola_free(s->w, s->nchannels);
+	ringbuffer_free(&s->input);
+	ringbuffer_free(&s->output);
+	ringbuffer_free(&s->marks);
+	free(s->feed[0]);
+	free(s->scratch);
+}
+
+// read up to n frames from the output ring into bufs, at offset
+static jack_nframes_t stretch_read(struct stretch *s, jack_default_audio_sample_t **bufs, jack_nframes_t offset,
+				   jack_nframes_t n)
+{
+	size_t frame = s->nchannels * sizeof(jack_default_audio_sample_t);
+	jack_nframes_t done = 0, len, i;
+	unsigned int k;
+
+	while (done < n) {
+		len = n - done < STRETCH_SCRATCH_FRAMES ? n - done : STRETCH_SCRATCH_FRAMES;
+		len = (jack_nframes_t) (ringbuffer_read(&s->output, s->scratch, len * frame) / frame);
+		if (len == 0)
+			break;
+		if (bufs != NULL)
+			for (k = 0; k < s->nchannels; k++)
+				for (i = 0; i < len; i++)
+					bufs[k][offset + done + i] = s->scratch[i * s->nchannels + k];
+		done += len;
+	}
+
+	// the mark of each hop that started playing
+	s->played += done;
+	while (s->hops * STRETCH_HOP < s->played) {
+		if (ringbuffer_read(&s->marks, &s->mark, sizeof(size_t)) == 0)
+			break;
+		s->hops++;
+	}
+	return done;
+}
+
+/*
+  Once the worker acknowledged the last restart, drop what it produced
+  before: nothing has been pushed since, nothing after it is there yet
+*/
+static void stretch_settle(struct stretch *s)
+{
+	if (s->flushing
+	    && atomic_load_explicit(&s->acked, memory_order_acquire) == atomic_load(&s->requested)) {
+		stretch_read(s, NULL, 0, STRETCH_RING_FRAMES);
+		while (ringbuffer_read(&s->marks, &s->mark, sizeof(size_t)) > 0)
+			;
+		s->played = 0;
+		s->hops = 0;
+		s->mark = 0;
+		s->flushing = 0;
+	}
+}
+
+/*
+  JACK thread: playback jumps, the worker starts again from the next
+  frame pushed
+  With fade, the frames that were about to be played are faded out over
+  the first frames played after the jump
+*/
+void stretch_restart(struct stretch *s, int fade)
+{
+	jack_default_audio_sample_t *tail[MAX_CHANNELS];
+	jack_nframes_t got = 0;
+	unsigned int k;
+
+	stretch_settle(s);
+	s->fade_pos = STRETCH_FADE_FRAMES;
+	if (fade && !s->flushing) {
+		for (k = 0; k < s->nchannels; k++)
+			tail[k] = s->fade + k * STRETCH_FADE_FRAMES;
+		got = stretch_read(s, tail, 0, STRETCH_FADE_FRAMES);
+		for (k = 0; k < s->nchannels; k++)
+			memset(tail[k] + got, 0, (STRETCH_FADE_FRAMES - got) * sizeof(jack_default_audio_sample_t));
+		s->fade_pos = 0;
+	}
+	atomic_store_explicit(&s->requested, atomic_load(&s->requested) + 1, memory_order_release);
+	s->flushing = 1;
+	s->pushed = 0;
+	sem_post(&s->sem);
+}
+
+/*
+  JACK thread: how many frames of the take to push this period, to
+  keep the worker busy for the next two periods of n frames
+  None until the worker acknowledged the last restart
+*/
+jack_nframes_t stretch_wants(struct stretch *s, jack_nframes_t n)
+{
+	size_t frame = s->nchannels * sizeof(jack_default_audio_sample_t);
+	size_t speed = atomic_load_explicit(&s->speed, memory_order_relaxed);
+	size_t target = 2 * n * speed / 100 + 2 * STRETCH_WINDOW;
+	size_t have = ringbuffer_read_space(&s->input) / frame;
+	size_t space = ringbuffer_write_space(&s->input) / frame;
+
+	stretch_settle(s);
+	if (s->flushing || have >= target)
+		return 0;
+	return (jack_nframes_t) (target - have < space ? target - have : space);
+}
+
+/*
+  JACK thread: queue frames of the take for the worker, interleaved on
+  the way like the stream does
+*/
+void stretch_push(struct stretch *s, jack_default_audio_sample_t **bufs, jack_nframes_t offset, jack_nframes_t n)
+{
+	size_t frame = s->nchannels * sizeof(jack_default_audio_sample_t);
+	jack_nframes_t done, len, i;
+	unsigned int k;
+
+	for (done = 0; done < n; done += len) {
+		len = n - done < STRETCH_SCRATCH_FRAMES ? n - done : STRETCH_SCRATCH_FRAMES;
+		for (k = 0; k < s->nchannels; k++)
+			for (i = 0; i < len; i++)
+				s->scratch[i * s->nchannels + k] = bufs[k][offset + done + i];
+		ringbuffer_write(&s->input, s->scratch, len * frame);
+	}
+	s->pushed += n;
+	sem_post(&s->sem);
+}
+
+/*
+  JACK thread: play n frames produced by the worker at offset in bufs,
+  silence if it hasn't produced them yet
+  Returns the number of frames the worker had produced
+*/
+jack_nframes_t stretch_pull(struct stretch *s, jack_default_audio_sample_t **bufs, jack_nframes_t offset,
+			    jack_nframes_t n)
+{
+	jack_nframes_t got = 0, len, i;
+	unsigned int k;
+
+	atomic_store_explicit(&s->period, n, memory_order_relaxed);
+	stretch_settle(s);
+	if (!s->flushing)
+		got = stretch_read(s, bufs, offset, n);
+	for (k = 0; k < s->nchannels; k++)
+		memset(bufs[k] + offset + got, 0, (n - got) * sizeof(jack_default_audio_sample_t));
+
+	// crossfade with what was about to be played before the last jump
+	len = STRETCH_FADE_FRAMES - s->fade_pos;
+	if (len > n)
+		len = n;
+	for (k = 0; k < s->nchannels; k++) {
+		jack_default_audio_sample_t *o = bufs[k] + offset;
+		const jack_default_audio_sample_t *f = s->fade + k * STRETCH_FADE_FRAMES + s->fade_pos;
+		for (i = 0; i < len; i++) {
+			float g = (float) (s->fade_pos + i + 1) / (STRETCH_FADE_FRAMES + 1);
+			o[i] = g * o[i] + (1 - g) * f[i];
+		}
+	}
+	s->fade_pos += len;
+
+	sem_post(&s->sem);
+	return got;
+}
+
+/*
+  JACK thread: frames of the take between the one being heard and the
+  next one to be pushed
+*/
+size_t stretch_lag(struct stretch *s)
+{
+	size_t heard = s->hops > 0 ? s->mark + (s->played - (s->hops - 1) * STRETCH_HOP) : 0;
+
+	return s->pushed > heard ? s->pushed - heard : 0;
+}
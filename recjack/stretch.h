@@ -0,0 +1,90 @@
+#ifndef STRETCH_H
+#define STRETCH_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <jack/jack.h>
+
+#include "ringbuffer.h"
+#include "buffer.h"
+
+// frames of a segment, each one overlaps the next one by half
+#define STRETCH_WINDOW 1024
+#define STRETCH_HOP (STRETCH_WINDOW / 2)
+// a segment may start this far from where the speed puts it
+#define STRETCH_TOLERANCE (STRETCH_WINDOW / 4)
+// room in each ring, more than the longest JACK period
+#define STRETCH_RING_FRAMES 16384
+#define STRETCH_SCRATCH_FRAMES 1024
+// what was about to be played is faded out over this many frames on a jump
+#define STRETCH_FADE_FRAMES 256
+// playback speed, in percent
+#define SPEED_NORMAL 100
+#define SPEED_MIN 50
+#define SPEED_MAX 150
+#define SPEED_STEP 5
+
+struct wsola;
+
+/*
+  Variable speed playback that keeps the pitch, by WSOLA: segments of
+  the take are overlapped every STRETCH_HOP frames, taken further apart
+  or closer together than that, each one where it matches the end of
+  the previous one best
+  The JACK thread pushes the frames of the take into a ring, a worker
+  thread stretches them into another ring, the JACK thread plays them:
+  it only copies to and from the rings
+  On a jump, the JACK thread counts a restart in requested and stops
+  pushing, the worker drops its input and acknowledges it in acked,
+  then the JACK thread drops what was produced before that
+  With each STRETCH_HOP frames of output, the worker sends the frame of
+  the input they were taken from, so that the JACK thread knows what is
+  being heard
+*/
+struct stretch
+{
+	struct ringbuffer input;
+	struct ringbuffer output;
+	struct ringbuffer marks;
+	sem_t sem;
+	pthread_t thread;
+	atomic_int running;
+	unsigned int nchannels;
+	// speed in percent, and frames played per period, set by the JACK thread
+	atomic_uint speed;
+	atomic_uint period;
+	atomic_uint requested;
+	atomic_uint acked;
+
+	// JACK thread only
+	char flushing;
+	jack_default_audio_sample_t *scratch;
+	// planar frames of the take, on their way to the input ring
+	jack_default_audio_sample_t *feed[MAX_CHANNELS];
+	jack_default_audio_sample_t fade[MAX_CHANNELS * STRETCH_FADE_FRAMES];
+	jack_nframes_t fade_pos;
+	// frames pushed and played since the last restart, and where the
+	// hop being played starts in the input
+	size_t pushed;
+	size_t played;
+	size_t hops;
+	size_t mark;
+
+	// worker only
+	struct wsola *w;
+};
+
+int stretch_start(struct stretch *s, unsigned int nchannels);
+void stretch_stop(struct stretch *s);
+
+void stretch_restart(struct stretch *s, int fade);
+jack_nframes_t stretch_wants(struct stretch *s, jack_nframes_t n);
+void stretch_push(struct stretch *s, jack_default_audio_sample_t **bufs, jack_nframes_t offset, jack_nframes_t n);
+jack_nframes_t stretch_pull(struct stretch *s, jack_default_audio_sample_t **bufs, jack_nframes_t offset,
+			    jack_nframes_t n);
+size_t stretch_lag(struct stretch *s);
+
+#endif // STRETCH_H
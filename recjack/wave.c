@@ -1,55 +1,377 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <jack/jack.h>
 
 #include "recjack.h"
 #include "wave.h"
+#include "convert.h"
 
-ssize_t write_wave_header(int fd, unsigned long srate, size_t wave_size)
+// the header fields are in host order, like the chunk ids
+static uint8_t *put16(uint8_t *p, uint16_t v)
 {
-	struct wave_header h;
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
 
-	uint32_t wsize = (uint32_t) wave_size * (DEPTH / 8);
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
 
-	h.chunkid = HEADER_RIFF;
-	h.chunksize = HEADER_LENGTH + wsize;
-	h.format = HEADER_WAVE;
-	h.fmtchunkid = HEADER_FMT;
-	h.fmtchunksize = 16;
-	h.audiofmt = 1;
-	h.nchannels = 1;
-	h.srate = (uint32_t) srate;
-	h.brate = h.srate * h.nchannels * DEPTH / 8;
-	h.balign = h.nchannels * DEPTH / 8;
-	h.bps = DEPTH;
-	h.datachunkid = HEADER_DATA;
-	h.datachunksize = wsize;
+static uint8_t *put64(uint8_t *p, uint64_t v)
+{
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
 
-	return write(fd, &h, HEADER_LENGTH);
+static uint16_t get16(const char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
 }
 
-int write_wave_samples(int fd, size_t wave_size, char *buf)
+static uint32_t get32(const char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t get64(const char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+  Header of a WAV file holding frames frames
+  With ds64 set, the header has room for a ds64 chunk: the file is RF64
+  if the data doesn't fit in 32-bit sizes, otherwise a JUNK chunk holds
+  the place, so that a file whose final size isn't known yet can become
+  RF64 by rewriting the header
+  Returns the length of the header
+*/
+size_t fill_wave_header(void *buf, unsigned long srate, unsigned int nchannels, enum sample_format format,
+			size_t frames, int ds64)
+{
+	unsigned int bytes = (unsigned int) sample_bytes(format);
+	uint64_t data = (uint64_t) frames * nchannels * bytes;
+	size_t length = ds64 ? HEADER_LENGTH_DS64 : HEADER_LENGTH;
+	int rf64 = ds64 && data > WAVE_MAX_DATA;
+	uint8_t *p = buf;
+
+	p = put32(p, rf64 ? HEADER_RF64 : HEADER_RIFF);
+	p = put32(p, rf64 ? UINT32_MAX : (uint32_t) (length - 8 + data));
+	p = put32(p, HEADER_WAVE);
+	if (ds64) {
+		p = put32(p, rf64 ? HEADER_DS64 : HEADER_JUNK);
+		p = put32(p, 28);
+		p = put64(p, rf64 ? length - 8 + data : 0);
+		p = put64(p, rf64 ? data : 0);
+		p = put64(p, rf64 ? frames : 0);
+		// no table of other chunk sizes
+		p = put32(p, 0);
+	}
+	p = put32(p, HEADER_FMT);
+	p = put32(p, 16);
+	p = put16(p, format == SAMPLE_F32 ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM);
+	p = put16(p, (uint16_t) nchannels);
+	p = put32(p, (uint32_t) srate);
+	p = put32(p, (uint32_t) (srate * nchannels * bytes));
+	p = put16(p, (uint16_t) (nchannels * bytes));
+	p = put16(p, (uint16_t) (bytes * 8));
+	p = put32(p, HEADER_DATA);
+	put32(p, rf64 ? UINT32_MAX : (uint32_t) data);
+
+	return length;
+}
+
+// size of the file save_wave writes
+size_t wave_file_size(size_t frames, unsigned int nchannels, enum sample_format format)
 {
-	// convert from floats to DEPTH integers and write
-	unsigned int i, offset;
-	unsigned short blen = 1024;
-	uint16_t *tmp = malloc(blen * sizeof(uint16_t));
-	jack_default_audio_sample_t *samples = (jack_default_audio_sample_t *) buf;
-
-	for (offset = 0; offset < wave_size; offset += blen) {
-		for (i = 0; i < blen && i < (wave_size - offset); i++)
-			tmp[i] = (uint16_t) (DEPTH_MAX * samples[i + offset]);
-		if (wave_size < (offset + blen))
-			blen = (unsigned short) (wave_size - offset);
-		if (write(fd, tmp, blen * sizeof(uint16_t)) < 0) {
-			perror("write failed");
-			free(tmp);
+	size_t data = frames * nchannels * sample_bytes(format);
+
+	return (data > WAVE_MAX_DATA ? HEADER_LENGTH_DS64 : HEADER_LENGTH) + data;
+}
+
+ssize_t write_wave_header(int fd, unsigned long srate, unsigned int nchannels, size_t wave_size)
+{
+	uint8_t h[HEADER_LENGTH];
+
+	fill_wave_header(h, srate, nchannels, SAMPLE_S16, wave_size, 0);
+	return write(fd, h, HEADER_LENGTH);
+}
+
+/*
+  Batched writer: the converted samples are gathered in a large buffer,
+  so that the file is written in WRITE_FRAMES blocks
+*/
+void wave_writer_init(struct wave_writer *w, int fd)
+{
+	w->fd = fd;
+	w->fill = 0;
+}
+
+int wave_writer_flush(struct wave_writer *w)
+{
+	if (w->fill > 0 && write(w->fd, w->buf, w->fill * sizeof(int16_t)) < 0) {
+		perror("write failed");
+		return -1;
+	}
+	w->fill = 0;
+	return 0;
+}
+
+int wave_writer_add(struct wave_writer *w, const jack_default_audio_sample_t *samples, size_t n)
+{
+	while (n > 0) {
+		size_t len = WRITE_FRAMES - w->fill;
+		if (len > n)
+			len = n;
+		convert_samples(w->buf + w->fill, samples, len);
+		w->fill += len;
+		samples += len;
+		n -= len;
+		if (w->fill == WRITE_FRAMES && wave_writer_flush(w) != 0)
 			return -1;
+	}
+	return 0;
+}
+
+int write_wave_samples(int fd, size_t wave_size, char *buf)
+{
+	struct wave_writer w;
+
+	wave_writer_init(&w, fd);
+	if (wave_writer_add(&w, (jack_default_audio_sample_t *) buf, wave_size) != 0)
+		return -1;
+	return wave_writer_flush(&w);
+}
+
+/*
+  Interleave the planar channels of a chunk and convert them
+  The chunk is processed in blocks small enough to stay in the cache
+*/
+static char *interleave_chunk(char *data, struct buffer *b, struct chunk *c, enum sample_format format)
+{
+	jack_default_audio_sample_t tmp[INTERLEAVE_FRAMES * MAX_CHANNELS];
+	jack_nframes_t off, i, len;
+	unsigned int k, nch = b->nchannels;
+
+	if (nch == 1)
+		return convert_format(data, c->buf + c->start, c->frames - c->start, format);
+
+	for (off = c->start; off < c->frames; off += len) {
+		len = c->frames - off;
+		if (len > INTERLEAVE_FRAMES)
+			len = INTERLEAVE_FRAMES;
+		for (k = 0; k < nch; k++) {
+			const jack_default_audio_sample_t *src = CHUNK_CHANNEL(b, c, k) + off;
+			for (i = 0; i < len; i++)
+				tmp[i * nch + k] = src[i];
 		}
+		data = convert_format(data, tmp, len * nch, format);
+	}
+	return data;
+}
+
+/*
+  Convert a mapped file to another format, it is already interleaved
+*/
+static void convert_map(char *data, const struct wave_map *m, enum sample_format format)
+{
+	jack_default_audio_sample_t tmp[INTERLEAVE_FRAMES * MAX_CHANNELS];
+	size_t n = m->frames * m->nchannels, bytes = sample_bytes(m->format), off, len;
+
+	for (off = 0; off < n; off += len) {
+		len = n - off < INTERLEAVE_FRAMES * MAX_CHANNELS ? n - off : INTERLEAVE_FRAMES * MAX_CHANNELS;
+		samples_to_float(tmp, m->data + off * bytes, m->format, 1, len);
+		data = convert_format(data, tmp, len, format);
 	}
+}
+
+/*
+  Export a take: the file is sized up front and mapped, and the samples
+  are converted straight into the mapped data chunk
+  The blocks are allocated before the file is mapped: a full disk is an
+  error here rather than a SIGBUS while the samples are written, and
+  the write errors are collected before the mapping goes away
+  Beyond 4 GB of samples, the file is RF64
+  fd must be open for reading and writing
+*/
+int save_wave(int fd, struct buffer *b, enum sample_format format)
+{
+	unsigned int nchannels = b->map != NULL ? b->map->nchannels : b->nchannels;
+	size_t length = wave_file_size(b->frames, nchannels, format);
+	size_t header = length - b->frames * nchannels * sample_bytes(format);
+	char *data, *addr;
+	int err;
+
+	if (ftruncate(fd, (off_t) length) != 0) {
+		perror("ftruncate failed");
+		return -1;
+	}
+	err = posix_fallocate(fd, 0, (off_t) length);
+	if (err != 0) {
+		errno = err;
+		perror("posix_fallocate failed");
+		return -1;
+	}
+	addr = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap failed");
+		return -1;
+	}
+	madvise(addr, length, MADV_SEQUENTIAL);
+
+	fill_wave_header(addr, b->srate, nchannels, format, b->frames, header == HEADER_LENGTH_DS64);
+	data = addr + header;
+	if (b->map != NULL && b->map->format == format) {
+		// a loaded file is saved as it is
+		memcpy(data, b->map->data, length - header);
+	} else if (b->map != NULL) {
+		convert_map(data, b->map, format);
+	} else {
+		struct chunk *c;
+		for (c = b->head; c != NULL; c = c->next)
+			data = interleave_chunk(data, b, c, format);
+	}
+
+	if (msync(addr, length, MS_SYNC) != 0) {
+		perror("msync failed");
+		munmap(addr, length);
+		return -1;
+	}
+	return munmap(addr, length);
+}
+
+/*
+  Map a WAV or RF64 file in memory
+  16-bit, 24-bit and float PCM files are supported
+  Returns 0 on success, -1 if the file can't be read or isn't supported
+*/
+int wave_map_open(struct wave_map *m, const char *filename)
+{
+	struct stat st;
+	const char *p, *end, *fmt = NULL;
+	uint64_t ds64_data = 0;
+	unsigned int audiofmt, bps;
+	int fd;
+
+	memset(m, 0, sizeof(struct wave_map));
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror(filename);
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < HEADER_LENGTH) {
+		fprintf(stderr, "%s: not a WAV file\n", filename);
+		close(fd);
+		return -1;
+	}
+	m->length = (size_t) st.st_size;
+	m->addr = mmap(NULL, m->length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m->addr == MAP_FAILED) {
+		perror("mmap failed");
+		return -1;
+	}
+
+	p = m->addr;
+	end = p + m->length;
+	if ((get32(p) != HEADER_RIFF && get32(p) != HEADER_RF64) || get32(p + 8) != HEADER_WAVE)
+		goto invalid;
+
+	// walk the chunks, looking for the format and the samples
+	for (p += 12; p + 8 <= end; p += 8 + ((get32(p + 4) + 1) & ~1U)) {
+		uint32_t id = get32(p);
+		uint64_t size = get32(p + 4);
+		if (id == HEADER_DS64 && size >= 28 && p + 8 + 28 <= end) {
+			// the 64-bit sizes of an RF64 file
+			ds64_data = get64(p + 16);
+		} else if (id == HEADER_FMT && size >= 16 && p + 24 <= end) {
+			fmt = p + 8;
+		} else if (id == HEADER_DATA) {
+			if (size == UINT32_MAX && ds64_data > 0)
+				size = ds64_data;
+			// a file that wasn't closed properly may have a wrong size
+			if (size > (uint64_t) (end - p - 8))
+				size = (uint64_t) (end - p - 8);
+			m->data = p + 8;
+			m->frames = (size_t) size;
+			break;
+		}
+	}
+	if (fmt == NULL || m->data == NULL)
+		goto invalid;
+	audiofmt = get16(fmt);
+	m->nchannels = get16(fmt + 2);
+	m->srate = get32(fmt + 4);
+	bps = get16(fmt + 14);
+	if (audiofmt == WAVE_FORMAT_PCM && bps == 16)
+		m->format = SAMPLE_S16;
+	else if (audiofmt == WAVE_FORMAT_PCM && bps == 24)
+		m->format = SAMPLE_S24;
+	else if (audiofmt == WAVE_FORMAT_IEEE_FLOAT && bps == 32)
+		m->format = SAMPLE_F32;
+	else
+		m->nchannels = 0;
+	if (m->nchannels == 0) {
+		fprintf(stderr, "%s: only 16-bit, 24-bit and float PCM files are supported\n", filename);
+		wave_map_close(m);
+		return -1;
+	}
+	m->frames /= m->nchannels * sample_bytes(m->format);
+	madvise(m->addr, m->length, MADV_SEQUENTIAL);
 
-	free(tmp);
 	return 0;
+
+invalid:
+	fprintf(stderr, "%s: not a WAV file\n", filename);
+	wave_map_close(m);
+	return -1;
+}
+
+void wave_map_close(struct wave_map *m)
+{
+	if (m->addr != NULL && m->addr != MAP_FAILED)
+		munmap(m->addr, m->length);
+	m->addr = NULL;
+	m->data = NULL;
+	m->frames = 0;
+}
+
+/*
+  Have the kernel read n frames of a mapped file from frame on, in the
+  background, so that the audio thread finds them in memory rather than
+  waiting for the disk: MADV_SEQUENTIAL alone doesn't follow seeks, and
+  is only a hint
+*/
+void wave_map_prefetch(const struct wave_map *m, size_t frame, size_t n)
+{
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t bytes = m->nchannels * sample_bytes(m->format);
+	size_t start, end;
+
+	if (m->addr == NULL || frame >= m->frames)
+		return;
+	if (n > m->frames - frame)
+		n = m->frames - frame;
+	start = (size_t) (m->data - (const char *) m->addr) + frame * bytes;
+	end = start + n * bytes;
+	start -= start % page;
+	madvise((char *) m->addr + start, end - start, MADV_WILLNEED);
 }
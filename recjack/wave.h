@@ -1,37 +1,74 @@
 #ifndef WAVE_H
 #define WAVE_H
 
+#include <stdint.h>
+
+#include <jack/jack.h>
+
+#include "convert.h"
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define HEADER_RIFF 0x46464952
+#define HEADER_RF64 0x34364652
 #define HEADER_WAVE 0x45564157
+#define HEADER_DS64 0x34367364
+#define HEADER_JUNK 0x4b4e554a
 #define HEADER_FMT  0x20746d66
 #define HEADER_DATA 0x61746164
 #elif __BYTE_ORDER == __BIG_ENDIAN
 #define HEADER_RIFF 0x52494646
+#define HEADER_RF64 0x52463634
 #define HEADER_WAVE 0x57415645
+#define HEADER_DS64 0x64733634
+#define HEADER_JUNK 0x4a554e4b
 #define HEADER_FMT  0x666d7420
 #define HEADER_DATA 0x64617461
 #endif
 
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+
 #define HEADER_LENGTH 44
+// with a ds64 chunk (RF64), or a JUNK chunk holding its place
+#define HEADER_LENGTH_DS64 80
+// larger data needs RF64, the RIFF sizes are 32-bit
+#define WAVE_MAX_DATA ((uint64_t) UINT32_MAX - HEADER_LENGTH_DS64)
 #define DEPTH 16
 #define DEPTH_MAX 32768
+#define WRITE_FRAMES 65536
+#define INTERLEAVE_FRAMES 256
+// a mapped take is read this far ahead of the playback position
+#define READAHEAD_SECONDS 2
 
-struct wave_header
+/*
+  A WAV file mapped in memory, data points to the samples
+*/
+struct wave_map
 {
-	uint32_t chunkid;
-	uint32_t chunksize;
-	uint32_t format;
-	uint32_t fmtchunkid;
-	uint32_t fmtchunksize;
-	uint16_t audiofmt;
-	uint16_t nchannels;
-	uint32_t srate;
-	uint32_t brate;
-	uint16_t balign;
-	uint16_t bps;
-	uint32_t datachunkid;
-	uint32_t datachunksize;
+	void *addr;
+	size_t length;
+	const char *data;
+	enum sample_format format;
+	size_t frames;
+	unsigned long srate;
+	unsigned int nchannels;
 };
 
+struct wave_writer
+{
+	int fd;
+	size_t fill;
+	int16_t buf[WRITE_FRAMES];
+};
+
+size_t fill_wave_header(void *buf, unsigned long srate, unsigned int nchannels, enum sample_format format,
+			size_t frames, int ds64);
+size_t wave_file_size(size_t frames, unsigned int nchannels, enum sample_format format);
+void wave_writer_init(struct wave_writer *w, int fd);
+int wave_writer_add(struct wave_writer *w, const jack_default_audio_sample_t *samples, size_t n);
+int wave_writer_flush(struct wave_writer *w);
+int wave_map_open(struct wave_map *m, const char *filename);
+void wave_map_close(struct wave_map *m);
+void wave_map_prefetch(const struct wave_map *m, size_t frame, size_t n);
+
 #endif // WAVE_H